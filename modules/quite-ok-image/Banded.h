@@ -0,0 +1,234 @@
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <cstring>
+
+#include "RGBValue.h"
+#include "CpuDispatch.h"
+#include "ThreadPool.h"
+#include "Segmented.h"
+#include "BufferPool.h"
+#include "MappedFile.h"
+#include "QOIConverter.h"
+
+using namespace std;
+
+// ----- BANDED FILE CONVERSION -----
+// For images larger than memory: both files are mapped and the image is converted a band of rows at a time,
+// so only a few bands of pixels are ever held. Encoding writes one segment per band (see Segmented.h) and
+// encodes the bands of a round in parallel; decoding reads any QOI stream front to back, carrying the decoder
+// state across band boundaries.
+
+const size_t BAND_PIXELS = 1 << 22; // default band size, 16 MB of pixels
+
+inline uint32_t bandRows(uint32_t rowsPerBand, uint32_t width) {
+    if (rowsPerBand > 0) return rowsPerBand;
+    return (uint32_t)max((size_t)1, BAND_PIXELS / max(width, 1u));
+}
+
+inline uint32_t loadLE32(const uint8_t* in) {
+    return (uint32_t)in[0] | ((uint32_t)in[1] << 8) | ((uint32_t)in[2] << 16) | ((uint32_t)in[3] << 24);
+}
+
+// Length of the data chunks in a QOI file body (everything after the header), without the end marker and
+// seek table. A body without a recognisable end is taken whole; the decoder stops at the last pixel anyway.
+inline size_t qoiDataSize(const uint8_t* body, size_t size) {
+    const uint8_t endMarker[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+    if (size >= 8 && memcmp(body + size - 4, SEEK_TABLE_MAGIC, 4) == 0) {
+        uint64_t trailer = loadBE(body + size - 8, 4) * 16 + 16;
+        if (trailer <= size && memcmp(body + size - trailer, endMarker, 8) == 0) return size - trailer;
+    }
+    if (size >= 8 && memcmp(body + size - 8, endMarker, 8) == 0) return size - 8;
+    return size;
+}
+
+// A bottom-up 24-bit BMP read through a mapping
+struct MappedBMP {
+    MappedFile file;
+    size_t dataOffset = 0;
+    size_t rowPadded = 0;
+    uint32_t width = 0;
+    uint32_t height = 0;
+
+    bool open(const string& filename) {
+        if (!file.openRead(filename) || file.size() < 54 || file.data()[0] != 'B' || file.data()[1] != 'M') {
+            cerr << "Failed to open BMP file." << endl;
+            return false;
+        }
+        const uint8_t* src = file.data();
+        dataOffset = loadLE32(src + 10);
+        width = loadLE32(src + 18);
+        int32_t signedHeight = (int32_t)loadLE32(src + 22);
+        uint16_t bitsPerPixel = src[28] | (src[29] << 8);
+        if (signedHeight <= 0 || bitsPerPixel != 24) {
+            cerr << "Only bottom-up 24-bit BMP files are supported." << endl;
+            return false;
+        }
+        height = (uint32_t)signedHeight;
+        if (width == 0) {
+            cerr << "BMP file has no pixels." << endl;
+            return false;
+        }
+        rowPadded = QOIConverter::bmpRowSize(width);
+        if (dataOffset > file.size() || (file.size() - dataOffset) / rowPadded < height) {
+            cerr << "BMP file is truncated." << endl;
+            return false;
+        }
+        return true;
+    }
+
+    // Image row y, counted from the top
+    const uint8_t* row(size_t y) const {
+        return file.data() + dataOffset + ((size_t)height - 1 - y) * rowPadded;
+    }
+
+    // Lets the OS drop rows [firstRow, lastRow) from memory
+    void release(size_t firstRow, size_t lastRow) {
+        file.release(dataOffset + ((size_t)height - lastRow) * rowPadded, (lastRow - firstRow) * rowPadded);
+    }
+
+    // Rows [firstRow, firstRow + rows) as pixels
+    void readRows(size_t firstRow, size_t rows, RGBValue* out) const {
+        for (size_t r = 0; r < rows; r++)
+            qoiKernels().bgrToRGB(row(firstRow + r), out + r * width, width);
+    }
+};
+
+// BMP -> segmented QOI. rowsPerBand = 0 picks bands of about BAND_PIXELS. The file is written under a temporary
+// name and renamed once complete. Returns false on failure, with no output left behind.
+inline bool encodeFileBanded(const string& bmpPath, const string& qoiPath, uint32_t rowsPerBand = 0,
+                             ThreadPool& pool = ThreadPool::shared()) {
+    MappedBMP bmp;
+    if (!bmp.open(bmpPath)) return false;
+    uint32_t width = bmp.width, height = bmp.height;
+
+    string tmpPath = qoiPath + ".tmp";
+    ofstream file(tmpPath, ios::binary);
+    if (!file) {
+        cerr << "Failed to open QOI file for writing." << endl;
+        return false;
+    }
+    vector<uint8_t> header = {'q', 'o', 'i', 'f'};
+    storeBE(header, width, 4);
+    storeBE(header, height, 4);
+    header.push_back(3); // channels
+    header.push_back(0); // colorspace
+    file.write(reinterpret_cast<const char*>(header.data()), header.size());
+
+    // one band per worker per round, written in order once the round is done
+    uint32_t rows = bandRows(rowsPerBand, width);
+    size_t bands = ((size_t)height + rows - 1) / rows;
+    size_t slots = min(pool.size(), bands);
+    vector<vector<RGBValue>> pixels(slots);
+    vector<vector<uint8_t>> parts(slots);
+    vector<QOISegment> segments;
+    uint64_t byteOffset = 0;
+
+    for (size_t first = 0; first < bands; first += slots) {
+        size_t round = min(slots, bands - first);
+        pool.parallelFor(round, [&](size_t k) {
+            size_t firstRow = (first + k) * rows;
+            size_t bandHeight = min((size_t)rows, (size_t)height - firstRow);
+            BufferPool<RGBValue>::shared().acquire(pixels[k], bandHeight * width);
+            pixels[k].resize(bandHeight * width);
+            bmp.readRows(firstRow, bandHeight, pixels[k].data());
+            BufferPool<uint8_t>::shared().acquire(parts[k], bandHeight * width * 4 + 16);
+            encodeSegment(pixels[k].data(), pixels[k].size(), parts[k]);
+        });
+
+        for (size_t k = 0; k < round; k++) {
+            segments.push_back({byteOffset, (uint64_t)(first + k) * rows * width});
+            file.write(reinterpret_cast<const char*>(parts[k].data()), parts[k].size());
+            byteOffset += parts[k].size();
+        }
+        bmp.release(first * rows, min((first + round) * rows, (size_t)height));
+    }
+    for (size_t k = 0; k < slots; k++) {
+        BufferPool<RGBValue>::shared().release(pixels[k]);
+        BufferPool<uint8_t>::shared().release(parts[k]);
+    }
+
+    const char endMarker[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+    file.write(endMarker, 8);
+    vector<uint8_t> table = serializeSeekTable(segments);
+    file.write(reinterpret_cast<const char*>(table.data()), table.size());
+    file.close();
+    bool ok = (bool)file;
+    if (!ok) cerr << "Failed to write QOI file." << endl;
+    if (ok) {
+        remove(qoiPath.c_str());
+        ok = rename(tmpPath.c_str(), qoiPath.c_str()) == 0;
+    }
+    if (!ok) remove(tmpPath.c_str());
+    return ok;
+}
+
+// QOI -> BMP, any QOI file (a seek table is not needed), standard or extended format. Returns false on failure.
+inline bool decodeFileBanded(const string& qoiPath, const string& bmpPath, uint32_t rowsPerBand = 0) {
+    MappedFile qoi;
+    if (!qoi.openRead(qoiPath) || qoi.size() < 14 || memcmp(qoi.data(), "qoif", 4) != 0) {
+        cerr << "Failed to open QOI file for reading." << endl;
+        return false;
+    }
+    uint32_t width = (uint32_t)loadBE(qoi.data() + 4, 4);
+    uint32_t height = (uint32_t)loadBE(qoi.data() + 8, 4);
+    size_t headerSize = 14;
+    DecodeState state;
+    if (qoi.data()[13] & QOI_EXTENDED_FLAG) {
+        QOIExtension ext;
+        if (qoi.size() < 15 || qoi.size() < 15 + (size_t)qoi.data()[14] || !parseExtension(qoi.data() + 15, qoi.data()[14], ext)) {
+            cerr << "Unsupported QOI extension header." << endl;
+            return false;
+        }
+        if (ext.wideIndexBits) {
+            cerr << "Banded decoding does not support the wide index." << endl;
+            return false;
+        }
+        if (ext.prediction) {
+            cerr << "Banded decoding does not support row prediction." << endl;
+            return false;
+        }
+        headerSize = 15 + qoi.data()[14];
+        state.longRuns = true;
+        state.hash = INDEX_HASHES[ext.indexHash];
+    }
+    const uint8_t* bytes = qoi.data() + headerSize;
+    size_t count = qoiDataSize(bytes, qoi.size() - headerSize);
+
+    size_t rowPadded = QOIConverter::bmpRowSize(width);
+    MappedFile bmp;
+    if (width == 0 || height == 0 || !bmp.create(bmpPath, 54 + rowPadded * height)) {
+        cerr << "Failed to open BMP file for writing." << endl;
+        return false;
+    }
+    QOIConverter::bmpHeader(width, height, bmp.data());
+
+    uint32_t rows = bandRows(rowsPerBand, width);
+    vector<RGBValue> band;
+    BufferPool<RGBValue>::shared().acquire(band, (size_t)min(rows, height) * width);
+    band.resize((size_t)min(rows, height) * width);
+
+    RGBValue index[64];
+    bool complete = true;
+    for (size_t firstRow = 0; firstRow < height && complete; firstRow += rows) {
+        size_t bandHeight = min((size_t)rows, (size_t)height - firstRow);
+        size_t begin = state.byte;
+        size_t decoded = decodeResume(bytes, count, state, index, band.data(), bandHeight * width);
+        if (decoded < bandHeight * width) {
+            cerr << "QOI data ends before the last pixel." << endl;
+            complete = false;
+        }
+
+        uint8_t* bandEnd = bmp.data() + 54 + ((size_t)height - firstRow) * rowPadded;
+        for (size_t r = 0; r < bandHeight; r++) // BMP stores bottom-up
+            qoiKernels().rgbToBGR(&band[r * width], bandEnd - (r + 1) * rowPadded, width);
+
+        bmp.release(54 + ((size_t)height - firstRow - bandHeight) * rowPadded, bandHeight * rowPadded);
+        qoi.release(headerSize + begin, state.byte - begin);
+    }
+    BufferPool<RGBValue>::shared().release(band);
+    return complete;
+}
@@ -0,0 +1,245 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <filesystem>
+#include <functional>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "QOIConverter.h"
+#include "ThreadPool.h"
+#include "Numa.h"
+
+using namespace std;
+
+// ----- NUMA-AWARE BATCH CONVERSION -----
+// Converts many files with one thread pool per NUMA node, every worker pinned to its node's CPUs. A job is read,
+// converted and written by a single worker, so its file data, pixel buffer and QOI buffer are first touched and
+// used on one node only; the per-node buffer pools then keep handing that node's pages back to it. Workers of
+// all nodes pull jobs from one shared counter, which balances nodes without ever moving a job mid-way.
+//
+// The direction follows the input extension: .bmp is encoded to QOI, .qoi is decoded to BMP. Outputs are written
+// to "<output>.tmp", flushed to disk and only then renamed, so a crash or a full disk never leaves a partial
+// file under the output name.
+
+struct ConvertJob {
+    string input;
+    string output;
+};
+
+struct NumaNodeStats {
+    size_t workers = 0;
+    size_t images = 0;
+    size_t failed = 0;
+    size_t pixels = 0;
+    size_t bytesIn = 0;
+    size_t bytesOut = 0;
+    size_t remote = 0;      // jobs that finished on another node's CPU (pinning not honoured)
+    double seconds = 0.0;   // busy time summed over the node's workers
+};
+
+// Outcome of one job, in the order of the job list
+struct ConvertResult {
+    bool ok = false;
+    size_t pixels = 0;
+    size_t bytesIn = 0;
+    size_t bytesOut = 0;
+    double seconds = 0.0;
+};
+
+class BatchConverter {
+private:
+    struct Node {
+        unique_ptr<ThreadPool> pool;
+        NumaNodeStats stats;
+        mutex m;
+    };
+
+    vector<unique_ptr<Node>> m_nodes;
+
+    static bool hasExtension(const string& path, const string& ext) {
+        if (path.size() < ext.size()) return false;
+        string tail = path.substr(path.size() - ext.size());
+        for (auto& c : tail) c = (char)tolower((unsigned char)c);
+        return tail == ext;
+    }
+
+    static size_t fileSize(const string& path) {
+        error_code ec;
+        uintmax_t size = filesystem::file_size(path, ec);
+        return ec ? 0 : (size_t)size;
+    }
+
+    // Flushes a file's data to the device. With isDirectory, the directory entries (a rename) instead.
+    static bool syncPath(const string& path, bool isDirectory = false) {
+#ifdef _WIN32
+        if (isDirectory) return true; // NTFS commits renames with its metadata journal
+        HANDLE file = CreateFileA(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) return false;
+        bool ok = FlushFileBuffers(file) != 0;
+        CloseHandle(file);
+        return ok;
+#else
+        int fd = open(path.c_str(), isDirectory ? O_RDONLY | O_DIRECTORY : O_WRONLY);
+        if (fd < 0) return false;
+        bool ok = fsync(fd) == 0;
+        close(fd);
+        return ok;
+#endif
+    }
+
+    // Moves a temporary output that was written in full into place, so an output that exists is always complete
+    static bool commitOutput(const string& tmpPath, const string& output, bool written) {
+        error_code ec;
+        if (!written || fileSize(tmpPath) == 0 || !syncPath(tmpPath)) {
+            filesystem::remove(tmpPath, ec);
+            return false;
+        }
+        filesystem::rename(tmpPath, output, ec);
+        if (ec) {
+            filesystem::remove(tmpPath, ec);
+            return false;
+        }
+        filesystem::path dir = filesystem::path(output).parent_path();
+        return syncPath(dir.empty() ? "." : dir.string(), true);
+    }
+
+public:
+    // Converts one job on the calling thread. Returns the number of pixels converted, 0 on failure.
+    static size_t convert(const ConvertJob& job) {
+        QOIConverter img;
+        string tmpPath = job.output + ".tmp";
+        if (hasExtension(job.input, ".bmp")) {
+            if (!img.readBMP(job.input)) return 0;
+            img.encode();
+            bool written = img.writeQOI(tmpPath);
+            return commitOutput(tmpPath, job.output, written) ? img.getPixelCount() : 0;
+        }
+        if (hasExtension(job.input, ".qoi")) {
+            img.readQOI(job.input);
+            if (img.getQOISize() == 0) return 0;
+            img.decode();
+            if (img.getPixelCount() != (size_t)img.getWidth() * img.getHeight()) return 0;
+            bool written = img.writeBMP(tmpPath);
+            return commitOutput(tmpPath, job.output, written) ? img.getPixelCount() : 0;
+        }
+        cerr << "Unknown input format: " << job.input << endl;
+        return 0;
+    }
+
+    // threadsPerNode = 0 uses every CPU of each node
+    explicit BatchConverter(size_t threadsPerNode = 0) {
+        const vector<vector<int>>& nodes = numaNodes();
+        for (size_t n = 0; n < nodes.size(); n++) {
+            auto node = make_unique<Node>();
+            size_t threads = threadsPerNode ? threadsPerNode : nodes[n].size();
+            node->stats.workers = threads;
+            node->pool = make_unique<ThreadPool>(threads, [n](size_t) { pinToNumaNode((int)n); });
+            m_nodes.push_back(std::move(node));
+        }
+    }
+
+    size_t nodeCount() const {
+        return m_nodes.size();
+    }
+
+    // Converts every job and returns how many succeeded. results, if given, receives one entry per job.
+    // onDone, if given, is called on the worker thread as soon as a job has finished.
+    size_t run(const vector<ConvertJob>& jobs, vector<ConvertResult>* results = nullptr,
+               const function<void(size_t, const ConvertResult&)>& onDone = nullptr) {
+        if (results) results->assign(jobs.size(), ConvertResult());
+        atomic<size_t> next{0};
+        atomic<size_t> succeeded{0};
+        size_t workers = 0;
+        for (auto& node : m_nodes) workers += node->pool->size();
+
+        mutex doneMutex;
+        condition_variable doneCv;
+        size_t running = workers;
+
+        for (size_t n = 0; n < m_nodes.size(); n++) {
+            Node* node = m_nodes[n].get();
+            for (size_t w = 0; w < node->pool->size(); w++) {
+                node->pool->submit([&, node, n] {
+                    NumaNodeStats local;
+                    auto begin = chrono::steady_clock::now();
+                    for (size_t j = next++; j < jobs.size(); j = next++) {
+                        auto jobBegin = chrono::steady_clock::now();
+                        ConvertResult result;
+                        result.pixels = convert(jobs[j]);
+                        result.ok = result.pixels > 0;
+                        if (result.ok) {
+                            result.bytesIn = fileSize(jobs[j].input);
+                            result.bytesOut = fileSize(jobs[j].output);
+                        }
+                        result.seconds = chrono::duration<double>(chrono::steady_clock::now() - jobBegin).count();
+                        if (results) (*results)[j] = result;
+                        if (onDone) onDone(j, result);
+
+                        if (!result.ok) {
+                            local.failed++;
+                            continue;
+                        }
+                        local.images++;
+                        succeeded++;
+                        local.pixels += result.pixels;
+                        local.bytesIn += result.bytesIn;
+                        local.bytesOut += result.bytesOut;
+                        if (runningNumaNode() >= 0 && runningNumaNode() != (int)n) local.remote++;
+                    }
+                    double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+
+                    {
+                        lock_guard<mutex> lock(node->m);
+                        node->stats.images += local.images;
+                        node->stats.failed += local.failed;
+                        node->stats.pixels += local.pixels;
+                        node->stats.bytesIn += local.bytesIn;
+                        node->stats.bytesOut += local.bytesOut;
+                        node->stats.remote += local.remote;
+                        node->stats.seconds += seconds;
+                    }
+                    lock_guard<mutex> lock(doneMutex);
+                    if (--running == 0) doneCv.notify_all();
+                });
+            }
+        }
+
+        unique_lock<mutex> lock(doneMutex);
+        doneCv.wait(lock, [&] { return running == 0; });
+        return succeeded;
+    }
+
+    // Totals since construction or the last resetStats()
+    vector<NumaNodeStats> stats() const {
+        vector<NumaNodeStats> out;
+        for (auto& node : m_nodes) {
+            lock_guard<mutex> lock(node->m);
+            out.push_back(node->stats);
+        }
+        return out;
+    }
+
+    void resetStats() {
+        for (auto& node : m_nodes) {
+            lock_guard<mutex> lock(node->m);
+            size_t workers = node->stats.workers;
+            node->stats = NumaNodeStats();
+            node->stats.workers = workers;
+        }
+    }
+};
@@ -0,0 +1,353 @@
+#pragma once
+
+#include <vector>
+#include <cstring>
+
+#include "RGBValue.h"
+#include "QOIKernels.h"
+#include "BufferPool.h"
+
+using namespace std;
+
+// ----- BATCH ENCODE (SIMD ACROSS IMAGES) -----
+// A small image is one short dependency chain, so encoding it alone mostly waits on itself. The batch kernels
+// run the encoder state machine for several same-sized images at once, one image per SIMD lane: a block of
+// pixels from every image is transposed so one vector holds pixel i of all images, and each lane keeps its own
+// prevPixel, run length and index table (lane-interleaved, slot * LANES + lane). The vector part produces, per lane, the bytes for pixel i packed
+// into one word (an optional QOI_OP_RUN that the pixel ends, then its own opcode) and their count; a short
+// scalar loop appends each word to its image's output. Output is byte-identical to encodeScalar().
+//
+// Pixels are handled as uint32 {r, g, b, 0} like the interleaved decoder. An index slot no image has written
+// yet holds EMPTY_SLOT, which never equals a pixel.
+
+const uint32_t EMPTY_SLOT = 0xFFFFFFFF;
+
+const size_t BATCH_GROUP = 16; // images per thread pool task, a multiple of every kernel's lane count
+
+// Fallback for tiers without gathers: one image after another through the given single-image kernel
+template <void (*Encode)(const RGBValue*, size_t, RGBValue, RGBValue*, vector<uint8_t>&)>
+void encodeEach(const RGBValue* const* images, size_t imageCount, size_t pixelCount, vector<uint8_t>* outs) {
+    for (size_t k = 0; k < imageCount; k++) {
+        RGBValue index[64];
+        Encode(images[k], pixelCount, RGBValue(0, 0, 0), index, outs[k]);
+    }
+}
+
+// Splits a batch into groups of Lanes images, padding the last group by repeating its first image
+template <size_t Lanes, void (*EncodeLanes)(const RGBValue* const*, size_t, vector<uint8_t>*)>
+void encodeInLanes(const RGBValue* const* images, size_t imageCount, size_t pixelCount, vector<uint8_t>* outs) {
+    for (size_t g = 0; g < imageCount; g += Lanes) {
+        size_t used = min(Lanes, imageCount - g);
+        if (used == Lanes) {
+            EncodeLanes(images + g, pixelCount, outs + g);
+            continue;
+        }
+        const RGBValue* group[Lanes];
+        vector<uint8_t> groupOuts[Lanes];
+        for (size_t l = 0; l < Lanes; l++) {
+            group[l] = images[g + (l < used ? l : 0)];
+            if (l < used) groupOuts[l].swap(outs[g + l]);
+            else BufferPool<uint8_t>::shared().acquire(groupOuts[l], pixelCount*4 + 16);
+        }
+        EncodeLanes(group, pixelCount, groupOuts);
+        for (size_t l = 0; l < Lanes; l++) {
+            if (l < used) outs[g + l].swap(groupOuts[l]);
+            else BufferPool<uint8_t>::shared().release(groupOuts[l]);
+        }
+    }
+}
+
+// Opens every lane's output for appending; each pixel stores a full 8-byte word, hence the slack
+inline void openLaneOutputs(vector<uint8_t>* outs, size_t lanes, size_t pixelCount, uint8_t** cursors) {
+    for (size_t l = 0; l < lanes; l++) {
+        size_t base = outs[l].size();
+        outs[l].resize(base + pixelCount*4 + 16); // QOI_OP_RGB is the worst case per pixel, plus a final run
+        cursors[l] = outs[l].data() + base;
+    }
+}
+
+inline void closeLaneOutputs(vector<uint8_t>* outs, size_t lanes, uint8_t** cursors, const uint32_t* runs) {
+    for (size_t l = 0; l < lanes; l++) {
+        if (runs[l] > 0) *cursors[l]++ = 0b11000000 + runs[l] - 1; // (QOI_OP_RUN)
+        outs[l].resize(cursors[l] - outs[l].data());
+    }
+}
+
+#ifdef QOI_X86
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+// rows[l] holds pixels 0..15 of lane l, afterwards rows[i] holds pixel i of lanes 0..15
+QOI_TARGET("avx512f")
+inline void transposeAVX512(__m512i* rows) {
+    __m512i t[16];
+    for (int i = 0; i < 16; i += 2) {
+        t[i] = _mm512_unpacklo_epi32(rows[i], rows[i+1]);
+        t[i+1] = _mm512_unpackhi_epi32(rows[i], rows[i+1]);
+    }
+    for (int i = 0; i < 16; i += 4) {
+        rows[i] = _mm512_unpacklo_epi64(t[i], t[i+2]);
+        rows[i+1] = _mm512_unpackhi_epi64(t[i], t[i+2]);
+        rows[i+2] = _mm512_unpacklo_epi64(t[i+1], t[i+3]);
+        rows[i+3] = _mm512_unpackhi_epi64(t[i+1], t[i+3]);
+    }
+    // each 128-bit lane k of rows[4i + j] now holds column 4k + j of rows 4i..4i+3
+    for (int j = 0; j < 4; j++) {
+        __m512i a = _mm512_shuffle_i32x4(rows[j], rows[4+j], 0x88);
+        __m512i b = _mm512_shuffle_i32x4(rows[j], rows[4+j], 0xDD);
+        __m512i c = _mm512_shuffle_i32x4(rows[8+j], rows[12+j], 0x88);
+        __m512i d = _mm512_shuffle_i32x4(rows[8+j], rows[12+j], 0xDD);
+        t[j] = _mm512_shuffle_i32x4(a, c, 0x88);
+        t[8+j] = _mm512_shuffle_i32x4(a, c, 0xDD);
+        t[4+j] = _mm512_shuffle_i32x4(b, d, 0x88);
+        t[12+j] = _mm512_shuffle_i32x4(b, d, 0xDD);
+    }
+    for (int i = 0; i < 16; i++) rows[i] = t[i];
+}
+
+// Exactly 16 images of pixelCount pixels each
+QOI_TARGET("avx512f,avx512bw")
+inline void encodeLanesAVX512(const RGBValue* const* images, size_t pixelCount, vector<uint8_t>* outs) {
+    const size_t LANES = 16;
+    alignas(64) uint32_t index[64 * LANES];
+    for (auto& slot : index) slot = EMPTY_SLOT;
+
+    uint8_t* cursors[LANES];
+    openLaneOutputs(outs, LANES, pixelCount, cursors);
+
+    const __m512i lane = _mm512_setr_epi32(0,1,2,3, 4,5,6,7, 8,9,10,11, 12,13,14,15);
+    const __m512i byteMask = _mm512_set1_epi32(0xFF);
+    const __m512i one = _mm512_set1_epi32(1), zero = _mm512_setzero_si512();
+    __m512i prev = zero, run = zero;
+    alignas(64) uint64_t words[LANES];
+    alignas(64) uint32_t lengths[LANES];
+
+    __m512i block[LANES];
+    for (size_t blockStart = 0; blockStart < pixelCount; blockStart += LANES) {
+        size_t blockSize = min(LANES, pixelCount - blockStart);
+        __mmask16 valid = (__mmask16)((1u << blockSize) - 1);
+        for (size_t l = 0; l < LANES; l++)
+            block[l] = _mm512_maskz_loadu_epi32(valid, images[l] + blockStart);
+        transposeAVX512(block);
+
+        for (size_t i = 0; i < blockSize; i++) {
+            __m512i px = _mm512_and_si512(block[i], _mm512_set1_epi32(0x00FFFFFF));
+            __mmask16 same = _mm512_cmpeq_epi32_mask(px, prev);
+
+            __m512i r = _mm512_and_si512(px, byteMask);
+            __m512i g = _mm512_and_si512(_mm512_srli_epi32(px, 8), byteMask);
+            __m512i b = _mm512_srli_epi32(px, 16);
+            __m512i dr = _mm512_sub_epi32(r, _mm512_and_si512(prev, byteMask));
+            __m512i dg = _mm512_sub_epi32(g, _mm512_and_si512(_mm512_srli_epi32(prev, 8), byteMask));
+            __m512i db = _mm512_sub_epi32(b, _mm512_srli_epi32(prev, 16));
+
+            // biased deltas, a signed range check becomes one unsigned compare
+            __m512i dr2 = _mm512_add_epi32(dr, _mm512_set1_epi32(2));
+            __m512i dg2 = _mm512_add_epi32(dg, _mm512_set1_epi32(2));
+            __m512i db2 = _mm512_add_epi32(db, _mm512_set1_epi32(2));
+            __mmask16 isDiff = _mm512_cmple_epu32_mask(dr2, _mm512_set1_epi32(3))
+                             & _mm512_cmple_epu32_mask(dg2, _mm512_set1_epi32(3))
+                             & _mm512_cmple_epu32_mask(db2, _mm512_set1_epi32(3));
+            __m512i dg32 = _mm512_add_epi32(dg, _mm512_set1_epi32(32));
+            __m512i drg = _mm512_add_epi32(_mm512_sub_epi32(dr, dg), _mm512_set1_epi32(8));
+            __m512i dbg = _mm512_add_epi32(_mm512_sub_epi32(db, dg), _mm512_set1_epi32(8));
+            __mmask16 isLuma = _mm512_cmple_epu32_mask(dg32, _mm512_set1_epi32(63))
+                             & _mm512_cmple_epu32_mask(drg, _mm512_set1_epi32(15))
+                             & _mm512_cmple_epu32_mask(dbg, _mm512_set1_epi32(15));
+
+            // r*3 + g*5 + b*7 + 255*11, mod 64
+            __m512i hash = _mm512_add_epi32(_mm512_add_epi32(_mm512_slli_epi32(r, 1), r), _mm512_add_epi32(_mm512_slli_epi32(g, 2), g));
+            hash = _mm512_add_epi32(hash, _mm512_sub_epi32(_mm512_slli_epi32(b, 3), b));
+            hash = _mm512_and_si512(_mm512_add_epi32(hash, _mm512_set1_epi32(255*11)), _mm512_set1_epi32(63));
+            __m512i slot = _mm512_add_epi32(_mm512_slli_epi32(hash, 4), lane);
+            __mmask16 isIndex = _mm512_cmpeq_epi32_mask(_mm512_i32gather_epi32(slot, index, 4), px);
+
+            // opcodes in reverse priority, so the later blends win: RGB < LUMA < INDEX < DIFF
+            __m512i op = _mm512_or_si512(_mm512_slli_epi32(px, 8), _mm512_set1_epi32(0b11111110));
+            __m512i len = _mm512_set1_epi32(4);
+            __m512i luma = _mm512_or_si512(_mm512_or_si512(dg32, _mm512_set1_epi32(0b10000000)),
+                                           _mm512_slli_epi32(_mm512_or_si512(_mm512_slli_epi32(drg, 4), dbg), 8));
+            op = _mm512_mask_mov_epi32(op, isLuma, luma);
+            len = _mm512_mask_mov_epi32(len, isLuma, _mm512_set1_epi32(2));
+            op = _mm512_mask_mov_epi32(op, isIndex, hash);
+            len = _mm512_mask_mov_epi32(len, isIndex, one);
+            __m512i diff = _mm512_or_si512(_mm512_or_si512(_mm512_set1_epi32(0b01000000), _mm512_slli_epi32(dr2, 4)),
+                                           _mm512_or_si512(_mm512_slli_epi32(dg2, 2), db2));
+            op = _mm512_mask_mov_epi32(op, isDiff, diff);
+            len = _mm512_mask_mov_epi32(len, isDiff, one);
+            len = _mm512_maskz_mov_epi32(~same, len);
+
+            // runs: a repeat extends the run and only emits at 62, anything else flushes a pending run first
+            __m512i runNext = _mm512_maskz_add_epi32(same, run, one);
+            __mmask16 full = _mm512_mask_cmpeq_epi32_mask(same, runNext, _mm512_set1_epi32(62));
+            __mmask16 flush = _mm512_mask_cmpgt_epu32_mask(~same, run, zero);
+            __m512i pre = _mm512_maskz_add_epi32(flush, run, _mm512_set1_epi32(0b11000000 - 1)); // (QOI_OP_RUN)
+            pre = _mm512_mask_mov_epi32(pre, full, _mm512_set1_epi32(0b11000000 + 62 - 1));
+            __m512i preLen = _mm512_maskz_mov_epi32(flush | full, one);
+            run = _mm512_maskz_mov_epi32(~full, runNext);
+
+            _mm512_mask_i32scatter_epi32(index, ~same, slot, px, 4);
+            prev = px;
+
+            // word = pre | op << (8 * preLen), widened to 64 bits so a flush plus QOI_OP_RGB fits
+            __m512i shift = _mm512_slli_epi32(preLen, 3);
+            __m512i wordsLo = _mm512_or_si512(_mm512_sllv_epi64(_mm512_cvtepu32_epi64(_mm512_castsi512_si256(op)),
+                                                                _mm512_cvtepu32_epi64(_mm512_castsi512_si256(shift))),
+                                              _mm512_cvtepu32_epi64(_mm512_castsi512_si256(pre)));
+            __m512i wordsHi = _mm512_or_si512(_mm512_sllv_epi64(_mm512_cvtepu32_epi64(_mm512_extracti64x4_epi64(op, 1)),
+                                                                _mm512_cvtepu32_epi64(_mm512_extracti64x4_epi64(shift, 1))),
+                                              _mm512_cvtepu32_epi64(_mm512_extracti64x4_epi64(pre, 1)));
+            _mm512_store_si512(words, wordsLo);
+            _mm512_store_si512(words + 8, wordsHi);
+            _mm512_store_si512(lengths, _mm512_add_epi32(len, preLen));
+
+            for (size_t l = 0; l < LANES; l++) {
+                memcpy(cursors[l], &words[l], 8);
+                cursors[l] += lengths[l];
+            }
+        }
+    }
+
+    alignas(64) uint32_t runs[LANES];
+    _mm512_store_si512(runs, run);
+    closeLaneOutputs(outs, LANES, cursors, runs);
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+// 8x8 version of transposeAVX512()
+QOI_TARGET("avx2")
+inline void transposeAVX2(__m256i* rows) {
+    __m256i t[8];
+    for (int i = 0; i < 8; i += 2) {
+        t[i] = _mm256_unpacklo_epi32(rows[i], rows[i+1]);
+        t[i+1] = _mm256_unpackhi_epi32(rows[i], rows[i+1]);
+    }
+    for (int i = 0; i < 8; i += 4) {
+        rows[i] = _mm256_unpacklo_epi64(t[i], t[i+2]);
+        rows[i+1] = _mm256_unpackhi_epi64(t[i], t[i+2]);
+        rows[i+2] = _mm256_unpacklo_epi64(t[i+1], t[i+3]);
+        rows[i+3] = _mm256_unpackhi_epi64(t[i+1], t[i+3]);
+    }
+    for (int j = 0; j < 4; j++) {
+        t[j] = _mm256_permute2x128_si256(rows[j], rows[4+j], 0x20);
+        t[4+j] = _mm256_permute2x128_si256(rows[j], rows[4+j], 0x31);
+    }
+    for (int i = 0; i < 8; i++) rows[i] = t[i];
+}
+
+// unsigned x <= limit, as all-ones lanes
+QOI_TARGET("avx2")
+inline __m256i withinAVX2(__m256i x, int limit) {
+    return _mm256_cmpeq_epi32(_mm256_min_epu32(x, _mm256_set1_epi32(limit)), x);
+}
+
+// AVX2 has gathers but no scatter or mask registers: compares give all-ones lanes and the index table is
+// written in the scalar loop, with repeat pixels sent to a spare row so that loop stays branch-free
+QOI_TARGET("avx2")
+inline void encodeLanesAVX2(const RGBValue* const* images, size_t pixelCount, vector<uint8_t>* outs) {
+    const size_t LANES = 8;
+    alignas(32) uint32_t index[65 * LANES]; // + spare row
+    for (auto& slot : index) slot = EMPTY_SLOT;
+
+    uint8_t* cursors[LANES];
+    openLaneOutputs(outs, LANES, pixelCount, cursors);
+
+    const __m256i lane = _mm256_setr_epi32(0,1,2,3, 4,5,6,7);
+    const __m256i spare = _mm256_add_epi32(lane, _mm256_set1_epi32(64 * LANES));
+    const __m256i byteMask = _mm256_set1_epi32(0xFF);
+    const __m256i one = _mm256_set1_epi32(1), zero = _mm256_setzero_si256();
+    __m256i prev = zero, run = zero;
+    alignas(32) uint64_t words[LANES];
+    alignas(32) uint32_t lengths[LANES], slots[LANES], pixels[LANES];
+
+    __m256i block[LANES];
+    for (size_t blockStart = 0; blockStart < pixelCount; blockStart += LANES) {
+        size_t blockSize = min(LANES, pixelCount - blockStart);
+        __m256i valid = _mm256_cmpgt_epi32(_mm256_set1_epi32((int)blockSize), lane);
+        for (size_t l = 0; l < LANES; l++)
+            block[l] = _mm256_maskload_epi32(reinterpret_cast<const int*>(images[l] + blockStart), valid);
+        transposeAVX2(block);
+
+        for (size_t i = 0; i < blockSize; i++) {
+            __m256i px = _mm256_and_si256(block[i], _mm256_set1_epi32(0x00FFFFFF));
+            __m256i same = _mm256_cmpeq_epi32(px, prev);
+
+            __m256i r = _mm256_and_si256(px, byteMask);
+            __m256i g = _mm256_and_si256(_mm256_srli_epi32(px, 8), byteMask);
+            __m256i b = _mm256_srli_epi32(px, 16);
+            __m256i dr = _mm256_sub_epi32(r, _mm256_and_si256(prev, byteMask));
+            __m256i dg = _mm256_sub_epi32(g, _mm256_and_si256(_mm256_srli_epi32(prev, 8), byteMask));
+            __m256i db = _mm256_sub_epi32(b, _mm256_srli_epi32(prev, 16));
+
+            __m256i dr2 = _mm256_add_epi32(dr, _mm256_set1_epi32(2));
+            __m256i dg2 = _mm256_add_epi32(dg, _mm256_set1_epi32(2));
+            __m256i db2 = _mm256_add_epi32(db, _mm256_set1_epi32(2));
+            __m256i isDiff = _mm256_and_si256(_mm256_and_si256(withinAVX2(dr2, 3), withinAVX2(dg2, 3)), withinAVX2(db2, 3));
+            __m256i dg32 = _mm256_add_epi32(dg, _mm256_set1_epi32(32));
+            __m256i drg = _mm256_add_epi32(_mm256_sub_epi32(dr, dg), _mm256_set1_epi32(8));
+            __m256i dbg = _mm256_add_epi32(_mm256_sub_epi32(db, dg), _mm256_set1_epi32(8));
+            __m256i isLuma = _mm256_and_si256(_mm256_and_si256(withinAVX2(dg32, 63), withinAVX2(drg, 15)), withinAVX2(dbg, 15));
+
+            __m256i hash = _mm256_add_epi32(_mm256_add_epi32(_mm256_slli_epi32(r, 1), r), _mm256_add_epi32(_mm256_slli_epi32(g, 2), g));
+            hash = _mm256_add_epi32(hash, _mm256_sub_epi32(_mm256_slli_epi32(b, 3), b));
+            hash = _mm256_and_si256(_mm256_add_epi32(hash, _mm256_set1_epi32(255*11)), _mm256_set1_epi32(63));
+            __m256i slot = _mm256_add_epi32(_mm256_slli_epi32(hash, 3), lane);
+            __m256i isIndex = _mm256_cmpeq_epi32(_mm256_i32gather_epi32(reinterpret_cast<const int*>(index), slot, 4), px);
+
+            __m256i op = _mm256_or_si256(_mm256_slli_epi32(px, 8), _mm256_set1_epi32(0b11111110));
+            __m256i len = _mm256_set1_epi32(4);
+            __m256i luma = _mm256_or_si256(_mm256_or_si256(dg32, _mm256_set1_epi32(0b10000000)),
+                                           _mm256_slli_epi32(_mm256_or_si256(_mm256_slli_epi32(drg, 4), dbg), 8));
+            op = _mm256_blendv_epi8(op, luma, isLuma);
+            len = _mm256_blendv_epi8(len, _mm256_set1_epi32(2), isLuma);
+            op = _mm256_blendv_epi8(op, hash, isIndex);
+            len = _mm256_blendv_epi8(len, one, isIndex);
+            __m256i diff = _mm256_or_si256(_mm256_or_si256(_mm256_set1_epi32(0b01000000), _mm256_slli_epi32(dr2, 4)),
+                                           _mm256_or_si256(_mm256_slli_epi32(dg2, 2), db2));
+            op = _mm256_blendv_epi8(op, diff, isDiff);
+            len = _mm256_blendv_epi8(len, one, isDiff);
+            len = _mm256_andnot_si256(same, len);
+
+            __m256i runNext = _mm256_and_si256(same, _mm256_add_epi32(run, one));
+            __m256i full = _mm256_cmpeq_epi32(runNext, _mm256_set1_epi32(62));
+            __m256i flush = _mm256_andnot_si256(same, _mm256_xor_si256(_mm256_cmpeq_epi32(run, zero), _mm256_set1_epi32(-1)));
+            __m256i pre = _mm256_and_si256(flush, _mm256_add_epi32(run, _mm256_set1_epi32(0b11000000 - 1))); // (QOI_OP_RUN)
+            pre = _mm256_blendv_epi8(pre, _mm256_set1_epi32(0b11000000 + 62 - 1), full);
+            __m256i preLen = _mm256_and_si256(_mm256_or_si256(flush, full), one);
+            run = _mm256_andnot_si256(full, runNext);
+            prev = px;
+
+            __m256i shift = _mm256_slli_epi32(preLen, 3);
+            __m256i wordsLo = _mm256_or_si256(_mm256_sllv_epi64(_mm256_cvtepu32_epi64(_mm256_castsi256_si128(op)),
+                                                                _mm256_cvtepu32_epi64(_mm256_castsi256_si128(shift))),
+                                              _mm256_cvtepu32_epi64(_mm256_castsi256_si128(pre)));
+            __m256i wordsHi = _mm256_or_si256(_mm256_sllv_epi64(_mm256_cvtepu32_epi64(_mm256_extracti128_si256(op, 1)),
+                                                                _mm256_cvtepu32_epi64(_mm256_extracti128_si256(shift, 1))),
+                                              _mm256_cvtepu32_epi64(_mm256_extracti128_si256(pre, 1)));
+            _mm256_store_si256(reinterpret_cast<__m256i*>(words), wordsLo);
+            _mm256_store_si256(reinterpret_cast<__m256i*>(words + 4), wordsHi);
+            _mm256_store_si256(reinterpret_cast<__m256i*>(lengths), _mm256_add_epi32(len, preLen));
+            _mm256_store_si256(reinterpret_cast<__m256i*>(slots), _mm256_blendv_epi8(slot, spare, same));
+            _mm256_store_si256(reinterpret_cast<__m256i*>(pixels), px);
+
+            for (size_t l = 0; l < LANES; l++) {
+                index[slots[l]] = pixels[l];
+                memcpy(cursors[l], &words[l], 8);
+                cursors[l] += lengths[l];
+            }
+        }
+    }
+
+    alignas(32) uint32_t runs[LANES];
+    _mm256_store_si256(reinterpret_cast<__m256i*>(runs), run);
+    closeLaneOutputs(outs, LANES, cursors, runs);
+}
+
+#endif // QOI_X86
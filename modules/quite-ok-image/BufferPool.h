@@ -0,0 +1,263 @@
+#pragma once
+
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+#include "Numa.h"
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+// ----- POOLED IMAGE BUFFERS -----
+// Batch conversion reads, encodes and drops thousands of images of similar size. Instead of freeing their
+// buffers and faulting fresh pages in for the next image, the converter borrows vectors from a process-wide
+// pool and hands them back when it is done. Buffers are kept in power-of-two size classes (by element count),
+// so any free buffer of a class fits every request that maps to it.
+//
+// The pool only keeps as many buffers per class as were out at once since the last trim() (the high-water
+// mark). Call trim() between batches of different shapes to give memory back. It only takes back storage it
+// lent out itself, recognised by its address; a copied vector is simply freed on release. A loan is also
+// recorded against the vector it went to, so when that vector outgrew its pooled storage, its release still
+// ends the loan (and frees the new storage) instead of leaving it counted as out.
+//
+// Large buffers (2 MB and up) are first-touched a lot by encode/decode, so on Linux the pool can also
+//   - ask for transparent huge pages (madvise MADV_HUGEPAGE) before the buffer is touched: QOI_HUGEPAGES, default on
+//   - pre-fault new buffers in one go instead of page by page inside the kernels: QOI_PREFAULT, default off
+// prepare() fills the pool ahead of a batch, e.g. from a background thread, to take the faults off the critical path.
+//
+// shared() keeps one pool per NUMA node and picks the one of the node the calling thread was pinned to. Pooled
+// pages were first touched by a thread of that node, so reusing them never hands out remote memory.
+
+const size_t HUGE_PAGE_BYTES = 2 << 20;
+
+// Env flag: unset keeps the default, "0" turns it off, anything else on
+inline bool envFlag(const char* name, bool fallback) {
+    const char* env = getenv(name);
+    if (!env || !*env) return fallback;
+    return strcmp(env, "0") != 0;
+}
+
+// Advises huge pages for the page-aligned interior of [data, data + bytes)
+inline void adviseHugePages(void* data, size_t bytes) {
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    if (bytes < HUGE_PAGE_BYTES) return;
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t begin = ((uintptr_t)data + page - 1) & ~(page - 1);
+    uintptr_t end = ((uintptr_t)data + bytes) & ~(page - 1);
+    if (end > begin) madvise(reinterpret_cast<void*>(begin), end - begin, MADV_HUGEPAGE);
+#else
+    (void)data;
+    (void)bytes;
+#endif
+}
+
+// Maps in every page of [data, data + bytes) now, with one call where the kernel supports it
+inline void prefaultPages(void* data, size_t bytes) {
+#if defined(__linux__)
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t begin = ((uintptr_t)data + page - 1) & ~(page - 1);
+    uintptr_t end = ((uintptr_t)data + bytes) & ~(page - 1);
+#ifdef MADV_POPULATE_WRITE
+    if (end > begin && madvise(reinterpret_cast<void*>(begin), end - begin, MADV_POPULATE_WRITE) == 0) return;
+#endif
+#endif
+    // older kernels: touch one byte per page (4 KB steps are safe for any page size)
+    volatile uint8_t* p = static_cast<volatile uint8_t*>(data);
+    for (size_t i = 0; i < bytes; i += 4096) p[i] = 0;
+}
+
+struct BufferPoolStats {
+    size_t allocations = 0; // requests the pool could not serve
+    size_t reuses = 0;      // requests served from a pooled buffer
+    size_t bytesHeld = 0;   // capacity currently sitting in the pool
+};
+
+template <class T>
+class BufferPool {
+private:
+    static const int MIN_CLASS = 10; // 1024 elements, smaller buffers are not worth pooling
+    static const int CLASSES = 48;
+
+    struct Loan {
+        int sizeClass;
+        const vector<T>* borrower;
+    };
+
+    vector<vector<T>> m_free[CLASSES];
+    unordered_map<const T*, Loan> m_lent;                  // storage out on loan, by address
+    unordered_map<const vector<T>*, const T*> m_borrowers; // vector each loan went to -> the storage it got
+    size_t m_outstanding[CLASSES] = {};
+    size_t m_highWater[CLASSES] = {};
+    BufferPoolStats m_stats;
+    mutable mutex m_mutex;
+    bool m_hugePages = envFlag("QOI_HUGEPAGES", true);
+    bool m_prefault = envFlag("QOI_PREFAULT", false);
+
+    // smallest class whose buffers hold count elements
+    static int classFor(size_t count) {
+        int c = MIN_CLASS;
+        while (c < CLASSES - 1 && ((size_t)1 << c) < count) c++;
+        return c;
+    }
+
+    // Storage for a new buffer of class c, set up before anything touches it
+    void allocate(vector<T>& buf, int c) {
+        buf.reserve((size_t)1 << c);
+        if (m_hugePages) adviseHugePages(buf.data(), buf.capacity() * sizeof(T));
+        if (m_prefault) prefaultPages(buf.data(), buf.capacity() * sizeof(T));
+    }
+
+    // Ends the loan of storage (m_mutex held)
+    int endLoan(typename unordered_map<const T*, Loan>::iterator lent) {
+        int c = lent->second.sizeClass;
+        auto borrower = m_borrowers.find(lent->second.borrower);
+        if (borrower != m_borrowers.end() && borrower->second == lent->first) m_borrowers.erase(borrower);
+        m_lent.erase(lent);
+        m_outstanding[c]--;
+        return c;
+    }
+
+    void releaseLocked(vector<T>& buf) {
+        auto lent = m_lent.find(buf.data());
+        bool grown = false;
+        if (lent == m_lent.end() && buf.capacity() > 0) { // the storage lent to buf, before it grew?
+            auto borrower = m_borrowers.find(&buf);
+            if (borrower != m_borrowers.end()) {
+                lent = m_lent.find(borrower->second);
+                if (lent != m_lent.end() && lent->second.borrower != &buf) lent = m_lent.end();
+                grown = lent != m_lent.end();
+            }
+        }
+        if (lent == m_lent.end()) { // not the pool's
+            vector<T>().swap(buf);
+            return;
+        }
+        int c = endLoan(lent);
+        if (grown || buf.capacity() < ((size_t)1 << c)) { // not the storage that was lent (that one is freed)
+            vector<T>().swap(buf);
+            return;
+        }
+        if (m_free[c].size() + m_outstanding[c] + 1 > m_highWater[c]) { // more than the batch ever needed
+            vector<T>().swap(buf);
+            return;
+        }
+        buf.clear();
+        m_stats.bytesHeld += buf.capacity() * sizeof(T);
+        m_free[c].emplace_back();
+        m_free[c].back().swap(buf);
+    }
+
+public:
+    BufferPool() = default;
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    // Leaves buf empty with room for at least count elements. Keeps buf's own storage if it is big enough,
+    // otherwise returns it to the pool and takes a pooled buffer of the right class.
+    void acquire(vector<T>& buf, size_t count) {
+        if (buf.capacity() >= count) {
+            buf.clear();
+            return;
+        }
+
+        lock_guard<mutex> lock(m_mutex);
+        releaseLocked(buf);
+
+        int c = classFor(count);
+        m_outstanding[c]++;
+        if (m_outstanding[c] > m_highWater[c]) m_highWater[c] = m_outstanding[c];
+
+        if (!m_free[c].empty()) {
+            buf.swap(m_free[c].back());
+            m_free[c].pop_back();
+            m_stats.bytesHeld -= buf.capacity() * sizeof(T);
+            m_stats.reuses++;
+        } else {
+            m_stats.allocations++;
+            allocate(buf, c);
+        }
+        // storage lent before at this address was freed by its borrower growing: that loan is over
+        auto stale = m_lent.find(buf.data());
+        if (stale != m_lent.end()) endLoan(stale);
+        m_lent[buf.data()] = {c, &buf};
+        m_borrowers[&buf] = buf.data();
+    }
+
+    // Puts pre-faulted buffers for count elements into the pool until it holds at least buffers of them,
+    // and raises the high-water mark so they are kept
+    void prepare(size_t count, size_t buffers) {
+        int c = classFor(count);
+        vector<vector<T>> fresh;
+        {
+            lock_guard<mutex> lock(m_mutex);
+            if (m_free[c].size() >= buffers) return;
+            fresh.resize(buffers - m_free[c].size());
+        }
+        for (auto& buf : fresh) { // outside the lock, this is the slow part
+            buf.reserve((size_t)1 << c);
+            if (m_hugePages) adviseHugePages(buf.data(), buf.capacity() * sizeof(T));
+            prefaultPages(buf.data(), buf.capacity() * sizeof(T));
+        }
+
+        lock_guard<mutex> lock(m_mutex);
+        for (auto& buf : fresh) {
+            m_stats.allocations++;
+            m_stats.bytesHeld += buf.capacity() * sizeof(T);
+            m_free[c].emplace_back();
+            m_free[c].back().swap(buf);
+        }
+        m_highWater[c] = max(m_highWater[c], m_free[c].size() + m_outstanding[c]);
+    }
+
+    void setHugePages(bool enabled) {
+        lock_guard<mutex> lock(m_mutex);
+        m_hugePages = enabled;
+    }
+
+    void setPrefault(bool enabled) {
+        lock_guard<mutex> lock(m_mutex);
+        m_prefault = enabled;
+    }
+
+    // Hands buf's storage to the pool, buf is left empty without capacity
+    void release(vector<T>& buf) {
+        if (buf.capacity() == 0) return;
+        lock_guard<mutex> lock(m_mutex);
+        releaseLocked(buf);
+    }
+
+    // Frees every pooled buffer and starts a new high-water period from what is out right now
+    void trim() {
+        lock_guard<mutex> lock(m_mutex);
+        for (int c = 0; c < CLASSES; c++) {
+            for (auto& buf : m_free[c]) m_stats.bytesHeld -= buf.capacity() * sizeof(T);
+            m_free[c].clear();
+            m_free[c].shrink_to_fit();
+            m_highWater[c] = m_outstanding[c];
+        }
+    }
+
+    BufferPoolStats stats() const {
+        lock_guard<mutex> lock(m_mutex);
+        return m_stats;
+    }
+
+    static BufferPool& shared() {
+        return forNode(currentNumaNode());
+    }
+
+    static BufferPool& forNode(int node) {
+        static BufferPool pools[MAX_NUMA_NODES];
+        return pools[(node >= 0 && node < MAX_NUMA_NODES) ? node : 0];
+    }
+};
@@ -0,0 +1,501 @@
+#pragma once
+
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+
+#include "Segmented.h"
+#include "ThreadPool.h"
+
+using namespace std;
+
+// ----- CONTEXT-MIXING STAGE -----
+// The archival option: as slow as it needs to be for the smallest files. The QOI bytes are coded one bit at a
+// time with a binary arithmetic coder. Each bit's probability comes from MIX_MODELS adaptive models, combined
+// by a logistic mixer that learns online which model to trust for which kind of byte.
+//
+// Coder and decoder both follow the opcode stream and rebuild what a QOI decoder would know at each point:
+// the previous pixel, the 64-entry index, and (given the image width) the row above. From these they predict
+// the next pixel as left + above - above-left. The models look at:
+//   tag bytes       the opcode QOI would write for the predicted pixel, and for the pixel above; the opcode that
+//                   wrote the pixel above; the two previous opcodes
+//   QOI_OP_RGB(A)   the predicted, above and left values of the channel; for green and blue, the prediction
+//                   corrected by how far off it was for the channel before
+//   QOI_OP_LUMA 2   the green difference, and the second byte QOI would write for the predicted pixel
+// Each model's context is hashed together with the bits of the byte seen so far into its own table of
+// probabilities.
+//
+// The body is cut into bands of about MIX_BAND bytes at opcode boundaries. Each band starts with fresh models and
+// a fresh decoder state, so bands are coded and decoded in parallel on the shared thread pool. All arithmetic is
+// integer, so every platform codes the same bytes.
+//
+// Stage data: decoded size (u64 BE), image width (u32 BE, 0 if unknown), band count (u32 BE), then per band its
+// byte count, first pixel and coded size (u64 BE each), then the coded bands one after another.
+
+const size_t MIX_BAND = 1 << 20;
+const int MIX_MODELS = 6;
+const int MIX_TABLE_BITS = 20;   // most probabilities per model, in lines of 16 (one per partial nibble)
+const int MIX_LIMIT = 255;       // counts above this stop slowing down a probability's adaptation
+const int MIX_LEARNING_SHIFT = 11;
+const int MIX_APM_RATE = 7;
+
+// stretch(p) = ln(p / (1 - p)) and squash(x) = 1 / (1 + e^-x), in 12-bit probabilities and 8-bit fixed point logits
+struct MixCurves {
+    int16_t stretch[4096];
+
+    MixCurves() {
+        int pi = 0;
+        for (int x = -2047; x <= 2047; x++) {
+            int v = squashValue(x);
+            for (int j = pi; j <= v; j++) stretch[j] = (int16_t)x;
+            pi = v + 1;
+        }
+        for (int j = pi; j < 4096; j++) stretch[j] = 2047;
+    }
+
+    // piecewise linear through 33 points, as in lpaq
+    static int squashValue(int x) {
+        static const int points[33] = {1, 2, 3, 6, 10, 16, 27, 45, 73, 120, 194, 310, 488, 747, 1101, 1546, 2047, 2549,
+                                       2994, 3348, 3607, 3785, 3901, 3975, 4024, 4050, 4068, 4079, 4085, 4089, 4092, 4093, 4094};
+        if (x > 2047) return 4095;
+        if (x < -2047) return 1;
+        int w = x & 127;
+        return (points[(x >> 7) + 16] * (128 - w) + points[(x >> 7) + 17] * w + 64) >> 7;
+    }
+};
+
+inline const MixCurves& mixCurves() {
+    static const MixCurves curves;
+    return curves;
+}
+
+inline uint32_t mixHash(uint32_t a, uint32_t b = 0, uint32_t c = 0) {
+    uint32_t h = a * 0x9E3779B1u ^ b * 0x85EBCA77u ^ c * 0xC2B2AE3Du;
+    return (h ^ (h >> 15)) * 0x2C1B3C6Du;
+}
+
+struct MixPixel {
+    uint8_t r = 0, g = 0, b = 0, a = 255;
+
+    bool operator==(const MixPixel& other) const {
+        return r == other.r && g == other.g && b == other.b && a == other.a;
+    }
+
+    int hash() const {
+        return (r * 3 + g * 5 + b * 7 + a * 11) % 64;
+    }
+};
+
+// A QOI decoder fed one byte at a time, with what the models need to know about the next byte
+class MixTracker {
+public:
+    enum Place { PLACE_TAG, PLACE_RED, PLACE_GREEN, PLACE_BLUE, PLACE_ALPHA, PLACE_LUMA, PLACES };
+
+private:
+    uint32_t m_width;
+    uint64_t m_pos;                 // next pixel
+    vector<MixPixel> m_rows;        // the last width + 1 pixels, pixel p at p % (width + 1)
+    vector<uint8_t> m_rowTags;      // the tag of the opcode that wrote each of them
+    MixPixel m_index[64];
+    MixPixel m_last;
+    MixPixel m_predicted, m_above;
+    uint8_t m_op[5];                // the current opcode so far
+    int m_have = 0, m_need = 1;
+    int m_kinds = 0;                // kinds of the previous two opcodes
+
+    static int kind(uint8_t tag) {
+        return tag >= 0xFE ? 4 + (tag & 1) : tag >> 6;
+    }
+
+    void emit(const MixPixel& pixel, int count, uint8_t tag) {
+        m_last = pixel;
+        m_index[pixel.hash()] = pixel;
+        if (m_width) {
+            for (int i = 0; i < count; i++) {
+                size_t slot = (size_t)((m_pos + i) % (m_width + 1));
+                m_rows[slot] = pixel;
+                m_rowTags[slot] = tag;
+            }
+        }
+        m_pos += count;
+    }
+
+    void finishOp() {
+        uint8_t tag = m_op[0];
+        MixPixel p = m_last;
+        int count = 1;
+        if (tag == 0xFE || tag == 0xFF) {
+            p.r = m_op[1];
+            p.g = m_op[2];
+            p.b = m_op[3];
+            if (tag == 0xFF) p.a = m_op[4];
+        }
+        else if ((tag >> 6) == 0) p = m_index[tag & 63];
+        else if ((tag >> 6) == 1) {
+            p.r = (uint8_t)(p.r + ((tag >> 4) & 3) - 2);
+            p.g = (uint8_t)(p.g + ((tag >> 2) & 3) - 2);
+            p.b = (uint8_t)(p.b + (tag & 3) - 2);
+        }
+        else if ((tag >> 6) == 2) {
+            int dg = (tag & 63) - 32;
+            p.r = (uint8_t)(p.r + dg + (m_op[1] >> 4) - 8);
+            p.g = (uint8_t)(p.g + dg);
+            p.b = (uint8_t)(p.b + dg + (m_op[1] & 15) - 8);
+        }
+        else count = (tag & 63) + 1;
+        emit(p, count, tag);
+        m_kinds = (m_kinds % 6) * 6 + kind(tag);
+
+        // left + above - above-left, per channel and clamped
+        m_above = m_last;
+        MixPixel aboveLeft = m_last;
+        if (m_width && m_pos > m_width) {
+            m_above = m_rows[(size_t)((m_pos + 1) % (m_width + 1))];
+            aboveLeft = m_rows[(size_t)(m_pos % (m_width + 1))];
+        }
+        auto gradient = [](int left, int above, int aboveLeft) { return (uint8_t)min(255, max(0, left + above - aboveLeft)); };
+        m_predicted.r = gradient(m_last.r, m_above.r, aboveLeft.r);
+        m_predicted.g = gradient(m_last.g, m_above.g, aboveLeft.g);
+        m_predicted.b = gradient(m_last.b, m_above.b, aboveLeft.b);
+        m_predicted.a = gradient(m_last.a, m_above.a, aboveLeft.a);
+    }
+
+    // The first byte QOI would write for pixel, coming after the previous one
+    uint8_t expectedTag(const MixPixel& pixel) const {
+        if (pixel == m_last) return 0xC0;
+        int h = pixel.hash();
+        if (m_index[h] == pixel) return (uint8_t)h;
+        if (pixel.a != m_last.a) return 0xFF;
+        int dr = (int8_t)(pixel.r - m_last.r), dg = (int8_t)(pixel.g - m_last.g), db = (int8_t)(pixel.b - m_last.b);
+        if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) return (uint8_t)(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+        if (dg >= -32 && dg <= 31 && dr - dg >= -8 && dr - dg <= 7 && db - dg >= -8 && db - dg <= 7) return (uint8_t)(0x80 | (dg + 32));
+        return 0xFE;
+    }
+
+    // The second QOI_OP_LUMA byte QOI would write for pixel, given the green difference dg, clamped
+    uint8_t expectedLuma(const MixPixel& pixel, int dg) const {
+        int dr = (int8_t)(pixel.r - m_last.r) - dg + 8, db = (int8_t)(pixel.b - m_last.b) - dg + 8;
+        return (uint8_t)(min(15, max(0, dr)) << 4 | min(15, max(0, db)));
+    }
+
+public:
+    MixTracker(uint32_t width, uint64_t firstPixel) : m_width(width), m_pos(firstPixel) {
+        m_last.r = m_last.g = m_last.b = 0;
+        m_last.a = 255;
+        if (width) {
+            m_rows.resize((size_t)width + 1, m_last);
+            m_rowTags.resize((size_t)width + 1, 0);
+        }
+        m_predicted = m_above = m_last;
+    }
+
+    Place place() const {
+        if (m_have == 0) return PLACE_TAG;
+        if (m_op[0] < 0xFE) return PLACE_LUMA;
+        return (Place)(PLACE_RED + m_have - 1);
+    }
+
+    // The contexts for the next byte, one per model
+    void contexts(uint32_t* out) const {
+        Place p = place();
+        if (p == PLACE_TAG) {
+            uint8_t guess = expectedTag(m_predicted), guessAbove = expectedTag(m_above);
+            uint8_t aboveTag = m_width ? m_rowTags[(size_t)((m_pos + 1) % (m_width + 1))] : 0;
+            out[0] = mixHash(1, m_kinds);
+            out[1] = mixHash(2, guess);
+            out[2] = mixHash(3, guessAbove, m_kinds % 6);
+            out[3] = mixHash(4, aboveTag);
+            out[4] = mixHash(5, guess, guessAbove);
+            out[5] = mixHash(6, guess, m_kinds);
+        }
+        else if (p == PLACE_LUMA) {
+            int dg = (m_op[0] & 63) - 32;
+            uint8_t guess = expectedLuma(m_predicted, dg), guessAbove = expectedLuma(m_above, dg);
+            out[0] = mixHash(10, dg);
+            out[1] = mixHash(11, guess);
+            out[2] = mixHash(12, guessAbove);
+            out[3] = mixHash(13, dg, guess);
+            out[4] = mixHash(14, guess, guessAbove);
+            out[5] = mixHash(15);
+        }
+        else {
+            int c = p - PLACE_RED;
+            const uint8_t* predicted = &m_predicted.r;
+            const uint8_t* above = &m_above.r;
+            const uint8_t* left = &m_last.r;
+            // green and blue: shift the prediction by the miss on the channel before
+            int corrected = predicted[c];
+            if (p == PLACE_GREEN || p == PLACE_BLUE) corrected = min(255, max(0, predicted[c] + m_op[c] - predicted[c - 1]));
+            out[0] = mixHash(20 + c, predicted[c]);
+            out[1] = mixHash(30 + c, above[c]);
+            out[2] = mixHash(40 + c, left[c]);
+            out[3] = mixHash(50 + c, corrected);
+            out[4] = mixHash(60 + c, corrected, above[c] >> 3);
+            out[5] = mixHash(70 + c);
+        }
+    }
+
+    void push(uint8_t byte) {
+        m_op[m_have++] = byte;
+        if (m_have == 1) m_need = byte == 0xFE ? 4 : byte == 0xFF ? 5 : (byte >> 6) == 2 ? 2 : 1;
+        if (m_have == m_need) {
+            finishOp();
+            m_have = 0;
+        }
+    }
+};
+
+// The probability tables, mixer weights and coding step shared by the band encoder and decoder
+class MixModel {
+private:
+    vector<uint32_t> m_tables[MIX_MODELS];  // probability (22 bits) << 10 | count (10 bits)
+    vector<int32_t> m_weights;              // per place and bit position, MIX_MODELS + 1 inputs (the last a bias)
+    uint32_t m_contexts[MIX_MODELS];
+    uint32_t m_lines[MIX_MODELS];
+    uint32_t* m_slots[MIX_MODELS];
+    int m_tableBits;
+    int m_inputs[MIX_MODELS + 1];
+    int32_t* m_weightSet = nullptr;
+    int m_place = 0;
+    vector<uint16_t> m_apm;                 // refines the mixed probability, per place and bits so far: 33 points (16 bits)
+    size_t m_apmSlot = 0;
+    int m_probability = 2048;               // the mixer's
+    int m_partial = 1;                      // bits of the byte so far, behind a leading 1
+    int m_bit = 0;
+
+    void selectLines() {
+        for (int i = 0; i < MIX_MODELS; i++)
+            m_lines[i] = mixHash(m_contexts[i], (uint32_t)m_partial, (uint32_t)m_place) >> (32 - m_tableBits) & ~15u;
+    }
+
+public:
+    // Tables sized for a band of count bytes: a byte takes at most two lines per model
+    explicit MixModel(size_t count) : m_weights(MixTracker::PLACES * 8 * (MIX_MODELS + 1), 1 << 14) {
+        m_tableBits = 12;
+        while (m_tableBits < MIX_TABLE_BITS && ((size_t)1 << m_tableBits) < count * 32) m_tableBits++;
+        for (auto& t : m_tables) t.assign((size_t)1 << m_tableBits, 1u << 31);
+        for (size_t k = MIX_MODELS; k < m_weights.size(); k += MIX_MODELS + 1) m_weights[k] = 0;
+        m_apm.resize(MixTracker::PLACES * 256 * 33);
+        for (size_t k = 0; k < m_apm.size(); k++) m_apm[k] = (uint16_t)(MixCurves::squashValue(((int)(k % 33) - 16) * 128) * 16);
+    }
+
+    // Starts a byte at place with its model contexts
+    void startByte(int place, const uint32_t* contexts) {
+        m_place = place;
+        m_partial = 1;
+        m_bit = 0;
+        memcpy(m_contexts, contexts, sizeof(m_contexts));
+        selectLines();
+    }
+
+    // Probability (12 bits) that the next bit is 1
+    int predict() {
+        const MixCurves& curves = mixCurves();
+        // the bits of the nibble so far, behind a leading 1, pick one of 15 slots of the line
+        int nibbleBits = m_bit & 3;
+        int slot = 1 << nibbleBits | (m_partial & ((1 << nibbleBits) - 1));
+        m_weightSet = &m_weights[(size_t)(m_place * 8 + m_bit) * (MIX_MODELS + 1)];
+        int64_t dot = 0;
+        for (int i = 0; i < MIX_MODELS; i++) {
+            m_slots[i] = &m_tables[i][m_lines[i] + slot];
+            m_inputs[i] = curves.stretch[*m_slots[i] >> 20];
+            dot += (int64_t)m_inputs[i] * m_weightSet[i];
+        }
+        m_inputs[MIX_MODELS] = 256;
+        dot += (int64_t)256 * m_weightSet[MIX_MODELS];
+        int mixed = (int)max<int64_t>(-2047, min<int64_t>(2047, dot >> 16));
+        m_probability = MixCurves::squashValue(mixed);
+
+        // the APM interpolates between the two points around the mixer's output, then gets 3/4 of the say
+        int position = mixed + 2048, weight = position & 127;
+        m_apmSlot = (size_t)(m_place * 256 + m_partial) * 33 + (position >> 7);
+        int refined = (m_apm[m_apmSlot] * (128 - weight) + m_apm[m_apmSlot + 1] * weight) >> 11;
+        if (weight >= 64) m_apmSlot++; // the nearer point learns
+        return min(4095, max(1, (m_probability + 3 * refined) >> 2));
+    }
+
+    void update(int bit) {
+        // mixer: each weight moves along its input, by how far off the mix was
+        int target = (bit << 16) + (bit << MIX_APM_RATE) - bit - bit;
+        m_apm[m_apmSlot] = (uint16_t)(m_apm[m_apmSlot] + ((target - m_apm[m_apmSlot]) >> MIX_APM_RATE));
+        int error = ((bit << 12) - m_probability);
+        for (int i = 0; i <= MIX_MODELS; i++) m_weightSet[i] += (m_inputs[i] * error) >> MIX_LEARNING_SHIFT;
+        // models: move towards the bit by 1 / (count + 1.5)
+        static const struct Rates {
+            int rate[1024];
+            Rates() { for (int n = 0; n < 1024; n++) rate[n] = 16384 / (n + n + 3); }
+        } rates;
+        for (int i = 0; i < MIX_MODELS; i++) {
+            uint32_t& s = *m_slots[i];
+            int count = s & 1023;
+            int p = (int)(s >> 10);
+            if (count < MIX_LIMIT) s++;
+            s += (uint32_t)((((bit << 22) - p) >> 3) * rates.rate[count]) & 0xFFFFFC00u;
+        }
+
+        m_partial = m_partial << 1 | bit;
+        m_bit++;
+        if (m_bit == 4) {
+            // a new line for the second nibble
+            selectLines();
+        }
+    }
+};
+
+// Binary arithmetic coder over 32-bit ranges, carry-free: the top byte goes out once both ends agree on it
+class MixEncoder {
+private:
+    vector<uint8_t>& m_out;
+    uint32_t m_low = 0, m_high = 0xFFFFFFFF;
+
+public:
+    explicit MixEncoder(vector<uint8_t>& out) : m_out(out) {}
+
+    void encode(int bit, int probability) {
+        uint32_t mid = m_low + (uint32_t)(((uint64_t)(m_high - m_low) * (uint32_t)probability) >> 12);
+        if (bit) m_high = mid;
+        else m_low = mid + 1;
+        while (((m_low ^ m_high) & 0xFF000000u) == 0) {
+            m_out.push_back((uint8_t)(m_high >> 24));
+            m_low <<= 8;
+            m_high = m_high << 8 | 255;
+        }
+    }
+
+    void flush() {
+        for (int i = 0; i < 4; i++) {
+            m_out.push_back((uint8_t)(m_low >> 24));
+            m_low <<= 8;
+        }
+    }
+};
+
+class MixDecoder {
+private:
+    const uint8_t* m_in;
+    const uint8_t* m_end;
+    uint32_t m_low = 0, m_high = 0xFFFFFFFF, m_code = 0;
+
+    uint8_t nextByte() {
+        return m_in < m_end ? *m_in++ : 0;
+    }
+
+public:
+    MixDecoder(const uint8_t* data, size_t size) : m_in(data), m_end(data + size) {
+        for (int i = 0; i < 4; i++) m_code = m_code << 8 | nextByte();
+    }
+
+    int decode(int probability) {
+        uint32_t mid = m_low + (uint32_t)(((uint64_t)(m_high - m_low) * (uint32_t)probability) >> 12);
+        int bit = m_code <= mid;
+        if (bit) m_high = mid;
+        else m_low = mid + 1;
+        while (((m_low ^ m_high) & 0xFF000000u) == 0) {
+            m_low <<= 8;
+            m_high = m_high << 8 | 255;
+            m_code = m_code << 8 | nextByte();
+        }
+        return bit;
+    }
+};
+
+inline void mixEncodeBand(const uint8_t* bytes, size_t count, uint32_t width, uint64_t firstPixel, vector<uint8_t>& out) {
+    MixTracker tracker(width, firstPixel);
+    MixModel model(count);
+    MixEncoder encoder(out);
+    uint32_t contexts[MIX_MODELS];
+    for (size_t i = 0; i < count; i++) {
+        tracker.contexts(contexts);
+        model.startByte(tracker.place(), contexts);
+        for (int b = 7; b >= 0; b--) {
+            int bit = (bytes[i] >> b) & 1;
+            encoder.encode(bit, model.predict());
+            model.update(bit);
+        }
+        tracker.push(bytes[i]);
+    }
+    encoder.flush();
+}
+
+inline void mixDecodeBand(const uint8_t* data, size_t size, uint32_t width, uint64_t firstPixel, uint8_t* out, size_t count) {
+    MixTracker tracker(width, firstPixel);
+    MixModel model(count);
+    MixDecoder decoder(data, size);
+    uint32_t contexts[MIX_MODELS];
+    for (size_t i = 0; i < count; i++) {
+        tracker.contexts(contexts);
+        model.startByte(tracker.place(), contexts);
+        int byte = 0;
+        for (int b = 0; b < 8; b++) {
+            int bit = decoder.decode(model.predict());
+            model.update(bit);
+            byte = byte << 1 | bit;
+        }
+        out[i] = (uint8_t)byte;
+        tracker.push((uint8_t)byte);
+    }
+}
+
+// Appends the stage data for bytes to out. width is the image width, or 0 if it is not known.
+inline void mixEncode(const uint8_t* bytes, size_t count, vector<uint8_t>& out, uint32_t width) {
+    // bands end at opcode boundaries; count the pixels on the way to know where each one starts
+    vector<size_t> starts{0};
+    vector<uint64_t> pixels{0};
+    uint64_t pixel = 0;
+    for (size_t pos = 0; pos < count;) {
+        uint8_t tag = bytes[pos];
+        pos += tag == 0xFE ? 4 : tag == 0xFF ? 5 : (tag >> 6) == 2 ? 2 : 1;
+        pixel += (tag >> 6) == 3 && tag < 0xFE ? (tag & 63) + 1 : 1;
+        if (pos - starts.back() >= MIX_BAND && pos < count) {
+            starts.push_back(pos);
+            pixels.push_back(pixel);
+        }
+    }
+    starts.push_back(count);
+    size_t bands = pixels.size();
+
+    vector<vector<uint8_t>> coded(bands);
+    ThreadPool::shared().parallelFor(bands, [&](size_t k) {
+        mixEncodeBand(bytes + starts[k], starts[k + 1] - starts[k], width, pixels[k], coded[k]);
+    });
+
+    storeBE(out, count, 8);
+    storeBE(out, width, 4);
+    storeBE(out, bands, 4);
+    for (size_t k = 0; k < bands; k++) {
+        storeBE(out, starts[k + 1] - starts[k], 8);
+        storeBE(out, pixels[k], 8);
+        storeBE(out, coded[k].size(), 8);
+    }
+    for (auto& band : coded) out.insert(out.end(), band.begin(), band.end());
+}
+
+// Undoes the stage into out. Returns false if the data is damaged or decodes to more than maxSize bytes.
+inline bool mixDecode(const uint8_t* data, size_t size, vector<uint8_t>& out, uint64_t maxSize) {
+    if (size < 16 || loadBE(data, 8) > maxSize) return false;
+    size_t total = (size_t)loadBE(data, 8);
+    uint32_t width = (uint32_t)loadBE(data + 8, 4);
+    uint64_t bands = loadBE(data + 12, 4);
+    if ((size - 16) / 24 < bands || width > maxSize) return false;
+
+    struct Band { size_t offset, count, codedOffset, codedSize; uint64_t pixel; };
+    vector<Band> list((size_t)bands);
+    size_t offset = 0, codedOffset = 16 + (size_t)bands * 24;
+    for (size_t k = 0; k < list.size(); k++) {
+        const uint8_t* entry = data + 16 + k * 24;
+        uint64_t count = loadBE(entry, 8), codedSize = loadBE(entry + 16, 8);
+        if (count > total - offset || codedSize > size - codedOffset) return false;
+        list[k] = {offset, (size_t)count, codedOffset, (size_t)codedSize, loadBE(entry + 8, 8)};
+        offset += (size_t)count;
+        codedOffset += (size_t)codedSize;
+    }
+    if (offset != total) return false;
+
+    out.resize(total);
+    ThreadPool::shared().parallelFor(list.size(), [&](size_t k) {
+        const Band& band = list[k];
+        mixDecodeBand(data + band.codedOffset, band.codedSize, width, band.pixel, out.data() + band.offset, band.count);
+    });
+    return true;
+}
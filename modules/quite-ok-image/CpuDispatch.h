@@ -0,0 +1,197 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <cstdlib>
+#include <cstdint>
+
+#include "QOIKernels.h"
+#include "BatchEncode.h"
+#include "RansKernels.h"
+#include "WideIndex.h"
+#include "Predict.h"
+
+#if defined(QOI_X86) && defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(QOI_X86)
+#include <cpuid.h>
+#endif
+
+using namespace std;
+
+// Instruction set tiers we build kernels for, in increasing order
+enum class CpuTier { Scalar = 0, SSE42 = 1, AVX2 = 2, AVX512 = 3 };
+
+inline const char* cpuTierName(CpuTier tier) {
+    switch (tier) {
+        case CpuTier::SSE42: return "sse4.2";
+        case CpuTier::AVX2: return "avx2";
+        case CpuTier::AVX512: return "avx512";
+        default: return "scalar";
+    }
+}
+
+// Function pointers for every hot loop, bound once per process to the best tier the host supports
+struct QOIKernels {
+    void (*encode)(const RGBValue* pixels, size_t count, RGBValue prevPixel, RGBValue* index, vector<uint8_t>& out);
+    void (*encodeExtended)(const RGBValue* pixels, size_t count, RGBValue prevPixel, RGBValue* index, IndexHash hash, vector<uint8_t>& out);
+    size_t (*decode)(const uint8_t* bytes, size_t count, RGBValue prevPixel, RGBValue* index, RGBValue* out, size_t pixelCount);
+    size_t (*decodeExtended)(const uint8_t* bytes, size_t count, RGBValue prevPixel, RGBValue* index, IndexHash hash, RGBValue* out, size_t pixelCount);
+    void (*encodeWide)(const RGBValue* pixels, size_t count, RGBValue prevPixel, RGBValue* index, IndexHash hash, WideIndex& wide, vector<uint8_t>& out);
+    size_t (*decodeWide)(const uint8_t* bytes, size_t count, RGBValue prevPixel, RGBValue* index, IndexHash hash, WideIndex& wide, RGBValue* out, size_t pixelCount);
+    void (*bgrToRGB)(const uint8_t* bgr, RGBValue* out, size_t count);
+    void (*rgbToBGR)(const RGBValue* in, uint8_t* bgr, size_t count);
+    void (*encodeBatch)(const RGBValue* const* images, size_t imageCount, size_t pixelCount, vector<uint8_t>* outs);
+    const uint8_t* (*ransDecode)(const uint32_t* table, uint32_t* states, const uint8_t* in, const uint8_t* inEnd, uint8_t* out, size_t count);
+    void (*scoreIndexHashes)(const RGBValue* pixels, size_t count, uint32_t* scores);
+    void (*encodePredicted)(const RGBValue* pixels, size_t width, size_t height, RGBValue* index, IndexHash hash, vector<uint8_t>& out);
+    size_t (*decodePredicted)(const uint8_t* bytes, size_t count, size_t width, RGBValue* index, IndexHash hash, RGBValue* out, size_t pixelCount);
+};
+
+struct CpuDispatch {
+    CpuTier detected = CpuTier::Scalar; // best tier supported by CPU and OS
+    CpuTier active = CpuTier::Scalar;   // tier the kernels are bound to
+    bool forced = false;                // QOI_CPU_TIER overrode the detected tier
+    QOIKernels kernels;
+};
+
+inline CpuTier detectCpuTier() {
+#ifdef QOI_X86
+    uint32_t regs[4] = {0, 0, 0, 0}; // eax, ebx, ecx, edx
+    auto cpuid = [&regs](uint32_t leaf, uint32_t subleaf) {
+#ifdef _MSC_VER
+        int r[4];
+        __cpuidex(r, (int)leaf, (int)subleaf);
+        for (int i=0; i<4; i++) regs[i] = (uint32_t)r[i];
+#else
+        __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+    };
+
+    cpuid(0, 0);
+    uint32_t maxLeaf = regs[0];
+    if (maxLeaf < 1) return CpuTier::Scalar;
+
+    cpuid(1, 0);
+    bool sse42 = (regs[2] >> 20) & 1;
+    bool osxsave = (regs[2] >> 27) & 1;
+    bool avx = (regs[2] >> 28) & 1;
+    if (!sse42) return CpuTier::Scalar;
+    if (!osxsave || !avx) return CpuTier::SSE42;
+
+    // the OS has to save the wider register state, otherwise AVX code faults
+#ifdef _MSC_VER
+    uint64_t xcr0 = _xgetbv(0);
+#else
+    uint32_t xcr0Lo, xcr0Hi;
+    __asm__ volatile("xgetbv" : "=a"(xcr0Lo), "=d"(xcr0Hi) : "c"(0));
+    uint64_t xcr0 = ((uint64_t)xcr0Hi << 32) | xcr0Lo;
+#endif
+    if ((xcr0 & 0x06) != 0x06 || maxLeaf < 7) return CpuTier::SSE42; // XMM | YMM state
+
+    cpuid(7, 0);
+    bool avx2 = (regs[1] >> 5) & 1;
+    bool avx512f = (regs[1] >> 16) & 1;
+    bool avx512bw = (regs[1] >> 30) & 1;
+    if (!avx2) return CpuTier::SSE42;
+    if (avx512f && avx512bw && (xcr0 & 0xE6) == 0xE6) return CpuTier::AVX512; // + opmask | ZMM state
+    return CpuTier::AVX2;
+#else
+    return CpuTier::Scalar;
+#endif
+}
+
+inline QOIKernels bindKernels(CpuTier tier) {
+    QOIKernels k = { encodeScalar, encodeClassifiedExtended<classifyScalar>, decodeScalar, decodeExtended<fillScalar>,
+                     encodeWide<classifyScalar>, decodeWide<fillScalar>, bgrToRGBScalar, rgbToBGRScalar, encodeEach<encodeScalar>, ransDecodeScalar,
+                     scoreIndexHashesScalar, encodePredicted<classifyFromScalar, predictRowsScalar>, decodePredicted<fillScalar> };
+#ifdef QOI_X86
+    switch (tier) {
+        case CpuTier::AVX512:
+            k.encode = encodeClassified<classifyAVX512>;
+            k.encodeExtended = encodeClassifiedExtended<classifyAVX512>;
+            k.decodeExtended = decodeExtended<fillAVX512>;
+            k.encodeWide = encodeWide<classifyAVX512>;
+            k.decodeWide = decodeWide<fillAVX512>;
+            k.encodePredicted = encodePredicted<classifyFromAVX512, predictRowsAVX2>;
+            k.decodePredicted = decodePredicted<fillAVX512>;
+            k.bgrToRGB = bgrToRGBAVX512;
+            k.rgbToBGR = rgbToBGRAVX512;
+            k.encodeBatch = encodeInLanes<16, encodeLanesAVX512>;
+            k.ransDecode = ransDecodeAVX512;
+            k.scoreIndexHashes = scoreIndexHashesAVX2;
+            break;
+        case CpuTier::AVX2:
+            k.encode = encodeClassified<classifyAVX2>;
+            k.encodeExtended = encodeClassifiedExtended<classifyAVX2>;
+            k.decodeExtended = decodeExtended<fillAVX2>;
+            k.encodeWide = encodeWide<classifyAVX2>;
+            k.decodeWide = decodeWide<fillAVX2>;
+            k.encodePredicted = encodePredicted<classifyFromAVX2, predictRowsAVX2>;
+            k.decodePredicted = decodePredicted<fillAVX2>;
+            k.bgrToRGB = bgrToRGBAVX2;
+            k.rgbToBGR = rgbToBGRAVX2;
+            k.encodeBatch = encodeInLanes<8, encodeLanesAVX2>;
+            k.ransDecode = ransDecodeAVX2;
+            k.scoreIndexHashes = scoreIndexHashesAVX2;
+            break;
+        case CpuTier::SSE42:
+            k.encode = encodeClassified<classifySSE42>;
+            k.encodeExtended = encodeClassifiedExtended<classifySSE42>;
+            k.decodeExtended = decodeExtended<fillSSE42>;
+            k.encodeWide = encodeWide<classifySSE42>;
+            k.decodeWide = decodeWide<fillSSE42>;
+            k.encodePredicted = encodePredicted<classifyFromSSE42, predictRowsScalar>;
+            k.decodePredicted = decodePredicted<fillSSE42>;
+            k.bgrToRGB = bgrToRGBSSE42;
+            k.rgbToBGR = rgbToBGRSSE42;
+            k.encodeBatch = encodeEach<encodeClassified<classifySSE42>>;
+            break;
+        default:
+            break;
+    }
+#endif
+    return k;
+}
+
+// Parses QOI_CPU_TIER (scalar | sse4.2 | avx2 | avx512), returns false if unset or unrecognised
+inline bool parseCpuTier(const char* name, CpuTier& tier) {
+    if (!name) return false;
+    string s(name);
+    if (s == "scalar") tier = CpuTier::Scalar;
+    else if (s == "sse4.2" || s == "sse42") tier = CpuTier::SSE42;
+    else if (s == "avx2") tier = CpuTier::AVX2;
+    else if (s == "avx512") tier = CpuTier::AVX512;
+    else return false;
+    return true;
+}
+
+// Probes the CPU on first use; every later call returns the same bound kernels
+inline const CpuDispatch& cpuDispatch() {
+    static const CpuDispatch dispatch = [] {
+        CpuDispatch d;
+        d.detected = detectCpuTier();
+        d.active = d.detected;
+
+        const char* env = getenv("QOI_CPU_TIER");
+        CpuTier requested;
+        if (parseCpuTier(env, requested)) {
+            if (requested > d.detected) {
+                cerr << "QOI_CPU_TIER=" << env << " not supported on this CPU, using " << cpuTierName(d.detected) << endl;
+            } else {
+                d.active = requested;
+                d.forced = requested != d.detected;
+            }
+        } else if (env && *env) {
+            cerr << "Unknown QOI_CPU_TIER=" << env << ", expected scalar, sse4.2, avx2 or avx512" << endl;
+        }
+
+        d.kernels = bindKernels(d.active);
+        return d;
+    }();
+    return dispatch;
+}
+
+inline const QOIKernels& qoiKernels() {
+    return cpuDispatch().kernels;
+}
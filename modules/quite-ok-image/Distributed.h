@@ -0,0 +1,240 @@
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <deque>
+
+#include "RGBValue.h"
+#include "Segmented.h"
+#include "Banded.h"
+
+#ifdef __unix__
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+// ----- SPLIT / ENCODE / MERGE ACROSS PROCESSES -----
+// One image is cut into row bands that separate processes encode on their own, locally or on other machines
+// sharing a directory. Each band is one segment (see Segmented.h), so the encoder state starts fresh at every
+// band and the parts only need to be concatenated. The merge checks that the parts tile the image and writes
+// one segmented QOI with a seek table.
+//
+// Part file: "qbnd", image width, image height, first row, row count (u32 big-endian), then the band's data chunks.
+// Workers write parts under a temporary name and rename them when done, so a half-written part is never merged.
+
+const char BAND_PART_MAGIC[4] = {'q', 'b', 'n', 'd'};
+
+struct BandRange {
+    uint32_t firstRow;
+    uint32_t rows;
+};
+
+// Splits height rows into count bands of nearly equal height
+inline vector<BandRange> planBands(uint32_t height, uint32_t count) {
+    count = max(1u, min(count, height));
+    vector<BandRange> bands;
+    for (uint32_t k = 0; k < count; k++) {
+        uint32_t first = (uint32_t)((uint64_t)height * k / count);
+        uint32_t next = (uint32_t)((uint64_t)height * (k + 1) / count);
+        bands.push_back({first, next - first});
+    }
+    return bands;
+}
+
+inline string bandPartPath(const string& workDir, const string& name, size_t band) {
+    return workDir + "/" + name + ".band" + to_string(band) + ".part";
+}
+
+// Worker side: encodes rows [firstRow, firstRow + rows) of a BMP into a part file. Returns false on failure.
+inline bool encodeBandFile(const string& bmpPath, const string& partPath, uint32_t firstRow, uint32_t rows) {
+    MappedBMP bmp;
+    if (!bmp.open(bmpPath)) return false;
+    if (rows == 0 || firstRow >= bmp.height || rows > bmp.height - firstRow) {
+        cerr << "Band rows " << firstRow << "+" << rows << " are outside the image." << endl;
+        return false;
+    }
+
+    vector<RGBValue> pixels((size_t)rows * bmp.width);
+    bmp.readRows(firstRow, rows, pixels.data());
+
+    vector<uint8_t> part(BAND_PART_MAGIC, BAND_PART_MAGIC + 4);
+    storeBE(part, bmp.width, 4);
+    storeBE(part, bmp.height, 4);
+    storeBE(part, firstRow, 4);
+    storeBE(part, rows, 4);
+    encodeSegment(pixels.data(), pixels.size(), part);
+
+    string tmpPath = partPath + ".tmp";
+    ofstream file(tmpPath, ios::binary);
+    file.write(reinterpret_cast<const char*>(part.data()), part.size());
+    file.close();
+    if (!file) {
+        cerr << "Failed to write band part " << tmpPath << "." << endl;
+        remove(tmpPath.c_str());
+        return false;
+    }
+    remove(partPath.c_str());
+    return rename(tmpPath.c_str(), partPath.c_str()) == 0;
+}
+
+// Writes the merged file to out, stops at the first part that does not fit
+inline bool writeMergedBands(const vector<string>& partPaths, ofstream& out) {
+    uint32_t width = 0, height = 0, nextRow = 0;
+    vector<QOISegment> segments;
+    uint64_t byteOffset = 0;
+
+    for (size_t k = 0; k < partPaths.size(); k++) {
+        ifstream file(partPaths[k], ios::binary);
+        if (!file) {
+            cerr << "Band part " << partPaths[k] << " is missing." << endl;
+            return false;
+        }
+        uint8_t header[20] = {};
+        file.read(reinterpret_cast<char*>(header), 20);
+        uint32_t partWidth = (uint32_t)loadBE(header + 4, 4), partHeight = (uint32_t)loadBE(header + 8, 4);
+        uint32_t firstRow = (uint32_t)loadBE(header + 12, 4), rows = (uint32_t)loadBE(header + 16, 4);
+        if (!file || memcmp(header, BAND_PART_MAGIC, 4) != 0) {
+            cerr << "Band part " << partPaths[k] << " is not a band part." << endl;
+            return false;
+        }
+        if (k == 0) {
+            width = partWidth;
+            height = partHeight;
+            vector<uint8_t> qoiHeader = {'q', 'o', 'i', 'f'};
+            storeBE(qoiHeader, width, 4);
+            storeBE(qoiHeader, height, 4);
+            qoiHeader.push_back(3); // channels
+            qoiHeader.push_back(0); // colorspace
+            out.write(reinterpret_cast<const char*>(qoiHeader.data()), qoiHeader.size());
+        }
+        if (partWidth != width || partHeight != height || firstRow != nextRow || rows == 0 || rows > height - firstRow) {
+            cerr << "Band part " << partPaths[k] << " (rows " << firstRow << "+" << rows << ") does not continue at row "
+                 << nextRow << "." << endl;
+            return false;
+        }
+
+        segments.push_back({byteOffset, (uint64_t)firstRow * width});
+        out << file.rdbuf();
+        byteOffset = (uint64_t)out.tellp() - 14;
+        nextRow = firstRow + rows;
+    }
+    if (segments.empty() || nextRow != height) {
+        cerr << "Band parts end at row " << nextRow << " of " << height << "." << endl;
+        return false;
+    }
+
+    const char endMarker[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+    out.write(endMarker, 8);
+    vector<uint8_t> table = serializeSeekTable(segments);
+    out.write(reinterpret_cast<const char*>(table.data()), table.size());
+    return (bool)out;
+}
+
+// Coordinator side: checks that the parts, in order, cover the image exactly and concatenates them into a
+// segmented QOI file. Returns false, naming the offending part, if one is missing or does not fit; no output
+// file is left behind then.
+inline bool mergeBandFiles(const vector<string>& partPaths, const string& qoiPath) {
+    string tmpPath = qoiPath + ".tmp";
+    ofstream out(tmpPath, ios::binary);
+    if (!out) {
+        cerr << "Failed to open QOI file for writing." << endl;
+        return false;
+    }
+    bool ok = writeMergedBands(partPaths, out);
+    out.close();
+    if (ok && !out) {
+        cerr << "Failed to write QOI file." << endl;
+        ok = false;
+    }
+    if (ok) {
+        remove(qoiPath.c_str());
+        ok = rename(tmpPath.c_str(), qoiPath.c_str()) == 0;
+    }
+    if (!ok) remove(tmpPath.c_str());
+    return ok;
+}
+
+// Encodes a BMP as bands in up to `processes` local worker processes at a time, then merges the parts. The
+// parts go to workDir and are removed after a successful merge. A worker is workerProgram run as
+// "<workerProgram> encode-band <bmp> <part> <first row> <rows>", so it must handle that command like
+// QOIConverter.cpp does (a program embedding this header can pass "/proc/self/exe" if it does). Workers are
+// started with fork() and exec, so the child runs no library code from this possibly multi-threaded process,
+// and only the workers' own pids are waited for. Without fork() or a workerProgram, or if it cannot be run,
+// the bands run one by one in this process; so does a band whose worker could not be exec'd (exit status 127).
+// Returns false if a worker or the merge failed.
+inline bool encodeDistributed(const string& bmpPath, const string& qoiPath, const string& workDir,
+                              uint32_t bandCount, uint32_t processes, const string& workerProgram = "") {
+    MappedBMP bmp;
+    if (!bmp.open(bmpPath)) return false;
+    vector<BandRange> bands = planBands(bmp.height, bandCount);
+    bmp.file.close();
+
+    string name = qoiPath.substr(qoiPath.find_last_of("/\\") + 1);
+    vector<string> parts;
+    for (size_t k = 0; k < bands.size(); k++) parts.push_back(bandPartPath(workDir, name, k));
+
+    bool ok = true;
+    vector<size_t> local; // bands encoded in this process
+#ifdef __unix__
+    if (!workerProgram.empty() && access(workerProgram.c_str(), X_OK) == 0) {
+        processes = max(1u, processes);
+        // waits for one worker (pid, band), oldest first; bands take about equally long
+        deque<pair<pid_t, size_t>> running;
+        auto reap = [&] {
+            int status = 0;
+            pid_t pid;
+            do pid = waitpid(running.front().first, &status, 0); while (pid < 0 && errno == EINTR);
+            size_t band = running.front().second;
+            running.pop_front();
+            if (pid >= 0 && WIFEXITED(status) && WEXITSTATUS(status) == 127) local.push_back(band); // exec failed
+            else if (pid < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) ok = false;
+        };
+        for (size_t k = 0; k < bands.size() && ok; k++) {
+            // the arguments are built before fork(): between fork() and exec the child only calls async-signal-safe functions
+            vector<string> args = {workerProgram, "encode-band", bmpPath, parts[k], to_string(bands[k].firstRow), to_string(bands[k].rows)};
+            vector<char*> argv;
+            for (auto& arg : args) argv.push_back(&arg[0]);
+            argv.push_back(nullptr);
+
+            if (running.size() >= processes) reap();
+            cout.flush();
+            cerr.flush();
+            pid_t pid = fork();
+            if (pid == 0) {
+                execv(argv[0], argv.data());
+                _exit(127);
+            }
+            if (pid < 0) {
+                cerr << "Failed to start a band worker." << endl;
+                ok = false;
+                break;
+            }
+            running.push_back({pid, k});
+        }
+        while (!running.empty()) reap();
+    }
+    else
+#endif
+    {
+        (void)processes;
+        for (size_t k = 0; k < bands.size(); k++) local.push_back(k);
+    }
+    for (size_t i = 0; i < local.size() && ok; i++)
+        ok = encodeBandFile(bmpPath, parts[local[i]], bands[local[i]].firstRow, bands[local[i]].rows);
+
+    if (!ok) {
+        cerr << "A band worker failed." << endl;
+        return false;
+    }
+    if (!mergeBandFiles(parts, qoiPath)) return false;
+    for (auto& part : parts) remove(part.c_str());
+    return true;
+}
@@ -0,0 +1,317 @@
+#pragma once
+
+#include <vector>
+#include <queue>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <functional>
+
+#include "Segmented.h"
+#include "PlaceStreams.h"
+
+using namespace std;
+
+// ----- CANONICAL HUFFMAN STAGE -----
+// The cheap option: static prefix codes, no arithmetic at all. The body is cut into blocks of about HUFFMAN_BLOCK
+// bytes at opcode boundaries, and each block into its five place streams (PlaceStreams.h), each with its own
+// canonical code. Codes are at most HUFFMAN_MAX_BITS long, so one lookup of that many bits always finds the next
+// code, and the decode table built from it holds every code that fits whole into those bits: on QOI bytes a
+// lookup usually gives 2 or 3 symbols. Codes are written most significant bit first.
+//
+// Block: byte count (u32 BE), then per stream its symbol count (u32 BE) and, if not empty, a mode byte:
+//   0  stored: the symbols as they are
+//   1  Huffman: 32-byte bitmap of the symbols present, their code lengths (4 bits each, first in the high
+//      nibble, padded to a byte), coded size (u32 BE), then the codes
+// A stream is stored when coding it would not make it smaller.
+
+const size_t HUFFMAN_BLOCK = 1 << 16;
+const int HUFFMAN_MAX_BITS = 11;
+const int HUFFMAN_MAX_SYMBOLS = 3; // per table lookup
+
+// Code lengths for the symbol counts, none longer than HUFFMAN_MAX_BITS
+inline void huffmanLengths(const size_t* counts, uint8_t* lengths) {
+    memset(lengths, 0, 256);
+    priority_queue<pair<size_t, int>, vector<pair<size_t, int>>, greater<pair<size_t, int>>> queue;
+    for (int s = 0; s < 256; s++)
+        if (counts[s]) queue.push({counts[s], s});
+    if (queue.size() == 1) {
+        lengths[queue.top().second] = 1;
+        return;
+    }
+
+    // nodes 0-255 are the symbols, merged nodes are numbered from 256 on, so a parent always comes after its children
+    int parent[511];
+    int next = 256;
+    while (queue.size() > 1) {
+        pair<size_t, int> a = queue.top();
+        queue.pop();
+        pair<size_t, int> b = queue.top();
+        queue.pop();
+        parent[a.second] = parent[b.second] = next;
+        queue.push({a.first + b.first, next++});
+    }
+    int depth[511];
+    depth[next - 1] = 0;
+    for (int n = next - 2; n >= 256; n--) depth[n] = depth[parent[n]] + 1;
+    bool tooLong = false;
+    for (int s = 0; s < 256; s++) {
+        if (!counts[s]) continue;
+        lengths[s] = (uint8_t)min(depth[parent[s]] + 1, 255);
+        tooLong |= lengths[s] > HUFFMAN_MAX_BITS;
+    }
+    if (!tooLong) return;
+
+    // Cut the long codes down, then lengthen codes, rarest symbols first, until the lengths fit a prefix code
+    // again (Kraft sum counted in units of 2^-HUFFMAN_MAX_BITS)
+    uint32_t kraft = 0;
+    for (int s = 0; s < 256; s++) {
+        if (!lengths[s]) continue;
+        lengths[s] = (uint8_t)min<int>(lengths[s], HUFFMAN_MAX_BITS);
+        kraft += 1u << (HUFFMAN_MAX_BITS - lengths[s]);
+    }
+    vector<int> byCount;
+    for (int s = 0; s < 256; s++)
+        if (counts[s]) byCount.push_back(s);
+    stable_sort(byCount.begin(), byCount.end(), [&](int a, int b) { return counts[a] < counts[b]; });
+    while (kraft > (1u << HUFFMAN_MAX_BITS)) {
+        for (int s : byCount) {
+            if (lengths[s] == HUFFMAN_MAX_BITS) continue;
+            kraft -= 1u << (HUFFMAN_MAX_BITS - lengths[s] - 1);
+            lengths[s]++;
+            if (kraft <= (1u << HUFFMAN_MAX_BITS)) break;
+        }
+    }
+}
+
+// Canonical codes for the lengths: shorter codes first, equal lengths in symbol order. Returns false if the
+// lengths do not fit a prefix code.
+inline bool huffmanCodes(const uint8_t* lengths, uint16_t* codes) {
+    uint32_t perLength[HUFFMAN_MAX_BITS + 1] = {};
+    uint32_t kraft = 0;
+    for (int s = 0; s < 256; s++) {
+        if (!lengths[s]) continue;
+        if (lengths[s] > HUFFMAN_MAX_BITS) return false;
+        perLength[lengths[s]]++;
+        kraft += 1u << (HUFFMAN_MAX_BITS - lengths[s]);
+    }
+    if (kraft > (1u << HUFFMAN_MAX_BITS)) return false;
+
+    uint32_t next[HUFFMAN_MAX_BITS + 1] = {};
+    for (int l = 1, code = 0; l <= HUFFMAN_MAX_BITS; l++) {
+        code = (code + perLength[l - 1]) << 1;
+        next[l] = code;
+    }
+    for (int s = 0; s < 256; s++)
+        if (lengths[s]) codes[s] = (uint16_t)next[lengths[s]]++;
+    return true;
+}
+
+// Appends one stream: symbol count, then the symbols stored or coded
+inline void huffmanEncodeStream(const uint8_t* symbols, size_t count, vector<uint8_t>& out) {
+    storeBE(out, count, 4);
+    if (count == 0) return;
+
+    size_t counts[256] = {};
+    for (size_t i = 0; i < count; i++) counts[symbols[i]]++;
+    uint8_t lengths[256];
+    uint16_t codes[256];
+    huffmanLengths(counts, lengths);
+    huffmanCodes(lengths, codes);
+
+    vector<uint8_t> table(32, 0);
+    int nibbles = 0;
+    for (int s = 0; s < 256; s++) {
+        if (!lengths[s]) continue;
+        table[s >> 3] |= (uint8_t)(1 << (s & 7));
+        if (nibbles++ % 2 == 0) table.push_back((uint8_t)(lengths[s] << 4));
+        else table.back() |= lengths[s];
+    }
+
+    // whole bytes are taken off the top of the bit buffer as soon as there are 32 bits in it
+    vector<uint8_t> coded(count * HUFFMAN_MAX_BITS / 8 + 8);
+    uint8_t* p = coded.data();
+    uint64_t bits = 0;
+    int bitCount = 0;
+    for (size_t i = 0; i < count; i++) {
+        bits = (bits << lengths[symbols[i]]) | codes[symbols[i]];
+        bitCount += lengths[symbols[i]];
+        if (bitCount >= 32) {
+            bitCount -= 32;
+            uint32_t word = (uint32_t)(bits >> bitCount);
+            p[0] = (uint8_t)(word >> 24);
+            p[1] = (uint8_t)(word >> 16);
+            p[2] = (uint8_t)(word >> 8);
+            p[3] = (uint8_t)word;
+            p += 4;
+        }
+    }
+    for (; bitCount > 0; bitCount -= 8) *p++ = (uint8_t)(bitCount >= 8 ? bits >> (bitCount - 8) : bits << (8 - bitCount));
+    size_t codedSize = p - coded.data();
+
+    if (table.size() + 4 + codedSize >= count) {
+        out.push_back(0);
+        out.insert(out.end(), symbols, symbols + count);
+        return;
+    }
+    out.push_back(1);
+    out.insert(out.end(), table.begin(), table.end());
+    storeBE(out, codedSize, 4);
+    out.insert(out.end(), coded.data(), p);
+}
+
+// Decode tables for one code, indexed by the next HUFFMAN_MAX_BITS bits of input:
+//   single[bits]  the first symbol | its length << 8
+//   multi[bits]   up to 3 symbols (one per byte, first in the low byte) | bits they take << 24 | how many << 28
+struct HuffmanTables {
+    uint16_t single[1 << HUFFMAN_MAX_BITS];
+    uint32_t multi[1 << HUFFMAN_MAX_BITS];
+
+    // Returns false if the lengths do not fit a prefix code
+    bool build(const uint8_t* lengths) {
+        uint16_t codes[256];
+        if (!huffmanCodes(lengths, codes)) return false;
+        // bits no code starts with only turn up in damaged data: they decode to symbol 0
+        for (auto& e : single) e = (uint16_t)(HUFFMAN_MAX_BITS << 8);
+        for (int s = 0; s < 256; s++) {
+            if (!lengths[s]) continue;
+            int shift = HUFFMAN_MAX_BITS - lengths[s];
+            for (uint32_t k = 0; k < (1u << shift); k++) single[(codes[s] << shift) | k] = (uint16_t)(s | lengths[s] << 8);
+        }
+
+        const uint32_t mask = (1u << HUFFMAN_MAX_BITS) - 1;
+        for (uint32_t bits = 0; bits <= mask; bits++) {
+            uint32_t symbols = 0;
+            int used = 0, n = 0;
+            while (n < HUFFMAN_MAX_SYMBOLS) {
+                uint16_t e = single[(bits << used) & mask];
+                if (used + (e >> 8) > HUFFMAN_MAX_BITS) break;
+                symbols |= (uint32_t)(e & 0xFF) << (8 * n++);
+                used += e >> 8;
+            }
+            multi[bits] = symbols | (uint32_t)used << 24 | (uint32_t)n << 28;
+        }
+        return true;
+    }
+};
+
+// Decodes count symbols from the codes in [in, inEnd) into out. Past the end of the input it reads zeros.
+inline void huffmanDecodeCodes(const HuffmanTables& tables, const uint8_t* in, const uint8_t* inEnd, uint8_t* out, size_t count) {
+    uint64_t bits = 0; // next input bits, from the top
+    int bitCount = 0;
+    uint8_t* o = out;
+    uint8_t* outEnd = out + count;
+
+    // One refill gives at least 56 bits, enough for 4 lookups of up to HUFFMAN_MAX_BITS each
+    while (outEnd - o >= 4 * HUFFMAN_MAX_SYMBOLS && inEnd - in >= 8) {
+        bits |= loadBE(in, 8) >> bitCount;
+        in += (63 - bitCount) >> 3;
+        bitCount |= 56;
+        for (int k = 0; k < 4; k++) {
+            uint32_t e = tables.multi[bits >> (64 - HUFFMAN_MAX_BITS)];
+            o[0] = (uint8_t)e;
+            o[1] = (uint8_t)(e >> 8);
+            o[2] = (uint8_t)(e >> 16);
+            o += e >> 28;
+            int used = (e >> 24) & 0xF;
+            bits <<= used;
+            bitCount -= used;
+        }
+    }
+
+    // the rest one symbol at a time, refilling byte by byte
+    while (o < outEnd) {
+        while (bitCount <= 56) {
+            bits |= (uint64_t)(in < inEnd ? *in++ : 0) << (56 - bitCount);
+            bitCount += 8;
+        }
+        uint16_t e = tables.single[bits >> (64 - HUFFMAN_MAX_BITS)];
+        *o++ = (uint8_t)e;
+        bits <<= e >> 8;
+        bitCount -= e >> 8;
+    }
+}
+
+// Reads one stream from p into out (room for maxCount symbols), advancing p. Returns false if it is damaged.
+inline bool huffmanDecodeStream(const uint8_t*& p, const uint8_t* end, uint8_t* out, size_t maxCount, size_t& count,
+                                HuffmanTables& tables) {
+    if (end - p < 4) return false;
+    count = (size_t)loadBE(p, 4);
+    p += 4;
+    if (count > maxCount) return false;
+    if (count == 0) return true;
+    if (end - p < 1) return false;
+    uint8_t mode = *p++;
+
+    if (mode == 0) {
+        if ((size_t)(end - p) < count) return false;
+        memcpy(out, p, count);
+        p += count;
+        return true;
+    }
+    if (mode != 1 || end - p < 32) return false;
+
+    const uint8_t* present = p;
+    p += 32;
+    uint8_t lengths[256] = {};
+    int nibbles = 0;
+    for (int s = 0; s < 256; s++) {
+        if (!((present[s >> 3] >> (s & 7)) & 1)) continue;
+        if (nibbles % 2 == 0 && p == end) return false;
+        lengths[s] = (nibbles++ % 2 == 0) ? (*p >> 4) : (*p++ & 0xF);
+        if (lengths[s] == 0) return false;
+    }
+    if (nibbles % 2) p++;
+    if (nibbles == 0 || !tables.build(lengths) || end - p < 4) return false;
+
+    size_t codedSize = (size_t)loadBE(p, 4);
+    p += 4;
+    if ((size_t)(end - p) < codedSize) return false;
+    huffmanDecodeCodes(tables, p, p + codedSize, out, count);
+    p += codedSize;
+    return true;
+}
+
+// Appends the stage data for bytes to out
+inline void huffmanEncode(const uint8_t* bytes, size_t count, vector<uint8_t>& out) {
+    storeBE(out, count, 8);
+    vector<uint8_t> streams[PLACE_STREAMS];
+    for (auto& s : streams) s.reserve(HUFFMAN_BLOCK + 4);
+    for (size_t pos = 0; pos < count;) {
+        for (auto& s : streams) s.clear();
+        size_t end = splitPlaces(bytes, count, pos, HUFFMAN_BLOCK, streams);
+        storeBE(out, end - pos, 4);
+        for (auto& s : streams) huffmanEncodeStream(s.data(), s.size(), out);
+        pos = end;
+    }
+}
+
+// Undoes the stage into out. Returns false if the data is damaged or decodes to more than maxSize bytes.
+inline bool huffmanDecode(const uint8_t* data, size_t size, vector<uint8_t>& out, uint64_t maxSize) {
+    if (size < 8 || loadBE(data, 8) > maxSize) return false;
+    size_t total = (size_t)loadBE(data, 8);
+    out.resize(total);
+
+    vector<uint8_t> scratch(HUFFMAN_BLOCK + 4 + MERGE_SLACK); // a block's streams, one after another
+    HuffmanTables tables;
+    const uint8_t* p = data + 8;
+    const uint8_t* end = data + size;
+    for (size_t done = 0; done < total;) {
+        if (end - p < 4) return false;
+        size_t blockSize = (size_t)loadBE(p, 4);
+        p += 4;
+        if (blockSize == 0 || blockSize > HUFFMAN_BLOCK + 4 || blockSize > total - done) return false;
+
+        const uint8_t* streams[PLACE_STREAMS];
+        size_t sizes[PLACE_STREAMS];
+        size_t offset = 0;
+        for (int k = 0; k < PLACE_STREAMS; k++) {
+            if (!huffmanDecodeStream(p, end, scratch.data() + offset, blockSize - offset, sizes[k], tables)) return false;
+            streams[k] = scratch.data() + offset;
+            offset += sizes[k];
+        }
+        if (!mergePlaces(streams, sizes, out.data() + done, blockSize)) return false;
+        done += blockSize;
+    }
+    return true;
+}
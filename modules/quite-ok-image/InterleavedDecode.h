@@ -0,0 +1,187 @@
+#pragma once
+
+#include <vector>
+#include <cstring>
+
+#include "RGBValue.h"
+#include "QOIKernels.h"
+
+using namespace std;
+
+// ----- INTERLEAVED MULTI-STREAM DECODE -----
+// A single QOI stream is one long dependency chain (every pixel needs the one before it), which leaves most
+// execution units idle. decodeInterleaved() steps N independent streams in lockstep on one thread so their
+// chains overlap. Each step is branch-free apart from runs: the opcode tag selects, through a lookup table,
+// between the RGB payload, the index entry and prev + packed per-channel delta.
+// Pixels are handled as little-endian uint32 {r, g, b, isNull = 0}, the same bytes as RGBValue.
+
+struct DecodeStream {
+    const uint8_t* bytes;
+    size_t count;
+    RGBValue* out;
+    size_t pixelCount;
+    size_t decoded = 0; // filled in by the decoder
+};
+
+// Per-channel add mod 256, no carries between channels
+inline uint32_t addChannels(uint32_t x, uint32_t y) {
+    return ((x & 0x7F7F7F7F) + (y & 0x7F7F7F7F)) ^ ((x ^ y) & 0x80808080);
+}
+
+inline uint32_t packDelta(int dr, int dg, int db) {
+    return (uint32_t)(uint8_t)dr | ((uint32_t)(uint8_t)dg << 8) | ((uint32_t)(uint8_t)db << 16);
+}
+
+// Everything a step needs about one tag byte, in one cache line half
+struct alignas(32) LaneOp {
+    uint32_t delta;     // QOI_OP_DIFF delta, or the dg part of QOI_OP_LUMA, else 0 (RUN keeps prev)
+    uint32_t lumaMask;  // ~0 for QOI_OP_LUMA tags
+    uint32_t deltaMask; // result comes from prev + delta
+    uint32_t rgbMask;   // result comes from the QOI_OP_RGB payload
+    uint32_t indexMask; // result comes from index[tag]
+    uint8_t length;
+    uint8_t pixels;
+};
+
+struct LaneOpTable {
+    LaneOp op[256];
+    uint32_t lumaSecond[256]; // second LUMA byte -> (dr - dg, 0, db - dg)
+
+    LaneOpTable() {
+        for (int b = 0; b < 256; b++) {
+            LaneOp& o = op[b];
+            o.delta = o.lumaMask = o.deltaMask = o.rgbMask = o.indexMask = 0;
+            o.length = 1;
+            o.pixels = 1;
+            lumaSecond[b] = packDelta(((b >> 4) & 0b1111) - 8, 0, (b & 0b1111) - 8);
+
+            if (b == 0b11111110) { // QOI_OP_RGB
+                o.rgbMask = ~0u;
+                o.length = 4;
+            } else if (b >> 6 == 0b00) { // QOI_OP_INDEX
+                o.indexMask = ~0u;
+            } else if (b >> 6 == 0b01) { // QOI_OP_DIFF
+                o.deltaMask = ~0u;
+                o.delta = packDelta(((b >> 4) & 0b11) - 2, ((b >> 2) & 0b11) - 2, (b & 0b11) - 2);
+            } else if (b >> 6 == 0b10) { // QOI_OP_LUMA
+                o.deltaMask = o.lumaMask = ~0u;
+                int dg = (b & 0b111111) - 32;
+                o.delta = packDelta(dg, dg, dg);
+                o.length = 2;
+            } else { // QOI_OP_RUN
+                o.deltaMask = ~0u;
+                o.pixels = (b & 0b111111) + 1;
+            }
+        }
+    }
+};
+
+struct DecodeLane {
+    DecodeStream* stream = nullptr;
+    const uint8_t* p;
+    const uint8_t* end;
+    RGBValue* out;
+    RGBValue* outEnd;
+    uint32_t prev;
+    uint32_t index[64];
+};
+
+inline uint8_t hashPacked(uint32_t px) {
+    uint32_t r = px & 0xFF, g = (px >> 8) & 0xFF, b = (px >> 16) & 0xFF;
+    return (r*3 + g*5 + b*7 + 255*11) % 64;
+}
+
+inline void startLane(DecodeLane& lane, DecodeStream* stream) {
+    lane.stream = stream;
+    lane.p = stream->bytes;
+    lane.end = stream->bytes + stream->count;
+    lane.out = stream->out;
+    lane.outEnd = stream->out + stream->pixelCount;
+    lane.prev = 0; // opaque black
+    memset(lane.index, 0, sizeof(lane.index)); // an empty slot reads as black, as in decodeScalar
+}
+
+// Hands the last few bytes (where the 4-byte lookahead would overrun) to the scalar decoder
+inline void finishLane(DecodeLane& lane) {
+    RGBValue prev, index[64];
+    memcpy(static_cast<void*>(&prev), &lane.prev, 4);
+    for (int h = 0; h < 64; h++) memcpy(static_cast<void*>(&index[h]), &lane.index[h], 4);
+
+    size_t done = lane.out - lane.stream->out;
+    done += decodeScalar(lane.p, lane.end - lane.p, prev, index, lane.out, lane.outEnd - lane.out);
+    lane.stream->decoded = done;
+    lane.stream = nullptr;
+}
+
+// One opcode of one lane, needs 4 readable bytes at p. The lane state is passed in pieces so the
+// caller can keep it in registers across a block of steps.
+inline void stepLane(const uint8_t*& p, RGBValue*& out, RGBValue* outEnd, uint32_t& prev, uint32_t* index,
+                     const LaneOpTable& table) {
+    const LaneOp& op = table.op[p[0]];
+    uint32_t payload;
+    memcpy(&payload, p, 4);
+
+    uint32_t d = addChannels(op.delta, table.lumaSecond[p[1]] & op.lumaMask);
+    uint32_t px = (addChannels(prev, d) & op.deltaMask)
+                | ((payload >> 8) & op.rgbMask)
+                | (index[p[0] & 0b111111] & op.indexMask);
+    px &= 0x00FFFFFF;
+
+    index[hashPacked(px)] = px;
+    prev = px;
+
+    size_t n = min((size_t)op.pixels, (size_t)(outEnd - out));
+    for (size_t i = 0; i < n; i++)
+        memcpy(static_cast<void*>(out + i), &px, 4);
+
+    out += n;
+    p += op.length;
+}
+
+// Decodes every stream, N at a time, refilling a lane as soon as its stream finishes.
+// Once fewer than N streams are left the rest go through the scalar decoder.
+template <int N>
+void decodeInterleaved(DecodeStream* streams, size_t count) {
+    static const LaneOpTable table;
+    DecodeLane lanes[N];
+    size_t next = 0;
+
+    while (true) {
+        bool full = true;
+        size_t steps = SIZE_MAX;
+        for (int l = 0; l < N; l++) {
+            DecodeLane& lane = lanes[l];
+            while (!lane.stream || lane.end - lane.p < 4 || lane.out >= lane.outEnd) {
+                if (lane.stream) finishLane(lane);
+                if (next == count) break;
+                startLane(lane, &streams[next++]);
+            }
+            if (!lane.stream) full = false;
+            else steps = min(steps, (size_t)(lane.end - lane.p) / 4); // an opcode is at most 4 bytes
+        }
+        if (!full) break;
+
+        // a lane that fills its output early keeps stepping harmlessly (nothing is written) until the block ends
+        const uint8_t* p[N];
+        RGBValue* out[N];
+        uint32_t prev[N];
+        for (int l = 0; l < N; l++) {
+            p[l] = lanes[l].p;
+            out[l] = lanes[l].out;
+            prev[l] = lanes[l].prev;
+        }
+        for (size_t s = 0; s < steps; s++) {
+            #pragma GCC unroll 16
+            for (int l = 0; l < N; l++)
+                stepLane(p[l], out[l], lanes[l].outEnd, prev[l], lanes[l].index, table);
+        }
+        for (int l = 0; l < N; l++) {
+            lanes[l].p = p[l];
+            lanes[l].out = out[l];
+            lanes[l].prev = prev[l];
+        }
+    }
+
+    for (int l = 0; l < N; l++)
+        if (lanes[l].stream) finishLane(lanes[l]);
+}
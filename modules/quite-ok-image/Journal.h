@@ -0,0 +1,160 @@
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <mutex>
+#include <cstring>
+#include <cstdlib>
+#include <cstdint>
+#include <filesystem>
+
+#include "BatchConverter.h"
+
+using namespace std;
+
+// ----- RESUMABLE BATCH CONVERSION -----
+// A batch records every finished output in an append-only journal. After a restart the journal is read back and
+// jobs whose output is still there, with the recorded size (and checksum, if asked to verify), are skipped.
+// Outputs are renamed into place only when complete (see BatchConverter), so an interrupted job never leaves a
+// partial output behind, and a torn last journal line is ignored.
+//
+// Journal: "qoi-journal 1", then per finished job "<output>\t<size>\t<checksum, hex>\t<input>". Each line is
+// flushed when written, which survives the process being killed (not a power loss).
+
+// 64-bit checksum, 8 bytes per step across four independent lanes
+inline uint64_t checksumBytes(const uint8_t* data, size_t size, uint64_t seed = 0) {
+    const uint64_t prime = 0x9E3779B97F4A7C15ull;
+    uint64_t lanes[4] = {seed, seed + 1, seed + 2, seed + 3};
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        for (int l = 0; l < 4; l++) {
+            uint64_t word;
+            memcpy(&word, data + i + l * 8, 8);
+            lanes[l] = ((lanes[l] ^ word) * prime);
+            lanes[l] ^= lanes[l] >> 29;
+        }
+    }
+    uint64_t hash = size;
+    for (int l = 0; l < 4; l++) hash = (hash ^ lanes[l]) * prime;
+    for (; i < size; i++) hash = (hash ^ data[i]) * prime;
+    return hash ^ (hash >> 32);
+}
+
+// Checksum of a whole file read in 1 MB blocks, each block's result seeding the next
+inline uint64_t fileChecksum(const string& path) {
+    ifstream file(path, ios::binary);
+    vector<uint8_t> block(1 << 20);
+    uint64_t hash = 0;
+    while (file) {
+        file.read(reinterpret_cast<char*>(block.data()), block.size());
+        size_t got = (size_t)file.gcount();
+        if (got == 0) break;
+        hash = checksumBytes(block.data(), got, hash);
+    }
+    return hash;
+}
+
+struct JournalEntry {
+    uint64_t size;
+    uint64_t checksum;
+    string input;
+};
+
+class ConversionJournal {
+private:
+    unordered_map<string, JournalEntry> m_done; // by output path
+    ofstream m_log;
+    mutex m_mutex;
+
+public:
+    // Loads what an earlier run finished and opens the journal for appending. Returns false if it cannot be written.
+    bool open(const string& path) {
+        m_done.clear();
+        bool exists = filesystem::exists(path);
+        bool torn = false;
+        {
+            ifstream in(path, ios::binary);
+            string line;
+            getline(in, line);
+            while (exists && getline(in, line)) {
+                if (in.eof()) { // torn last line (no newline): the run was killed while writing it
+                    torn = true;
+                    break;
+                }
+                vector<string> fields;
+                stringstream ss(line);
+                string field;
+                while (getline(ss, field, '\t')) fields.push_back(field);
+                if (fields.size() != 4) continue;
+                m_done[fields[0]] = {strtoull(fields[1].c_str(), nullptr, 10), strtoull(fields[2].c_str(), nullptr, 16), fields[3]};
+            }
+        }
+        m_log.open(path, ios::binary | ios::app);
+        if (!exists) m_log << "qoi-journal 1\n" << flush;
+        if (torn) m_log << "\n" << flush; // keeps the next record off the torn line
+        return (bool)m_log;
+    }
+
+    // Whether job's output was finished by an earlier run and is still intact
+    bool isDone(const ConvertJob& job, bool verify) const {
+        auto it = m_done.find(job.output);
+        if (it == m_done.end() || it->second.input != job.input) return false;
+        error_code ec;
+        uintmax_t size = filesystem::file_size(job.output, ec);
+        if (ec || size != it->second.size) return false;
+        return !verify || fileChecksum(job.output) == it->second.checksum;
+    }
+
+    // Appends a finished job, thread-safe
+    void record(const ConvertJob& job) {
+        error_code ec;
+        uintmax_t size = filesystem::file_size(job.output, ec);
+        if (ec) return;
+        uint64_t checksum = fileChecksum(job.output);
+
+        ostringstream line;
+        line << job.output << "\t" << size << "\t" << hex << checksum << "\t" << job.input << "\n";
+        lock_guard<mutex> lock(m_mutex);
+        m_done[job.output] = {size, checksum, job.input};
+        m_log << line.str() << flush;
+    }
+
+    size_t size() const {
+        return m_done.size();
+    }
+};
+
+struct ResumeStats {
+    size_t skipped = 0;   // done in an earlier run
+    size_t converted = 0;
+    size_t failed = 0;
+};
+
+// Converts the jobs not yet finished according to the journal at journalPath, recording each one as it
+// completes. verify re-checks the checksum of skipped outputs instead of only their size.
+inline ResumeStats runResumable(const vector<ConvertJob>& jobs, const string& journalPath, BatchConverter& converter,
+                                bool verify = false) {
+    ResumeStats stats;
+    ConversionJournal journal;
+    if (!journal.open(journalPath)) {
+        cerr << "Failed to open journal " << journalPath << "." << endl;
+        stats.failed = jobs.size();
+        return stats;
+    }
+
+    vector<ConvertJob> pending;
+    for (auto& job : jobs) {
+        if (journal.isDone(job, verify)) stats.skipped++;
+        else pending.push_back(job);
+    }
+
+    stats.converted = converter.run(pending, nullptr, [&](size_t j, const ConvertResult& result) {
+        if (result.ok) journal.record(pending[j]);
+    });
+    stats.failed = pending.size() - stats.converted;
+    return stats;
+}
@@ -0,0 +1,184 @@
+#pragma once
+
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+
+#include "Segmented.h"
+
+using namespace std;
+
+// ----- LZ BACK-REFERENCE STAGE -----
+// encode() only remembers the last 64 colors, so an image that repeats a pattern (text glyphs, icons, UI chrome)
+// gets the same opcode sequence written out again each time. This stage replaces such repeats with references
+// back into the bytes already written, LZ4 style, and leaves everything else as literals. It makes no use of the
+// opcode structure, so it works before or after any other stage. On screenshots it pays to run it first and an
+// entropy stage after it; photos have few exact repeats, and there it only gets in the entropy stages' way.
+//
+// The encoder finds matches through hash chains on 4-byte prefixes, trying the LZ_CHAIN_DEPTH most recent
+// candidates, so even short repeats such as a glyph's few opcodes are found. The decoder copies 16 or 8 bytes at
+// a time into an output buffer with some slack at the end, and only copies byte by byte for short, overlapping
+// matches.
+//
+// Stage data: decoded size (u64 BE), then sequences until that many bytes are decoded:
+//   token: literal count (high nibble), match length - LZ_MIN_MATCH (low nibble); 15 means more follows
+//   more literal count: bytes added up until one is below 255
+//   the literals
+//   unless the decoded size is reached: offset back from the current position (u16 LE), more match length
+// The last sequence has only literals; it is left out when the data ends with a match.
+
+const int LZ_MIN_MATCH = 4;
+const size_t LZ_WINDOW = 1 << 16;  // offsets go up to LZ_WINDOW - 1
+const int LZ_HASH_BITS = 16;
+const int LZ_CHAIN_DEPTH = 16;
+const size_t LZ_SLACK = 32;        // bytes the decoder may write past the end of its output
+
+inline uint32_t lzHash(const uint8_t* p) {
+    uint32_t v = (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// How many bytes from a and b on are equal, b running to end. Compares 8 bytes at a time while it can.
+inline size_t lzMatchLength(const uint8_t* a, const uint8_t* b, const uint8_t* end) {
+    const uint8_t* start = b;
+    while (end - b >= 8) {
+        uint64_t x, y;
+        memcpy(&x, a, 8);
+        memcpy(&y, b, 8);
+        if (x != y) break;
+        a += 8;
+        b += 8;
+    }
+    while (b < end && *a == *b) {
+        a++;
+        b++;
+    }
+    return b - start;
+}
+
+inline void lzStoreLength(vector<uint8_t>& out, size_t length) {
+    for (; length >= 255; length -= 255) out.push_back(255);
+    out.push_back((uint8_t)length);
+}
+
+// Appends literals and, if length is not 0, a match
+inline void lzSequence(vector<uint8_t>& out, const uint8_t* literals, size_t literalCount, size_t offset, size_t length) {
+    size_t matchCode = length ? length - LZ_MIN_MATCH : 0;
+    out.push_back((uint8_t)(min<size_t>(literalCount, 15) << 4 | min<size_t>(matchCode, 15)));
+    if (literalCount >= 15) lzStoreLength(out, literalCount - 15);
+    out.insert(out.end(), literals, literals + literalCount);
+    if (!length) return;
+    out.push_back((uint8_t)offset);
+    out.push_back((uint8_t)(offset >> 8));
+    if (matchCode >= 15) lzStoreLength(out, matchCode - 15);
+}
+
+// Appends the stage data for bytes to out
+inline void lzEncode(const uint8_t* bytes, size_t count, vector<uint8_t>& out) {
+    storeBE(out, count, 8);
+    out.reserve(out.size() + count + count / 128 + 16);
+    // Positions are kept as their low 32 bits, the distance back as the difference mod 2^32. Past 4 GB a stale
+    // entry can look recent: that only costs a comparison, since every candidate is checked byte by byte.
+    vector<uint32_t> head(1 << LZ_HASH_BITS, 0);
+    vector<uint32_t> chain(LZ_WINDOW, 0); // previous position with the same hash, by position % LZ_WINDOW
+
+    auto insert = [&](size_t pos) {
+        uint32_t h = lzHash(bytes + pos);
+        chain[pos & (LZ_WINDOW - 1)] = head[h];
+        head[h] = (uint32_t)pos;
+    };
+
+    size_t anchor = 0, pos = 0;
+    while (pos + LZ_MIN_MATCH <= count) {
+        size_t bestLength = 0, bestOffset = 0;
+        uint32_t candidate = head[lzHash(bytes + pos)];
+        for (size_t depth = 0, last = 0; depth < LZ_CHAIN_DEPTH; depth++) {
+            size_t offset = (uint32_t)((uint32_t)pos - candidate);
+            if (offset <= last || offset >= LZ_WINDOW || offset > pos) break; // chains only go further back
+            last = offset;
+            const uint8_t* from = bytes + pos - offset;
+            // only worth comparing if it would beat the best so far
+            if (pos + bestLength < count && from[bestLength] == bytes[pos + bestLength]) {
+                size_t length = lzMatchLength(from, bytes + pos, bytes + count);
+                if (length > bestLength) {
+                    bestLength = length;
+                    bestOffset = offset;
+                }
+            }
+            candidate = chain[candidate & (LZ_WINDOW - 1)];
+        }
+        insert(pos);
+
+        if (bestLength < LZ_MIN_MATCH) {
+            pos++;
+            continue;
+        }
+        lzSequence(out, bytes + anchor, pos - anchor, bestOffset, bestLength);
+        for (size_t end = pos + bestLength; ++pos < end;)
+            if (pos + LZ_MIN_MATCH <= count) insert(pos);
+        anchor = pos;
+    }
+    if (anchor < count) lzSequence(out, bytes + anchor, count - anchor, 0, 0);
+}
+
+// Reads a length continuation. Returns false if the input ends inside it.
+inline bool lzLoadLength(const uint8_t*& in, const uint8_t* inEnd, size_t& length) {
+    uint8_t b;
+    do {
+        if (in == inEnd) return false;
+        b = *in++;
+        length += b;
+    } while (b == 255);
+    return true;
+}
+
+// Undoes the stage into out. Returns false if the data is damaged or decodes to more than maxSize bytes.
+inline bool lzDecode(const uint8_t* data, size_t size, vector<uint8_t>& out, uint64_t maxSize) {
+    if (size < 8 || loadBE(data, 8) > maxSize) return false;
+    size_t total = (size_t)loadBE(data, 8);
+    out.resize(total + LZ_SLACK);
+
+    const uint8_t* in = data + 8;
+    const uint8_t* inEnd = data + size;
+    uint8_t* begin = out.data();
+    uint8_t* o = begin;
+    uint8_t* outEnd = begin + total;
+    while (o < outEnd) {
+        if (in == inEnd) return false;
+        uint8_t token = *in++;
+
+        size_t literals = token >> 4;
+        if (literals == 15 && !lzLoadLength(in, inEnd, literals)) return false;
+        if (literals > (size_t)(inEnd - in) || literals > (size_t)(outEnd - o)) return false;
+        if (literals <= 16 && inEnd - in >= 16) memcpy(o, in, 16);
+        else memcpy(o, in, literals);
+        o += literals;
+        in += literals;
+        if (o == outEnd) break;
+
+        if (inEnd - in < 2) return false;
+        size_t offset = (size_t)in[0] | ((size_t)in[1] << 8);
+        in += 2;
+        size_t length = token & 15;
+        if (length == 15 && !lzLoadLength(in, inEnd, length)) return false;
+        length += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(o - begin) || length > (size_t)(outEnd - o)) return false;
+
+        // whole chunks may run up to 15 bytes past the match, into the slack; each chunk's source was written
+        // before it is read as long as the offset is at least the chunk size
+        const uint8_t* from = o - offset;
+        if (offset >= 16) {
+            for (size_t k = 0; k < length; k += 16) memcpy(o + k, from + k, 16);
+        }
+        else if (offset >= 8) {
+            for (size_t k = 0; k < length; k += 8) memcpy(o + k, from + k, 8);
+        }
+        else {
+            for (size_t k = 0; k < length; k++) o[k] = from[k];
+        }
+        o += length;
+    }
+    out.resize(total);
+    return true;
+}
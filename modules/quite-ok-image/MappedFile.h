@@ -0,0 +1,136 @@
+#pragma once
+
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+// ----- MEMORY-MAPPED FILES -----
+// Whole-file mappings for images that do not fit in memory. Pages are read in (or written back) by the OS as
+// they are touched, and release() lets it drop a range that has been processed, so only the band being worked
+// on stays resident.
+
+class MappedFile {
+private:
+    uint8_t* m_data = nullptr;
+    size_t m_size = 0;
+#ifdef _WIN32
+    HANDLE m_file = INVALID_HANDLE_VALUE;
+    HANDLE m_mapping = nullptr;
+#else
+    int m_fd = -1;
+#endif
+
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+        close();
+    }
+
+    // Maps an existing file read-only
+    bool openRead(const string& filename) {
+        close();
+#ifdef _WIN32
+        m_file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                             FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (m_file == INVALID_HANDLE_VALUE) return false;
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(m_file, &size) || size.QuadPart == 0) return close(), false;
+        m_size = (size_t)size.QuadPart;
+        m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!m_mapping) return close(), false;
+        m_data = static_cast<uint8_t*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+#else
+        m_fd = ::open(filename.c_str(), O_RDONLY);
+        if (m_fd < 0) return false;
+        struct stat st;
+        if (fstat(m_fd, &st) != 0 || st.st_size == 0) return close(), false;
+        m_size = (size_t)st.st_size;
+        void* data = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, m_fd, 0);
+        m_data = (data == MAP_FAILED) ? nullptr : static_cast<uint8_t*>(data);
+        if (m_data) madvise(m_data, m_size, MADV_SEQUENTIAL);
+#endif
+        if (!m_data) return close(), false;
+        return true;
+    }
+
+    // Creates (or truncates) a file of the given size and maps it for writing
+    bool create(const string& filename, size_t size) {
+        close();
+        if (size == 0) return false;
+#ifdef _WIN32
+        m_file = CreateFileA(filename.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+                             FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (m_file == INVALID_HANDLE_VALUE) return false;
+        m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READWRITE, (DWORD)((uint64_t)size >> 32), (DWORD)size, nullptr);
+        if (!m_mapping) return close(), false;
+        m_data = static_cast<uint8_t*>(MapViewOfFile(m_mapping, FILE_MAP_WRITE, 0, 0, 0));
+#else
+        m_fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (m_fd < 0) return false;
+        if (ftruncate(m_fd, (off_t)size) != 0) return close(), false;
+        void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+        m_data = (data == MAP_FAILED) ? nullptr : static_cast<uint8_t*>(data);
+#endif
+        m_size = size;
+        if (!m_data) return close(), false;
+        return true;
+    }
+
+    // Tells the OS the range is done with: written pages are scheduled for write-back, and all of its pages
+    // may be dropped from this process
+    void release(size_t offset, size_t length) {
+        if (!m_data || offset >= m_size) return;
+        length = (length < m_size - offset) ? length : m_size - offset;
+#ifdef _WIN32
+        FlushViewOfFile(m_data + offset, length);
+#else
+        uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+        uintptr_t begin = ((uintptr_t)(m_data + offset) + page - 1) & ~(page - 1);
+        uintptr_t end = ((uintptr_t)(m_data + offset + length)) & ~(page - 1);
+        if (end <= begin) return;
+        msync(reinterpret_cast<void*>(begin), end - begin, MS_ASYNC);
+        madvise(reinterpret_cast<void*>(begin), end - begin, MADV_DONTNEED);
+#endif
+    }
+
+    void close() {
+#ifdef _WIN32
+        if (m_data) UnmapViewOfFile(m_data);
+        if (m_mapping) CloseHandle(m_mapping);
+        if (m_file != INVALID_HANDLE_VALUE) CloseHandle(m_file);
+        m_mapping = nullptr;
+        m_file = INVALID_HANDLE_VALUE;
+#else
+        if (m_data) munmap(m_data, m_size);
+        if (m_fd >= 0) ::close(m_fd);
+        m_fd = -1;
+#endif
+        m_data = nullptr;
+        m_size = 0;
+    }
+
+    uint8_t* data() const {
+        return m_data;
+    }
+
+    size_t size() const {
+        return m_size;
+    }
+};
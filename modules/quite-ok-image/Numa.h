@@ -0,0 +1,98 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+#ifdef __linux__
+#include <sched.h>
+#include <pthread.h>
+#endif
+
+using namespace std;
+
+// ----- NUMA TOPOLOGY -----
+// Nodes and their CPUs come from /sys/devices/system/node on Linux. Everywhere else, and on machines that do
+// not expose nodes, the whole machine is node 0. Threads remember the node they were pinned to, so per-node
+// resources (the buffer pools) can be picked without a system call.
+
+const int MAX_NUMA_NODES = 64;
+
+// "0-3,8,10-11" -> {0,1,2,3,8,10,11}
+inline vector<int> parseCpuList(const string& list) {
+    vector<int> cpus;
+    stringstream ss(list);
+    string range;
+    while (getline(ss, range, ',')) {
+        if (range.empty() || range[0] == '\n') continue;
+        size_t dash = range.find('-');
+        int first = stoi(range.substr(0, dash));
+        int last = (dash == string::npos) ? first : stoi(range.substr(dash + 1));
+        for (int cpu = first; cpu <= last; cpu++) cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+// CPUs per node, nodes without CPUs (memory-only) are left out
+inline const vector<vector<int>>& numaNodes() {
+    static const vector<vector<int>> nodes = [] {
+        vector<vector<int>> found;
+#ifdef __linux__
+        for (int n = 0; n < MAX_NUMA_NODES; n++) {
+            ifstream file("/sys/devices/system/node/node" + to_string(n) + "/cpulist");
+            if (!file) continue;
+            string list;
+            getline(file, list);
+            vector<int> cpus = parseCpuList(list);
+            if (!cpus.empty()) found.push_back(cpus);
+        }
+#endif
+        if (found.empty()) {
+            vector<int> all;
+            for (unsigned cpu = 0; cpu < max(1u, thread::hardware_concurrency()); cpu++) all.push_back((int)cpu);
+            found.push_back(all);
+        }
+        return found;
+    }();
+    return nodes;
+}
+
+inline int& threadNumaNode() {
+    thread_local int node = 0;
+    return node;
+}
+
+// Node the calling thread was pinned to, 0 if it never was
+inline int currentNumaNode() {
+    return threadNumaNode();
+}
+
+// Restricts the calling thread to the node's CPUs. Memory it touches first is then allocated on that node
+// by the kernel's default first-touch policy. Returns false if the affinity could not be set.
+inline bool pinToNumaNode(int node) {
+    const vector<vector<int>>& nodes = numaNodes();
+    if (node < 0 || node >= (int)nodes.size()) return false;
+    threadNumaNode() = node;
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : nodes[node]) CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    return false;
+#endif
+}
+
+// Node of the CPU the calling thread is running on right now, -1 if unknown
+inline int runningNumaNode() {
+#ifdef __linux__
+    int cpu = sched_getcpu();
+    const vector<vector<int>>& nodes = numaNodes();
+    for (size_t n = 0; n < nodes.size(); n++)
+        for (int c : nodes[n])
+            if (c == cpu) return (int)n;
+#endif
+    return -1;
+}
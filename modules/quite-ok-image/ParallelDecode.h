@@ -0,0 +1,260 @@
+#pragma once
+
+#include <vector>
+#include <cstring>
+
+#include "RGBValue.h"
+#include "CpuDispatch.h"
+#include "ThreadPool.h"
+
+using namespace std;
+
+// ----- SPECULATIVE PARALLEL DECODE -----
+// Works on plain single-stream QOI data (no seek table):
+//   1. (serial)   walk the opcode tags only, cutting the stream into chunks at opcode boundaries
+//   2. (parallel) decode each chunk without knowing the previous pixel or index[64] it starts with.
+//                 A chunk is a sequence of segments:
+//                   EXACT    starts at a QOI_OP_RGB, so every pixel is known; it keeps a segment-local index
+//                            and ends when a QOI_OP_INDEX reads a slot it has not written itself
+//                   RELATIVE starts at the chunk start or at such a QOI_OP_INDEX; DIFF/LUMA/RUN are summed
+//                            into per-channel offsets from an unknown base pixel (an additive prefix scan)
+//   3. (serial)   walk the segments in order with the true decoder state: a RELATIVE segment's base is the
+//                 true previous pixel or index slot, and each segment's index writes are applied
+//   4. (parallel) add the resolved base to every RELATIVE pixel
+// Step 3 only touches segment boundaries and the tail of RELATIVE segments, so most of the work is parallel.
+
+const size_t PARALLEL_DECODE_MIN_CHUNK = 1 << 16; // pixels
+
+struct DecodeSegment {
+    enum Kind : uint8_t { EXACT, RELATIVE_PREV, RELATIVE_SLOT };
+    Kind kind;
+    uint8_t slot;          // index slot a RELATIVE_SLOT segment starts from
+    size_t pixelBegin;
+    size_t pixelEnd;
+    size_t writesBegin;    // EXACT: range in DecodeChunk::writes
+    size_t writesEnd;
+    RGBValue base;         // RELATIVE: resolved in step 3
+};
+
+struct DecodeChunk {
+    size_t byteBegin, byteEnd;
+    size_t pixelBegin, pixelEnd;
+    vector<DecodeSegment> segments;
+    vector<pair<uint8_t, RGBValue>> writes; // final index state of each EXACT segment
+};
+
+// Per-channel add mod 256 of two pixels packed as {r, g, b, isNull=0}
+inline RGBValue addPixels(const RGBValue& a, const RGBValue& b) {
+    RGBValue out(a.red + b.red, a.green + b.green, a.blue + b.blue);
+    return out;
+}
+
+inline void addBase(RGBValue* pixels, size_t count, const RGBValue& base) {
+    uint32_t b;
+    memcpy(&b, &base, 4);
+    b &= 0x00FFFFFF; // keep isNull = false
+    for (size_t i = 0; i < count; i++) {
+        uint32_t p;
+        memcpy(&p, &pixels[i], 4);
+        p = ((p & 0x7F7F7F7F) + (b & 0x7F7F7F7F)) ^ ((p ^ b) & 0x80808080); // bytewise add, no carries
+        memcpy(static_cast<void*>(&pixels[i]), &p, 4);
+    }
+}
+
+// Opcode length in bytes and pixels produced, by tag byte
+struct OpcodeTable {
+    uint8_t length[256];
+    uint8_t pixels[256];
+
+    OpcodeTable() {
+        for (int b = 0; b < 256; b++) {
+            length[b] = (b == 0b11111110) ? 4 : (b >> 6 == 0b10) ? 2 : 1; // QOI_OP_RGB, QOI_OP_LUMA, the rest
+            pixels[b] = (b >> 6 == 0b11 && b != 0b11111110) ? (b & 0b111111) + 1 : 1; // QOI_OP_RUN
+        }
+    }
+};
+
+// 1. Cuts bytes into chunks of roughly equal pixel counts. Returns the number of pixels the stream holds.
+// Table lookups instead of tag branches: the tags are too irregular for the branch predictor.
+inline size_t splitOpcodes(const uint8_t* bytes, size_t count, size_t pixelCount, size_t chunks, vector<DecodeChunk>& out) {
+    static const OpcodeTable table;
+    size_t curIdx = 0, pixels = 0;
+
+    for (size_t k = 0; k < chunks && curIdx < count && pixels < pixelCount; k++) {
+        size_t nextCut = (k + 1 < chunks) ? pixelCount * (k + 1) / chunks : pixelCount;
+        if (pixels >= nextCut) continue;
+
+        out.push_back(DecodeChunk());
+        out.back().byteBegin = curIdx;
+        out.back().pixelBegin = pixels;
+
+        // every opcode is at most 4 bytes, so only the stream's last few opcodes need a bounds check
+        size_t safeEnd = count >= 4 ? count - 4 : 0;
+        while (curIdx < safeEnd && pixels < nextCut) {
+            uint8_t curByte = bytes[curIdx];
+            curIdx += table.length[curByte];
+            pixels += table.pixels[curByte];
+        }
+        while (curIdx < count && pixels < nextCut) {
+            uint8_t curByte = bytes[curIdx];
+            if (curIdx + table.length[curByte] > count) { // truncated opcode, the serial decoder stops here too
+                curIdx = count;
+                break;
+            }
+            curIdx += table.length[curByte];
+            pixels += table.pixels[curByte];
+        }
+        pixels = min(pixels, pixelCount);
+
+        out.back().byteEnd = min(curIdx, count);
+        out.back().pixelEnd = pixels;
+    }
+    return pixels;
+}
+
+// 2. Decodes one chunk (k > 0) into out[pixelBegin, pixelEnd), RELATIVE pixels hold offsets from their base
+inline void decodeSpeculative(const uint8_t* bytes, DecodeChunk& chunk, RGBValue* out) {
+    RGBValue cur(0, 0, 0);
+    RGBValue segIndex[64];
+    uint64_t written = 0; // slots written in the current EXACT segment
+    bool exact = false;
+
+    auto closeSegment = [&](size_t pixel) {
+        if (chunk.segments.empty()) return;
+        DecodeSegment& seg = chunk.segments.back();
+        seg.pixelEnd = pixel;
+        if (seg.kind == DecodeSegment::EXACT) {
+            seg.writesBegin = chunk.writes.size();
+            for (int h = 0; h < 64; h++)
+                if (written >> h & 1) chunk.writes.push_back({(uint8_t)h, segIndex[h]});
+            seg.writesEnd = chunk.writes.size();
+        }
+    };
+    auto openSegment = [&](DecodeSegment::Kind kind, uint8_t slot, size_t pixel) {
+        closeSegment(pixel);
+        chunk.segments.push_back({kind, slot, pixel, pixel, 0, 0, RGBValue(0, 0, 0)});
+        exact = kind == DecodeSegment::EXACT;
+        written = 0;
+    };
+
+    size_t curIdx = chunk.byteBegin, outIdx = chunk.pixelBegin;
+    openSegment(DecodeSegment::RELATIVE_PREV, 0, outIdx);
+
+    while (curIdx < chunk.byteEnd && outIdx < chunk.pixelEnd) {
+        uint8_t curByte = bytes[curIdx++];
+
+        // QOI_OP_RGB
+        if (curByte == 0b11111110) {
+            if (!exact) openSegment(DecodeSegment::EXACT, 0, outIdx);
+            cur = RGBValue(bytes[curIdx], bytes[curIdx+1], bytes[curIdx+2]);
+            curIdx += 3;
+            out[outIdx++] = cur;
+        }
+        // QOI_OP_INDEX
+        else if (curByte >> 6 == 0b00) {
+            if (exact && (written >> curByte & 1)) {
+                cur = segIndex[curByte];
+            } else {
+                openSegment(DecodeSegment::RELATIVE_SLOT, curByte, outIdx);
+                cur = RGBValue(0, 0, 0);
+            }
+            out[outIdx++] = cur;
+        }
+        // QOI_OP_DIFF
+        else if (curByte >> 6 == 0b01) {
+            int dr = ((curByte >> 4) & 0b11) - 2;
+            int dg = ((curByte >> 2) & 0b11) - 2;
+            int db = (curByte & 0b11) - 2;
+            cur = RGBValue(cur.red + dr, cur.green + dg, cur.blue + db);
+            out[outIdx++] = cur;
+        }
+        // QOI_OP_LUMA
+        else if (curByte >> 6 == 0b10) {
+            uint8_t b2 = bytes[curIdx++];
+            int dg = (curByte & 0b111111) - 32;
+            int dr = ((b2 >> 4) & 0b1111) - 8 + dg;
+            int db = (b2 & 0b1111) - 8 + dg;
+            cur = RGBValue(cur.red + dr, cur.green + dg, cur.blue + db);
+            out[outIdx++] = cur;
+        }
+        // QOI_OP_RUN
+        else {
+            size_t run = min((size_t)(curByte & 0b111111) + 1, chunk.pixelEnd - outIdx);
+            for (size_t i = 0; i < run; i++)
+                out[outIdx++] = cur;
+        }
+
+        if (exact) {
+            uint8_t hash = cur.hash();
+            segIndex[hash] = cur;
+            written |= 1ull << hash;
+        }
+    }
+
+    closeSegment(outIdx);
+}
+
+// 3. Advances the true decoder state across one speculatively decoded chunk
+inline void resolveChunk(DecodeChunk& chunk, const RGBValue* out, RGBValue& prevPixel, RGBValue* index) {
+    for (DecodeSegment& seg : chunk.segments) {
+        if (seg.pixelBegin == seg.pixelEnd) continue;
+
+        if (seg.kind == DecodeSegment::EXACT) {
+            for (size_t w = seg.writesBegin; w < seg.writesEnd; w++)
+                index[chunk.writes[w].first] = chunk.writes[w].second;
+            prevPixel = out[seg.pixelEnd - 1];
+            continue;
+        }
+
+        seg.base = (seg.kind == DecodeSegment::RELATIVE_SLOT) ? index[seg.slot] : prevPixel;
+        seg.base.isNull = false;
+
+        // last write per slot, scanning back until every slot is seen or the segment is exhausted
+        uint64_t seen = 0;
+        for (size_t i = seg.pixelEnd; i > seg.pixelBegin && seen != ~0ull; i--) {
+            RGBValue px = addPixels(out[i-1], seg.base);
+            uint8_t hash = px.hash();
+            if (seen >> hash & 1) continue;
+            seen |= 1ull << hash;
+            index[hash] = px;
+        }
+        prevPixel = addPixels(out[seg.pixelEnd - 1], seg.base);
+    }
+}
+
+// Returns the number of pixels decoded, like the serial decode kernel
+inline size_t decodeParallel(const uint8_t* bytes, size_t count, RGBValue* out, size_t pixelCount, ThreadPool& pool) {
+    size_t chunkCount = min(pool.size() * 4, pixelCount / PARALLEL_DECODE_MIN_CHUNK);
+    if (chunkCount <= 1) {
+        RGBValue index[64];
+        return qoiKernels().decode(bytes, count, RGBValue(0, 0, 0), index, out, pixelCount);
+    }
+
+    vector<DecodeChunk> chunks;
+    size_t decoded = splitOpcodes(bytes, count, pixelCount, chunkCount, chunks);
+    if (chunks.empty()) return decoded; // no opcodes at all, nothing was decoded
+
+    // chunk 0 starts from the known initial state and decodes exactly
+    RGBValue index[64];
+    pool.parallelFor(chunks.size(), [&](size_t k) {
+        DecodeChunk& chunk = chunks[k];
+        if (k == 0) {
+            qoiKernels().decode(bytes + chunk.byteBegin, chunk.byteEnd - chunk.byteBegin, RGBValue(0, 0, 0), index,
+                                out + chunk.pixelBegin, chunk.pixelEnd - chunk.pixelBegin);
+        } else {
+            decodeSpeculative(bytes, chunk, out);
+        }
+    });
+
+    RGBValue prevPixel = chunks[0].pixelEnd > 0 ? out[chunks[0].pixelEnd - 1] : RGBValue(0, 0, 0);
+    for (size_t k = 1; k < chunks.size(); k++)
+        resolveChunk(chunks[k], out, prevPixel, index);
+
+    pool.parallelFor(chunks.size() - 1, [&](size_t k) {
+        for (const DecodeSegment& seg : chunks[k + 1].segments)
+            if (seg.kind != DecodeSegment::EXACT)
+                addBase(out + seg.pixelBegin, seg.pixelEnd - seg.pixelBegin, seg.base);
+    });
+
+    return decoded;
+}
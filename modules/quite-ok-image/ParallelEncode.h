@@ -0,0 +1,95 @@
+#pragma once
+
+#include <vector>
+#include <cstring>
+
+#include "RGBValue.h"
+#include "CpuDispatch.h"
+#include "ThreadPool.h"
+
+using namespace std;
+
+// ----- TWO-PHASE PARALLEL ENCODE -----
+// The serial encoder's state at a pixel that is not part of a run is just the previous pixel (known) and
+// index[64], which holds the last non-run pixel seen per hash slot. So:
+//   1. (parallel) split the image at non-run pixels and scan each chunk backwards for its last pixel per slot
+//   2. (serial)   fold those 64-entry tables front to back into the index each chunk starts with
+//   3. (parallel) encode every chunk from its own starting state, then concatenate the outputs
+// Runs never cross a chunk boundary, so the result is byte-identical to one encode() over the whole image.
+
+const size_t PARALLEL_MIN_CHUNK = 1 << 16; // pixels, below this the threading overhead outweighs the work
+
+// Last non-run pixel per hash slot in pixels[begin, end), pixels[begin-1] must be valid if begin > 0
+inline void lastPixelPerSlot(const RGBValue* pixels, size_t begin, size_t end, RGBValue* slots, IndexHash indexHash = IndexHash()) {
+    int filled = 0;
+    for (size_t i = end; i > begin && filled < 64; i--) {
+        const RGBValue& px = pixels[i-1];
+        const RGBValue prev = (i-1 > 0) ? pixels[i-2] : RGBValue(0, 0, 0);
+        if (px == prev) continue; // part of a run, never written to the index
+        uint8_t hash = indexHash(px);
+        if (slots[hash].isNull) {
+            slots[hash] = px;
+            filled++;
+        }
+    }
+}
+
+// longRuns writes the extended format, hashing with indexHash
+inline void encodeParallel(const RGBValue* pixels, size_t count, vector<uint8_t>& out, ThreadPool& pool, bool longRuns = false,
+                           IndexHash indexHash = IndexHash()) {
+    const QOIKernels& kernels = qoiKernels();
+    auto encode = [&](const RGBValue* chunk, size_t n, RGBValue prev, RGBValue* index, vector<uint8_t>& dst) {
+        if (longRuns) kernels.encodeExtended(chunk, n, prev, index, indexHash, dst);
+        else kernels.encode(chunk, n, prev, index, dst);
+    };
+    size_t chunks = min(pool.size() * 4, count / PARALLEL_MIN_CHUNK);
+    if (chunks <= 1) {
+        RGBValue index[64];
+        encode(pixels, count, RGBValue(0, 0, 0), index, out);
+        return;
+    }
+
+    // chunk boundaries, nudged forward so each chunk starts on a pixel that differs from its predecessor
+    vector<size_t> bounds = {0};
+    for (size_t k = 1; k < chunks; k++) {
+        size_t b = max(count * k / chunks, bounds.back() + 1);
+        while (b < count && pixels[b] == pixels[b-1]) b++;
+        if (b >= count) break;
+        bounds.push_back(b);
+    }
+    bounds.push_back(count);
+    chunks = bounds.size() - 1;
+
+    // 1. per-chunk index contributions
+    vector<RGBValue> slots(chunks * 64);
+    pool.parallelFor(chunks, [&](size_t k) {
+        lastPixelPerSlot(pixels, bounds[k], bounds[k+1], &slots[k * 64], indexHash);
+    });
+
+    // 2. serial fix-up: index state at the start of each chunk
+    vector<RGBValue> startIndex(chunks * 64);
+    for (size_t k = 1; k < chunks; k++) {
+        for (int h = 0; h < 64; h++) {
+            const RGBValue& own = slots[(k-1) * 64 + h];
+            startIndex[k * 64 + h] = own.isNull ? startIndex[(k-1) * 64 + h] : own;
+        }
+    }
+
+    // 3. independent emission per chunk
+    vector<vector<uint8_t>> parts(chunks);
+    pool.parallelFor(chunks, [&](size_t k) {
+        size_t begin = bounds[k], end = bounds[k+1];
+        RGBValue prev = begin > 0 ? pixels[begin-1] : RGBValue(0, 0, 0);
+        parts[k].reserve((end - begin) * 3);
+        encode(pixels + begin, end - begin, prev, &startIndex[k * 64], parts[k]);
+    });
+
+    size_t total = out.size();
+    for (auto& part : parts) total += part.size();
+    size_t offset = out.size();
+    out.resize(total);
+    for (auto& part : parts) {
+        memcpy(out.data() + offset, part.data(), part.size());
+        offset += part.size();
+    }
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+using namespace std;
+
+// ----- PLACE STREAMS -----
+// Static entropy coders do much better on QOI bytes when bytes with different roles are counted apart, so the
+// rANS and Huffman stages split a block into five streams by the byte's place in the opcode stream: tag bytes,
+// red (and alpha), green - red, blue - green, and the second QOI_OP_LUMA byte. Blocks end at opcode boundaries
+// (or where the body ends, even mid-opcode), and merging the streams gives back the exact bytes.
+
+enum PlaceStream { STREAM_TAG, STREAM_RED, STREAM_GREEN, STREAM_BLUE, STREAM_LUMA, PLACE_STREAMS };
+
+// stream of each QOI_OP_RGB(A) payload byte
+const PlaceStream RGBA_STREAMS[4] = {STREAM_RED, STREAM_GREEN, STREAM_BLUE, STREAM_RED};
+
+// Moves the opcodes from pos on into their streams until blockSize bytes are taken, returns where the block ends
+inline size_t splitPlaces(const uint8_t* bytes, size_t count, size_t pos, size_t blockSize, vector<uint8_t>* streams) {
+    size_t end = min(count, pos + blockSize);
+    while (pos < end) {
+        uint8_t tag = bytes[pos++];
+        streams[STREAM_TAG].push_back(tag);
+        if (tag >= 0xFE) {
+            size_t payload = min<size_t>(tag == 0xFE ? 3 : 4, count - pos);
+            for (size_t c = 0; c < payload; c++) {
+                bool delta = RGBA_STREAMS[c] == STREAM_GREEN || RGBA_STREAMS[c] == STREAM_BLUE;
+                streams[RGBA_STREAMS[c]].push_back((uint8_t)(bytes[pos + c] - (delta ? bytes[pos + c - 1] : 0)));
+            }
+            pos += payload;
+        }
+        else if ((tag >> 6) == 0b10 && pos < count) { // (QOI_OP_LUMA)
+            streams[STREAM_LUMA].push_back(bytes[pos++]);
+        }
+    }
+    return pos;
+}
+
+// How far a tag byte moves the output and the payload streams
+struct MergeStep {
+    uint8_t length; // tag and payload bytes
+    uint8_t red;    // red and alpha bytes
+    uint8_t rgb;    // green and blue bytes
+    uint8_t luma;
+};
+
+struct MergeSteps {
+    MergeStep steps[256];
+
+    MergeSteps() {
+        for (int tag = 0; tag < 256; tag++) {
+            if (tag >= 0xFE) steps[tag] = {(uint8_t)(tag == 0xFE ? 4 : 5), (uint8_t)(tag == 0xFE ? 1 : 2), 1, 0};
+            else if ((tag >> 6) == 0b10) steps[tag] = {2, 0, 0, 1};
+            else steps[tag] = {1, 0, 0, 0};
+        }
+    }
+};
+
+// Bytes mergePlaces may read past the end of each stream (and never use), so its callers keep this much slack
+// after every stream
+const size_t MERGE_SLACK = 2;
+
+// Interleaves a block's streams back into count QOI bytes. Returns false if the streams do not add up.
+inline bool mergePlaces(const uint8_t* const* streams, const size_t* sizes, uint8_t* out, size_t count) {
+    static const MergeSteps table;
+    const uint8_t* at[PLACE_STREAMS];
+    const uint8_t* end[PLACE_STREAMS];
+    for (int k = 0; k < PLACE_STREAMS; k++) {
+        at[k] = streams[k];
+        end[k] = streams[k] + sizes[k];
+    }
+    const uint8_t *tags = at[STREAM_TAG], *red = at[STREAM_RED], *green = at[STREAM_GREEN], *blue = at[STREAM_BLUE], *luma = at[STREAM_LUMA];
+    uint8_t* o = out;
+    uint8_t* outEnd = out + count;
+
+    // Without branching on the opcode: every step writes all five bytes an opcode can have, from the heads of
+    // all streams, and then moves each one by what this tag actually takes. An empty or used up payload stream
+    // only gives slack bytes that the step does not take, so the loop runs until the output or the tags end, or
+    // a stream is taken past its end (damaged data).
+    while (outEnd - o >= 5 && tags < end[STREAM_TAG] && red <= end[STREAM_RED] && green <= end[STREAM_GREEN]
+           && blue <= end[STREAM_BLUE] && luma <= end[STREAM_LUMA]) {
+        uint8_t tag = *tags++;
+        MergeStep step = table.steps[tag];
+        uint8_t r = red[0];
+        uint8_t g = (uint8_t)(r + green[0]);
+        o[0] = tag;
+        o[1] = step.luma ? luma[0] : r;
+        o[2] = g;
+        o[3] = (uint8_t)(g + blue[0]);
+        o[4] = red[1];
+        o += step.length;
+        red += step.red;
+        green += step.rgb;
+        blue += step.rgb;
+        luma += step.luma;
+    }
+    at[STREAM_TAG] = tags;
+    at[STREAM_RED] = red;
+    at[STREAM_GREEN] = green;
+    at[STREAM_BLUE] = blue;
+    at[STREAM_LUMA] = luma;
+    for (int k = 0; k < PLACE_STREAMS; k++)
+        if (at[k] > end[k]) return false;
+
+    // the rest one opcode at a time, checking every stream
+    while (o < outEnd && at[STREAM_TAG] < end[STREAM_TAG]) {
+        uint8_t tag = *at[STREAM_TAG]++;
+        *o++ = tag;
+        if (tag >= 0xFE) {
+            size_t payload = min<size_t>(tag == 0xFE ? 3 : 4, outEnd - o); // cut short by the end of the body
+            for (size_t c = 0; c < payload; c++) {
+                PlaceStream s = RGBA_STREAMS[c];
+                if (at[s] == end[s]) return false;
+                bool delta = s == STREAM_GREEN || s == STREAM_BLUE;
+                *o = (uint8_t)(*at[s]++ + (delta ? o[-1] : 0));
+                o++;
+            }
+        }
+        else if ((tag >> 6) == 0b10 && o < outEnd) {
+            if (at[STREAM_LUMA] == end[STREAM_LUMA]) return false;
+            *o++ = *at[STREAM_LUMA]++;
+        }
+    }
+    for (int k = 0; k < PLACE_STREAMS; k++)
+        if (at[k] != end[k]) return false;
+    return o == outEnd;
+}
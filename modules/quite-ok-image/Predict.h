@@ -0,0 +1,265 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+
+#include "RGBValue.h"
+#include "QOIKernels.h"
+
+using namespace std;
+
+// ----- ROW PREDICTION -----
+// QOI_OP_DIFF, QOI_OP_LUMA and QOI_OP_RUN describe a pixel relative to the one before it, so a vertical gradient
+// or a row that repeats the one above costs as much as noise. With prediction (extended format), the reference
+// pixel is chosen per row instead, and every row starts with one byte naming its predictor:
+//   PREDICT_LEFT     the previous pixel, as in the standard format
+//   PREDICT_UP       the pixel above
+//   PREDICT_AVERAGE  (left + up + 1) / 2 per channel
+//   PREDICT_PAETH    per channel whichever of left, up and up-left is closest to left + up - up-left (as in PNG)
+// DIFF and LUMA then hold the difference from the prediction, and a run is a stretch of pixels that each equal
+// their prediction. QOI_OP_INDEX and QOI_OP_RGB are unchanged, and as before only pixels outside runs go into the
+// index. Runs end with their row. The first pixel of a row has the last one of the row before as its left
+// neighbour and the pixel above as its up-left one; the first row can only use PREDICT_LEFT.
+//
+// The encoder classifies each row against all four predictions with the tier's classifier and keeps the one
+// whose opcodes come out shortest, counting a run pixel as free and an index hit as QOI_OP_RGB. The decoder reads
+// nothing but the row above, which it has just written.
+
+enum RowPredictor : uint8_t { PREDICT_LEFT = 0, PREDICT_UP = 1, PREDICT_AVERAGE = 2, PREDICT_PAETH = 3 };
+
+const size_t ROW_PREDICTORS = 4;
+
+// Distances to left + up - upLeft written out, so that the selects compile to conditional moves
+inline uint8_t paethChannel(int left, int up, int upLeft) {
+    int pl = abs(up - upLeft), pu = abs(left - upLeft), pul = abs(left + up - 2*upLeft);
+    int upOrCorner = pu <= pul ? up : upLeft;
+    return (uint8_t)(pl <= pu && pl <= pul ? left : upOrCorner);
+}
+
+template <uint8_t Mode>
+inline RGBValue predictPixel(const RGBValue& left, const RGBValue& up, const RGBValue& upLeft) {
+    if (Mode == PREDICT_LEFT) return left;
+    if (Mode == PREDICT_UP) return up;
+    if (Mode == PREDICT_AVERAGE) {
+        return RGBValue((uint8_t)((left.red + up.red + 1) >> 1), (uint8_t)((left.green + up.green + 1) >> 1),
+                        (uint8_t)((left.blue + up.blue + 1) >> 1));
+    }
+    return RGBValue(paethChannel(left.red, up.red, upLeft.red), paethChannel(left.green, up.green, upLeft.green),
+                    paethChannel(left.blue, up.blue, upLeft.blue));
+}
+
+// Predictions for the width pixels of a row that has one above it; row[-1] must be readable
+template <uint8_t Mode>
+inline void predictRow(const RGBValue* row, size_t width, RGBValue* preds) {
+    const RGBValue* up = row - width;
+    preds[0] = predictPixel<Mode>(row[-1], up[0], up[0]);
+    for (size_t x = 1; x < width; x++) preds[x] = predictPixel<Mode>(row[x-1], up[x], up[x-1]);
+}
+
+// The average and Paeth predictions of a row at once, the candidates the encoder scores besides left and up
+inline void predictRowsScalar(const RGBValue* row, size_t width, RGBValue* average, RGBValue* paeth) {
+    predictRow<PREDICT_AVERAGE>(row, width, average);
+    predictRow<PREDICT_PAETH>(row, width, paeth);
+}
+
+#ifdef QOI_X86
+// 32 channel bytes per step, 8 pixels: the average is _mm256_avg_epu8, Paeth picks per channel in 16 bits, and
+// the fourth byte of every pixel is cleared like a constructed RGBValue's isNull
+QOI_TARGET("avx2")
+inline void predictRowsAVX2(const RGBValue* row, size_t width, RGBValue* average, RGBValue* paeth) {
+    const RGBValue* up = row - width;
+    const __m256i rgb = _mm256_set1_epi32(0x00FFFFFF);
+    average[0] = predictPixel<PREDICT_AVERAGE>(row[-1], up[0], up[0]);
+    paeth[0] = predictPixel<PREDICT_PAETH>(row[-1], up[0], up[0]);
+    size_t x = 1;
+    for (; x + 8 <= width; x += 8) {
+        __m256i l = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + x - 1));
+        __m256i u = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(up + x));
+        __m256i ul = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(up + x - 1));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(average + x), _mm256_and_si256(_mm256_avg_epu8(l, u), rgb));
+
+        __m256i notLeft[2], notUp[2];
+        for (int half = 0; half < 2; half++) {
+            __m256i l16 = _mm256_cvtepu8_epi16(half ? _mm256_extracti128_si256(l, 1) : _mm256_castsi256_si128(l));
+            __m256i u16 = _mm256_cvtepu8_epi16(half ? _mm256_extracti128_si256(u, 1) : _mm256_castsi256_si128(u));
+            __m256i ul16 = _mm256_cvtepu8_epi16(half ? _mm256_extracti128_si256(ul, 1) : _mm256_castsi256_si128(ul));
+            __m256i pl = _mm256_abs_epi16(_mm256_sub_epi16(u16, ul16));
+            __m256i pu = _mm256_abs_epi16(_mm256_sub_epi16(l16, ul16));
+            __m256i pul = _mm256_abs_epi16(_mm256_sub_epi16(_mm256_add_epi16(l16, u16), _mm256_add_epi16(ul16, ul16)));
+            notLeft[half] = _mm256_or_si256(_mm256_cmpgt_epi16(pl, pu), _mm256_cmpgt_epi16(pl, pul));
+            notUp[half] = _mm256_cmpgt_epi16(pu, pul);
+        }
+        // packs works per 128-bit lane, the permute puts the bytes back in order
+        __m256i maskLeft = _mm256_permute4x64_epi64(_mm256_packs_epi16(notLeft[0], notLeft[1]), 0xD8);
+        __m256i maskUp = _mm256_permute4x64_epi64(_mm256_packs_epi16(notUp[0], notUp[1]), 0xD8);
+        __m256i pick = _mm256_blendv_epi8(l, _mm256_blendv_epi8(u, ul, maskUp), maskLeft);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(paeth + x), _mm256_and_si256(pick, rgb));
+    }
+    for (; x < width; x++) {
+        average[x] = predictPixel<PREDICT_AVERAGE>(row[x-1], up[x], up[x-1]);
+        paeth[x] = predictPixel<PREDICT_PAETH>(row[x-1], up[x], up[x-1]);
+    }
+}
+#endif
+
+// What the opcodes for width classified pixels roughly cost: runs nothing, DIFF 1 byte, LUMA 2, anything else 4
+inline uint32_t rowCost(const uint32_t* desc, size_t width) {
+    uint32_t cost = 0;
+    for (size_t x = 0; x < width; x++) cost += (0x4210 >> ((desc[x] & 0b11) * 4)) & 0xF;
+    return cost;
+}
+
+// Encodes a width x height image with a predictor per row (extended format, so runs can be QOI_OP_LONG_RUN)
+template <void (*ClassifyFrom)(const RGBValue*, const RGBValue*, size_t, uint32_t*),
+          void (*PredictRows)(const RGBValue*, size_t, RGBValue*, RGBValue*)>
+void encodePredicted(const RGBValue* pixels, size_t width, size_t height, RGBValue* index, IndexHash indexHash, vector<uint8_t>& out) {
+    if (width == 0 || height == 0) return;
+    const bool descHash = indexHash.isStandard(); // the descriptors carry the spec's hash
+
+    size_t base = out.size();
+    out.resize(base + width*height*4 + height); // QOI_OP_RGB per pixel and a predictor byte per row at worst
+    uint8_t* dst = out.data() + base;
+
+    vector<uint32_t> desc(width * ROW_PREDICTORS);
+    vector<RGBValue> preds(width * 2);
+
+    for (size_t y = 0; y < height; y++) {
+        const RGBValue* row = pixels + y*width;
+        uint8_t mode = PREDICT_LEFT;
+        if (y == 0) {
+            desc[0] = classifyPixel(row[0], RGBValue(0, 0, 0));
+            ClassifyFrom(row + 1, row, width - 1, desc.data() + 1);
+        } else {
+            ClassifyFrom(row, row - 1, width, desc.data());
+            ClassifyFrom(row, row - width, width, desc.data() + width);
+            PredictRows(row, width, preds.data(), preds.data() + width);
+            ClassifyFrom(row, preds.data(), width, desc.data() + width*2);
+            ClassifyFrom(row, preds.data() + width, width, desc.data() + width*3);
+
+            uint32_t best = rowCost(desc.data(), width);
+            for (uint8_t m = 1; m < ROW_PREDICTORS; m++) {
+                uint32_t cost = rowCost(desc.data() + width*m, width);
+                if (cost < best) {
+                    best = cost;
+                    mode = m;
+                }
+            }
+        }
+
+        *dst++ = mode;
+        size_t runLength = 0;
+        dst = emitClassified<true>(row, desc.data() + width*mode, width, index, descHash, indexHash, runLength, dst);
+        if (runLength > 0) {
+            dst = storeRun(dst, runLength, true);
+        }
+    }
+    out.resize(dst - out.data());
+}
+
+// Decodes one row, out[rowStart, rowEnd), with the predictor Mode. Returns the number of pixels written, fewer
+// than the row has if the stream ends first.
+template <uint8_t Mode, void (*Fill)(RGBValue*, RGBValue, size_t)>
+size_t decodePredictedRow(const uint8_t* bytes, size_t count, size_t& curIdx, size_t width, RGBValue* index, IndexHash indexHash,
+                          RGBValue& prevPixel, RGBValue* out, size_t rowStart, size_t rowEnd) {
+    const RGBValue* up = rowStart >= width ? out + rowStart - width : out; // unused in the first row, which is PREDICT_LEFT
+    size_t x = 0, rowWidth = rowEnd - rowStart;
+    RGBValue* row = out + rowStart;
+    auto predict = [&](size_t at) {
+        if (Mode == PREDICT_LEFT) return prevPixel;
+        return predictPixel<Mode>(prevPixel, up[at], at ? up[at-1] : up[0]);
+    };
+
+    while (x < rowWidth) {
+        if (curIdx >= count) return x;
+        uint8_t curByte = bytes[curIdx++];
+        RGBValue px;
+
+        // QOI_OP_RGB
+        if (curByte == 0b11111110) {
+            if (curIdx + 3 > count) return x;
+            px = RGBValue(bytes[curIdx], bytes[curIdx+1], bytes[curIdx+2]);
+            curIdx += 3;
+        }
+        // QOI_OP_INDEX
+        else if (curByte >> 6 == 0b00) {
+            px = index[curByte];
+            px.isNull = false;
+        }
+        // QOI_OP_DIFF
+        else if (curByte >> 6 == 0b01) {
+            RGBValue pred = predict(x);
+            int dr = ((curByte >> 4) & 0b11) - 2;
+            int dg = ((curByte >> 2) & 0b11) - 2;
+            int db = (curByte & 0b11) - 2;
+            px = RGBValue(pred.red + dr, pred.green + dg, pred.blue + db);
+        }
+        // QOI_OP_LUMA
+        else if (curByte >> 6 == 0b10) {
+            if (curIdx >= count) return x;
+            RGBValue pred = predict(x);
+            uint8_t b2 = bytes[curIdx++];
+            int dg = (curByte & 0b111111) - 32;
+            int dr = ((b2 >> 4) & 0b1111) - 8 + dg;
+            int db = (b2 & 0b1111) - 8 + dg;
+            px = RGBValue(pred.red + dr, pred.green + dg, pred.blue + db);
+        }
+        // QOI_OP_RUN, QOI_OP_LONG_RUN
+        else {
+            size_t run = (curByte & 0b111111) + 1;
+            if (curByte == QOI_OP_LONG_RUN && !loadLongRun(bytes, count, curIdx, run)) return x;
+            run = min(run, rowWidth - x);
+            if (Mode == PREDICT_LEFT) {
+                Fill(row + x, prevPixel, run);
+            } else if (Mode == PREDICT_UP) {
+                memcpy(row + x, up + x, run * sizeof(RGBValue));
+            } else {
+                for (size_t k = 0; k < run; k++) row[x + k] = prevPixel = predict(x + k);
+            }
+            x += run;
+            prevPixel = row[x - 1];
+            continue;
+        }
+
+        row[x++] = px;
+        index[indexHash(px)] = px;
+        prevPixel = px;
+    }
+    return x;
+}
+
+// Decodes a predicted stream of width pixels per row into a buffer for pixelCount pixels, returns the number of
+// pixels written
+template <void (*Fill)(RGBValue*, RGBValue, size_t)>
+size_t decodePredicted(const uint8_t* bytes, size_t count, size_t width, RGBValue* index, IndexHash indexHash, RGBValue* out, size_t pixelCount) {
+    if (width == 0) return 0;
+    size_t curIdx = 0, outIdx = 0;
+    RGBValue prevPixel(0, 0, 0);
+    while (outIdx < pixelCount && curIdx < count) {
+        uint8_t mode = bytes[curIdx++];
+        size_t rowEnd = min(outIdx + width, pixelCount);
+        if (mode != PREDICT_LEFT && outIdx == 0) break; // nothing above the first row
+        size_t written;
+        switch (mode) {
+            case PREDICT_LEFT:
+                written = decodePredictedRow<PREDICT_LEFT, Fill>(bytes, count, curIdx, width, index, indexHash, prevPixel, out, outIdx, rowEnd);
+                break;
+            case PREDICT_UP:
+                written = decodePredictedRow<PREDICT_UP, Fill>(bytes, count, curIdx, width, index, indexHash, prevPixel, out, outIdx, rowEnd);
+                break;
+            case PREDICT_AVERAGE:
+                written = decodePredictedRow<PREDICT_AVERAGE, Fill>(bytes, count, curIdx, width, index, indexHash, prevPixel, out, outIdx, rowEnd);
+                break;
+            case PREDICT_PAETH:
+                written = decodePredictedRow<PREDICT_PAETH, Fill>(bytes, count, curIdx, width, index, indexHash, prevPixel, out, outIdx, rowEnd);
+                break;
+            default:
+                return outIdx; // not a predictor
+        }
+        outIdx += written;
+        if (outIdx < rowEnd) break;
+    }
+    return outIdx;
+}
@@ -1,422 +1,527 @@
 #include <iostream>
-#include <vector>
-#include <fstream>
 #include <chrono>
-#include <bitset>
-#include <cstring>
-#include <algorithm>
+#include <climits>
 
-using namespace std;
+#include "QOIConverter.h"
+#include "BatchConverter.h"
+#include "Banded.h"
+#include "Distributed.h"
+#include "Sharding.h"
+#include "Journal.h"
+#include "WatchFolder.h"
 
-struct RGBValue {
-    uint8_t red;
-    uint8_t green;
-    uint8_t blue;
-    bool isNull = true;
-
-    RGBValue(uint8_t r, uint8_t g, uint8_t b) {
-        red = r;
-        green = g;
-        blue = b;
-        isNull = false;
-    }
+#ifdef __unix__
+#include <sys/resource.h>
+#endif
 
-    RGBValue() {
-        isNull = true;
-    }
+#include <csignal>
 
-    bool operator==(const RGBValue& other) const {
-        return (red == other.red && green == other.green) && (blue == other.blue);
-    }
+using namespace std;
 
-    void print() {
-        cout << (int)red << ' ' << (int)green << ' ' << (int)blue << endl;
-    }
+// ----- SAMPLE IMPLEMENTATION -----
 
-    uint8_t hash() const {
-        return (red*3 + green*5 + blue*7) % 64;
+volatile sig_atomic_t g_interrupted = 0;
+
+// Minor page faults of this process so far, 0 where getrusage is unavailable
+long minorFaults() {
+#ifdef __unix__
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_minflt;
+#else
+    return 0;
+#endif
+}
+
+int main(int argc, char** argv) {
+    // one band of a distributed encode, or the merge, e.g. run on other machines sharing a directory:
+    //   encode-band <in.bmp> <out.part> <first row> <rows>
+    //   merge-bands <out.qoi> <part>...
+    if (argc == 6 && string(argv[1]) == "encode-band")
+        return encodeBandFile(argv[2], argv[3], (uint32_t)stoul(argv[4]), (uint32_t)stoul(argv[5])) ? 0 : 1;
+    if (argc >= 4 && string(argv[1]) == "merge-bands")
+        return mergeBandFiles(vector<string>(argv + 3, argv + argc), argv[2]) ? 0 : 1;
+    // one shard of a corpus, and the merge of all shard manifests (see Sharding.h):
+    //   shard <job list> <shard> <shard count> <manifest> [path|content]
+    //   merge-shards <shard count> <corpus manifest> <manifest>...
+    if ((argc == 6 || argc == 7) && string(argv[1]) == "shard") {
+        BatchConverter converter;
+        ShardKey key = (argc == 7 && string(argv[6]) == "content") ? ShardKey::Content : ShardKey::Path;
+        return runShard(readJobList(argv[2]), (uint32_t)stoul(argv[3]), (uint32_t)stoul(argv[4]), key, argv[5], converter) ? 0 : 1;
     }
-};
-
-class QOIConverter {
-private:
-    RGBValue index[64];
-    vector<RGBValue> m_RGBBytes;
-    vector<uint8_t> m_QOIBytes;
-    uint32_t m_width;
-    uint32_t m_height;
-    uint32_t m_channels;
-    uint32_t m_colorspace;
-
-public:
-    QOIConverter() {
-        for (int i=0; i<64; i++)
-            index[i] = RGBValue(); // initialize to NULL
+    // resumable batch: finished jobs are journaled and skipped when the same command runs again
+    //   batch <job list> <journal> [verify]
+    if ((argc == 4 || argc == 5) && string(argv[1]) == "batch") {
+        BatchConverter converter;
+        ResumeStats stats = runResumable(readJobList(argv[2]), argv[3], converter, argc == 5 && string(argv[4]) == "verify");
+        cout << stats.converted << " converted, " << stats.skipped << " already done, " << stats.failed << " failed" << endl;
+        return stats.failed == 0 ? 0 : 1;
+    }
+    // convert BMPs as they are dropped into a directory, until Ctrl+C / SIGTERM
+    //   watch <dir> <output dir> [debounce ms]
+    if ((argc == 4 || argc == 5) && string(argv[1]) == "watch") {
+        WatchFolder watch(argv[2], argv[3], chrono::milliseconds(argc == 5 ? stoul(argv[4]) : 20));
+        if (!watch.start()) return 1;
+        signal(SIGINT, [](int) { g_interrupted = 1; });
+        signal(SIGTERM, [](int) { g_interrupted = 1; });
+        while (!g_interrupted) this_thread::sleep_for(chrono::milliseconds(100));
+        watch.stop();
+        WatchStats stats = watch.stats();
+        cout << stats.converted << " converted, " << stats.failed << " failed, latency avg "
+             << (stats.converted ? stats.totalLatency / stats.converted * 1000 : 0.0) << "ms, max " << stats.maxLatency * 1000 << "ms" << endl;
+        return 0;
+    }
+    if (argc >= 4 && string(argv[1]) == "merge-shards") {
+        ShardMergeReport report = mergeShardManifests(vector<string>(argv + 4, argv + argc), (uint32_t)stoul(argv[2]), argv[3]);
+        for (uint32_t shard : report.missingShards) cerr << "shard " << shard << ": missing" << endl;
+        for (uint32_t shard : report.incompleteShards) cerr << "shard " << shard << ": incomplete" << endl;
+        for (uint32_t shard : report.failedShards) cerr << "shard " << shard << ": failed jobs" << endl;
+        for (auto& job : report.failedJobs) cerr << "failed: " << job << endl;
+        cout << report.succeeded << "/" << report.jobs << " converted, " << report.bytesIn << " -> " << report.bytesOut << " bytes" << endl;
+        return report.complete() ? 0 : 1;
     }
-    
-    void readBMP(const string& filename, int channels=3, int colorspace=0) {
-        m_RGBBytes = {};
-        m_channels = channels;
-        m_colorspace = colorspace;
-
-        ifstream file(filename, ios::binary);
-        if (!file) {
-            cerr << "Failed to open BMP file." << endl;
-            return;
-        }
-
-        file.seekg(10);
-        uint32_t dataOffset;
-        file.read(reinterpret_cast<char*>(&dataOffset), 4);
 
-        file.seekg(18);
-        file.read(reinterpret_cast<char*>(&m_width), 4);
-        file.read(reinterpret_cast<char*>(&m_height), 4);
+    QOIConverter img;
 
-        file.seekg(dataOffset);
+    const CpuDispatch& cpu = cpuDispatch();
+    cout << "CPU tier: " << cpuTierName(cpu.active);
+    if (cpu.forced) cout << " (forced by QOI_CPU_TIER, detected " << cpuTierName(cpu.detected) << ")";
+    cout << endl;
 
-        int rowPadded = (m_width * 3 + 3) & (~3);
-        vector<uint8_t> row(rowPadded);
-        m_RGBBytes.reserve(m_width * m_height * 3 + 9);
+    auto start = chrono::high_resolution_clock::now();
+    
+    long f0 = minorFaults();
+    img.readBMP("../../test_images/input/sample_1920.bmp");
+    long f1 = minorFaults();
+    auto t1 = chrono::high_resolution_clock::now();
+    
+    img.encode(true);
+    auto t2 = chrono::high_resolution_clock::now();
+    long f2 = minorFaults();
+    auto duration = chrono::duration_cast<chrono::milliseconds>(t2 - t1);
+    cout << "Time taken (encoding): " << duration.count() << "ms" << endl;
+    cout << "Page faults (reading BMP / encoding): " << f1 - f0 << " / " << f2 - f1 << endl;
+
+    vector<uint8_t> serialBytes = img.getQOI();
+    auto p1 = chrono::high_resolution_clock::now();
+    img.encodeParallel();
+    auto p2 = chrono::high_resolution_clock::now();
+    duration = chrono::duration_cast<chrono::milliseconds>(p2 - p1);
+    cout << "Time taken (parallel encoding, " << ThreadPool::shared().size() << " threads): " << duration.count() << "ms";
+    cout << (img.getQOI() == serialBytes ? "" : " [OUTPUT DIFFERS FROM SERIAL]") << endl;
+
+    // the tier's encoder against the scalar one, both writing the shortest opcode for every pixel
+    {
+        vector<RGBValue> pixels = img.getRAW();
+        vector<uint8_t> reference;
+        RGBValue referenceIndex[64];
+        auto o1 = chrono::high_resolution_clock::now();
+        encodeScalar(pixels.data(), pixels.size(), RGBValue(0, 0, 0), referenceIndex, reference);
+        auto o2 = chrono::high_resolution_clock::now();
+        cout << "Time taken (scalar reference encoding): " << chrono::duration_cast<chrono::milliseconds>(o2 - o1).count() << "ms";
+        cout << (reference == serialBytes ? "" : " [OUTPUT DIFFERS FROM SERIAL]") << endl;
+    }
 
-        for (int y = 0; y < m_height; y++) {
-            file.read(reinterpret_cast<char*>(row.data()), rowPadded);
-            for (int x = 0; x < m_width; x++) {
-                uint8_t b = row[x * 3];
-                uint8_t g = row[x * 3 + 1];
-                uint8_t r = row[x * 3 + 2];
-                m_RGBBytes.push_back(RGBValue(r, g, b));
-            }
-        }
+    img.writeQOI("../../test_images/input/sample_1920.qoi");
+    auto t3 = chrono::high_resolution_clock::now();
+    
+    img.readQOI("../../test_images/input/sample_1920.qoi");
+    auto t4 = chrono::high_resolution_clock::now();
 
-        if (m_height > 0) {
-            reverse(m_RGBBytes.begin(), m_RGBBytes.end()); // BMP stored bottom-up
-        }
+    long f3 = minorFaults();
+    img.decode();
+    auto t5 = chrono::high_resolution_clock::now();
+    long f4 = minorFaults();
+    duration = chrono::duration_cast<chrono::milliseconds>(t5 - t4);
+    cout << "Time taken (decoding): " << duration.count() << "ms" << endl;
+    cout << "Page faults (decoding): " << f4 - f3 << endl;
+
+    vector<RGBValue> serialPixels = img.getRAW();
+    auto p3 = chrono::high_resolution_clock::now();
+    img.decodeParallel();
+    auto p4 = chrono::high_resolution_clock::now();
+    duration = chrono::duration_cast<chrono::milliseconds>(p4 - p3);
+    cout << "Time taken (parallel decoding, " << ThreadPool::shared().size() << " threads): " << duration.count() << "ms";
+    cout << (img.getRAW() == serialPixels ? "" : " [OUTPUT DIFFERS FROM SERIAL]") << endl;
+    {
+        // a header-only stream for a large image: no chunks to split, nothing decoded
+        vector<RGBValue> empty(1000 * 1000);
+        uint8_t noBytes[1] = {0};
+        size_t decoded = decodeParallel(noBytes, 0, empty.data(), empty.size(), ThreadPool::shared());
+        cout << "Parallel decoding (header-only 1000x1000 stream): " << decoded << " pixels";
+        cout << (decoded == 0 ? "" : " [OUTPUT DIFFERS FROM SERIAL]") << endl;
     }
 
-    void readQOI(const string& filename, int channels=3, int colorspace=0) {
-        m_QOIBytes = {};
-        m_channels = channels;
-        m_colorspace = colorspace;
-
-        ifstream file(filename, ios::binary);
-        if (!file) {
-            cerr << "Failed to open QOI file for reading." << endl;
-            return;
-        }
+    // one buffer for the compressed data and the pixels
+    QOIConverter inPlace;
+    auto p7 = chrono::high_resolution_clock::now();
+    inPlace.readQOIInPlace("../../test_images/input/sample_1920.qoi");
+    auto p8 = chrono::high_resolution_clock::now();
+    duration = chrono::duration_cast<chrono::milliseconds>(p8 - p7);
+    cout << "Time taken (reading + in-place decoding): " << duration.count() << "ms, peak buffers "
+         << (double)serialPixels.size()*4/1000000 << "MB instead of " << (double)(serialPixels.size()*4 + serialBytes.size())/1000000 << "MB";
+    cout << (inPlace.getRAW() == serialPixels ? "" : " [OUTPUT DIFFERS FROM SERIAL]") << endl;
+
+    // entropy stages on top of the plain stream, read back through readQOI()
+    for (const vector<QOIStage>& stages : vector<vector<QOIStage>>{{QOIStage::Range}, {QOIStage::Rans}, {QOIStage::Huffman}, {QOIStage::Lz}}) {
+        string name;
+        for (QOIStage stage : stages) name += string(name.empty() ? "" : "+") + stageName(stage);
+        auto e1 = chrono::high_resolution_clock::now();
+        img.writeQOI("../../test_images/input/sample_1920.qoix", stages);
+        auto e2 = chrono::high_resolution_clock::now();
+        QOIConverter packed;
+        packed.readQOI("../../test_images/input/sample_1920.qoix");
+        packed.decode();
+        auto e3 = chrono::high_resolution_clock::now();
+        size_t packedSize = filesystem::file_size("../../test_images/input/sample_1920.qoix");
+        cout << "Stage " << name << ": " << (double)packedSize/1000000 << "MB (" << (double)packedSize / (serialBytes.size() + 22) * 100
+             << "% of QOI), " << chrono::duration_cast<chrono::milliseconds>(e2 - e1).count() << "ms writing, "
+             << chrono::duration_cast<chrono::milliseconds>(e3 - e2).count() << "ms reading + decoding";
+        cout << (packed.getRAW() == serialPixels ? "" : " [OUTPUT DIFFERS FROM SERIAL]") << endl;
+        filesystem::remove("../../test_images/input/sample_1920.qoix");
+    }
 
-        char magic[4];
-        file.read(magic, 4);
-        if (strncmp(magic, "qoif", 4) != 0) {
-            cerr << "Invalid QOI magic." << endl;
-            return;
+    // a screenshot stand-in: lines of text drawn from 40 glyphs, which the LZ stage finds again and again
+    {
+        const uint32_t width = 1920, height = 1080;
+        vector<RGBValue> screen(width * height, RGBValue(255, 255, 255));
+        uint32_t seed = 7;
+        auto random = [&seed]() { seed = seed * 1103515245 + 12345; return seed >> 16; };
+        vector<uint8_t> glyphs(40 * 8 * 12);
+        for (auto& v : glyphs) v = random() % 3 ? 255 : (uint8_t)(random() % 160);
+        for (uint32_t y = 10; y + 12 <= height; y += 16) {
+            for (uint32_t x = 4; x + 8 <= width; x += 8) {
+                const uint8_t* glyph = &glyphs[random() % 40 * 96];
+                for (uint32_t gy = 0; gy < 12; gy++)
+                    for (uint32_t gx = 0; gx < 8; gx++) screen[(y + gy) * width + x + gx] = RGBValue(glyph[gy * 8 + gx], glyph[gy * 8 + gx], glyph[gy * 8 + gx]);
+            }
         }
-
-        file.read(reinterpret_cast<char*>(&m_width), 4);
-        file.read(reinterpret_cast<char*>(&m_height), 4);
-        file.read(reinterpret_cast<char*>(&m_channels), 1);
-        file.read(reinterpret_cast<char*>(&m_colorspace), 1);
-
-        m_QOIBytes.reserve(file.tellg());
-
-        while (true) {
-            int next = file.get();
-            if (next == EOF) break;
-            m_QOIBytes.push_back((uint8_t)next);
-
-            // Check if the last 8 bytes match end marker
-            if (m_QOIBytes.size() >= 8) {
-                bool isEndMarker = true;
-                for (int i = 0; i < 7; i++) {
-                    if (m_QOIBytes[m_QOIBytes.size() - 8 + i] != 0) {
-                        isEndMarker = false;
-                        break;
-                    }
-                }
-                if (isEndMarker && m_QOIBytes.back() == 1) {
-                    // Remove end marker from QOIBytes
-                    m_QOIBytes.resize(m_QOIBytes.size() - 8);
-                    break;
-                }
+        QOIConverter text;
+        text.setRAW(screen, width, height);
+        text.encode();
+        vector<uint8_t> textBytes = text.getQOI();
+        for (const vector<QOIStage>& stages : vector<vector<QOIStage>>{{QOIStage::Huffman}, {QOIStage::Lz}, {QOIStage::Lz, QOIStage::Huffman}}) {
+            string name;
+            for (QOIStage stage : stages) name += string(name.empty() ? "" : "+") + stageName(stage);
+            vector<uint8_t> packed = packStages(textBytes.data(), textBytes.size(), stages);
+            vector<uint8_t> current = packed, next;
+            bool same = true;
+            auto s1 = chrono::high_resolution_clock::now();
+            for (size_t k = stages.size(); same && k-- > 0;) {
+                same = unpackStage(stages[k], current.data(), current.size(), next, textBytes.size() * 2);
+                current.swap(next);
             }
+            auto s2 = chrono::high_resolution_clock::now();
+            cout << "Stage " << name << " (text screenshot): " << (double)packed.size() / textBytes.size() * 100 << "% of QOI, undone at "
+                 << textBytes.size() / max(chrono::duration<double>(s2 - s1).count(), 1e-9) / 1000000 << " MB/s of QOI";
+            cout << (same && current == textBytes ? "" : " [OUTPUT DIFFERS FROM SERIAL]") << endl;
         }
     }
 
-    void writeBMP(const string& filename) {
-        ofstream file(filename, ios::binary);
-        if (!file) {
-            cerr << "Failed to open BMP file for writing." << endl;
-            return;
-        }
-
-        uint32_t rowPadded = (m_width * 3 + 3) & (~3);
-        uint32_t fileSize = 54 + rowPadded * m_height;  // 54 = header size
-
-        // --- BMP HEADER ---
-        uint8_t header[54] = {
-            'B', 'M',                   // Signature
-            0,0,0,0,                     // File size
-            0,0,0,0,                     // Reserved
-            54,0,0,0,                    // Offset to pixel data
-            40,0,0,0,                    // DIB header size
-            0,0,0,0,                     // Width
-            0,0,0,0,                     // Height
-            1,0,                         // Planes
-            24,0,                        // Bits per pixel
-            0,0,0,0,                     // Compression
-            0,0,0,0,                     // Image size (can be 0 for uncompressed)
-            0,0,0,0,                     // X pixels per meter
-            0,0,0,0,                     // Y pixels per meter
-            0,0,0,0,                     // Colors in color table
-            0,0,0,0                      // Important color count
-        };
-
-        // Set file size
-        header[2] = (uint8_t)(fileSize);
-        header[3] = (uint8_t)(fileSize >> 8);
-        header[4] = (uint8_t)(fileSize >> 16);
-        header[5] = (uint8_t)(fileSize >> 24);
-
-        // Set width
-        header[18] = (uint8_t)(m_width);
-        header[19] = (uint8_t)(m_width >> 8);
-        header[20] = (uint8_t)(m_width >> 16);
-        header[21] = (uint8_t)(m_width >> 24);
-
-        // Set height
-        header[22] = (uint8_t)(m_height);
-        header[23] = (uint8_t)(m_height >> 8);
-        header[24] = (uint8_t)(m_height >> 16);
-        header[25] = (uint8_t)(m_height >> 24);
-
-        file.write(reinterpret_cast<char*>(header), 54);
-
-        // --- PIXEL DATA ---
-        vector<uint8_t> row(rowPadded, 0);
-        for (int y = m_height - 1; y >= 0; --y) { // BMP stores bottom-up
-            for (uint32_t x = 0; x < m_width; ++x) {
-                const RGBValue& px = m_RGBBytes[y * m_width + (m_width - x - 1)];
-                row[x * 3 + 0] = px.blue;
-                row[x * 3 + 1] = px.green;
-                row[x * 3 + 2] = px.red;
+    // a scanned page stand-in (A4 at 300 dpi): white with a few paragraphs, where QOI_OP_LONG_RUN pays off
+    {
+        const uint32_t width = 2480, height = 3508;
+        vector<RGBValue> page((size_t)width * height, RGBValue(255, 255, 255));
+        uint32_t seed = 11;
+        auto random = [&seed]() { seed = seed * 1103515245 + 12345; return seed >> 16; };
+        vector<uint8_t> glyphs(40 * 24 * 16, 0); // a few strokes each
+        for (uint32_t g = 0; g < 40; g++) {
+            for (uint32_t stroke = 0; stroke < 3; stroke++) {
+                uint32_t x0 = random() % 12, y0 = random() % 16;
+                bool vertical = random() % 2;
+                for (uint32_t k = 0; k < 8; k++)
+                    for (uint32_t t = 0; t < 3; t++)
+                        glyphs[g * 384 + (vertical ? (y0 + k) * 16 + x0 + t : (y0 + t) * 16 + x0 + k % 4)] = 1;
             }
-            file.write(reinterpret_cast<char*>(row.data()), rowPadded);
         }
-    }
-
-    void writeQOI(const string& filename) {
-        ofstream file(filename, ios::binary);
-        if (!file) {
-            cerr << "Failed to open QOI file for writing." << endl;
-            return;
+        for (uint32_t y = 300; y + 24 <= height - 300; y += 60) {
+            if (random() % 6 == 0) continue; // paragraph break
+            uint32_t lineEnd = width - 240 - (random() % 3 == 0 ? random() % 1200 : 0);
+            for (uint32_t x = 240; x + 16 <= lineEnd; x += 16) {
+                if (random() % 6 == 0) continue; // space
+                const uint8_t* glyph = &glyphs[random() % 40 * 384];
+                for (uint32_t gy = 0; gy < 24; gy++)
+                    for (uint32_t gx = 0; gx < 16; gx++)
+                        if (glyph[gy * 16 + gx]) page[(size_t)(y + gy) * width + x + gx] = RGBValue(30, 30, 30);
+            }
         }
-
-        file.write("qoif", 4);
-        file.write(reinterpret_cast<char*>(&m_width), 4);
-        file.write(reinterpret_cast<char*>(&m_height), 4);
-        file.write(reinterpret_cast<char*>(&m_channels), 1);
-        file.write(reinterpret_cast<char*>(&m_colorspace), 1);
-
-        // Write data chunks
-        for (const auto& byte : m_QOIBytes) {
-            file.put(byte);
+        QOIConverter scan;
+        scan.setRAW(page, width, height);
+        scan.encode();
+        vector<uint8_t> standardBytes = scan.getQOI();
+        scan.setFormat(QOIFormat::Extended);
+        scan.encode();
+        vector<uint8_t> extendedBytes = scan.getQOI();
+        scan.writeQOI("../../test_images/input/scan.qoi");
+        scan.setFormat(QOIFormat::Standard);
+        scan.readQOI("../../test_images/input/scan.qoi"); // back to Extended from the header
+        scan.decode();
+
+        // both kernels into one buffer that is already mapped in, alternating, best of 5 each
+        vector<RGBValue> decoded(page.size());
+        long standardUs = LONG_MAX, extendedUs = LONG_MAX;
+        bool same = true;
+        for (int round = 0; round < 5; round++) {
+            RGBValue index[64];
+            auto l1 = chrono::high_resolution_clock::now();
+            qoiKernels().decode(standardBytes.data(), standardBytes.size(), RGBValue(0, 0, 0), index, decoded.data(), decoded.size());
+            auto l2 = chrono::high_resolution_clock::now();
+            same = same && decoded == page;
+            RGBValue extendedIndex[64];
+            auto l3 = chrono::high_resolution_clock::now();
+            qoiKernels().decodeExtended(extendedBytes.data(), extendedBytes.size(), RGBValue(0, 0, 0), extendedIndex, IndexHash(), decoded.data(), decoded.size());
+            auto l4 = chrono::high_resolution_clock::now();
+            same = same && decoded == page;
+            standardUs = min(standardUs, (long)chrono::duration_cast<chrono::microseconds>(l2 - l1).count());
+            extendedUs = min(extendedUs, (long)chrono::duration_cast<chrono::microseconds>(l4 - l3).count());
         }
-
-        // 8-byte end marker
-        uint8_t endMarker[8] = {0, 0, 0, 0, 0, 0, 0, 1};
-        file.write(reinterpret_cast<char*>(endMarker), 8);
+        cout << "Extended format (scanned page): " << (double)extendedBytes.size() / standardBytes.size() * 100 << "% of QOI, decoding in "
+             << extendedUs << "us instead of " << standardUs << "us";
+        cout << (same && scan.getFormat() == QOIFormat::Extended && scan.getRAW() == page ? "" : " [OUTPUT DIFFERS FROM SERIAL]") << endl;
+        filesystem::remove("../../test_images/input/scan.qoi");
     }
 
-    vector<RGBValue> getRAW(bool print=false) {
-        if (print) {
-            for (RGBValue i : m_RGBBytes) {
-                i.print();
-            }   
-            cout << "-------------------------" << endl;
-            cout << "RAW Length: " << m_RGBBytes.size() << " bytes" << endl;
-        }
-
-        return m_RGBBytes;
+    // the wide index next to index[64], at its smallest and largest
+    for (pair<uint32_t, uint32_t> size : vector<pair<uint32_t, uint32_t>>{{256, 1}, {4096, 2}}) {
+        QOIConverter wide;
+        wide.setRAW(serialPixels, img.getWidth(), img.getHeight());
+        wide.setFormat(QOIFormat::Extended);
+        wide.setWideIndex(size.first, size.second);
+        auto w1 = chrono::high_resolution_clock::now();
+        wide.encode();
+        auto w2 = chrono::high_resolution_clock::now();
+        wide.decode();
+        auto w3 = chrono::high_resolution_clock::now();
+        cout << "Wide index (" << size.first << " entries, " << size.second << "-way): " << (double)wide.getQOISize() / serialBytes.size() * 100
+             << "% of QOI, " << chrono::duration_cast<chrono::milliseconds>(w2 - w1).count() << "ms encoding, "
+             << chrono::duration_cast<chrono::milliseconds>(w3 - w2).count() << "ms decoding";
+        cout << (wide.getRAW() == serialPixels ? "" : " [OUTPUT DIFFERS FROM SERIAL]") << endl;
     }
 
-    vector<uint8_t> getQOI(bool print=false) {
-        if (print) {
-            for (auto i : m_QOIBytes) {
-                cout << bitset<8>(i).to_string() << endl;
-            }
-            cout << "-------------------------" << endl;
-            cout << "QOI Length: " << m_QOIBytes.size() << " bytes" << endl;
-        }
+    // row prediction against the extended format without it
+    {
+        QOIConverter rows;
+        rows.setRAW(serialPixels, img.getWidth(), img.getHeight());
+        rows.setFormat(QOIFormat::Extended);
+        rows.encode();
+        size_t extendedSize = rows.getQOISize();
+        rows.setPrediction(true);
+        auto r1 = chrono::high_resolution_clock::now();
+        rows.encode();
+        auto r2 = chrono::high_resolution_clock::now();
+        rows.decode();
+        auto r3 = chrono::high_resolution_clock::now();
+        cout << "Row prediction: " << (double)rows.getQOISize() / extendedSize * 100 << "% of the extended format, "
+             << chrono::duration_cast<chrono::milliseconds>(r2 - r1).count() << "ms encoding, "
+             << chrono::duration_cast<chrono::milliseconds>(r3 - r2).count() << "ms decoding";
+        cout << (rows.getRAW() == serialPixels ? "" : " [OUTPUT DIFFERS FROM SERIAL]") << endl;
+    }
 
-        return m_QOIBytes;
+    // adaptive index hash on the sample posterized to 4 levels per channel, where the spec's hash puts every
+    // color in one slot
+    {
+        vector<RGBValue> poster = serialPixels;
+        for (auto& px : poster) px = RGBValue(px.red & 0xC0, px.green & 0xC0, px.blue & 0xC0);
+        QOIConverter palette;
+        palette.setRAW(poster, img.getWidth(), img.getHeight());
+        palette.setFormat(QOIFormat::Extended);
+        palette.encode();
+        size_t specSize = palette.getQOISize();
+        auto h1 = chrono::high_resolution_clock::now();
+        palette.encode();
+        auto h2 = chrono::high_resolution_clock::now();
+        uint8_t set = chooseIndexHash(poster.data(), poster.size());
+        auto h3 = chrono::high_resolution_clock::now();
+        palette.setAdaptiveIndexHash(true);
+        palette.encode();
+        palette.decode();
+        cout << "Adaptive index hash (posterized): set " << (int)palette.getExtension().indexHash << ", " << (double)palette.getQOISize() / specSize * 100
+             << "% of the spec's hash, choosing in " << chrono::duration_cast<chrono::microseconds>(h3 - h2).count() << "us against "
+             << chrono::duration_cast<chrono::microseconds>(h2 - h1).count() << "us encoding";
+        cout << (set == palette.getExtension().indexHash && palette.getRAW() == poster ? "" : " [OUTPUT DIFFERS FROM SERIAL]") << endl;
     }
 
-    void encode(bool verbose=false) {
-        size_t curIdx = 0;
-        RGBValue prevPixel;
-        m_QOIBytes.reserve(m_RGBBytes.size()*3);
-    
-        while (curIdx < m_RGBBytes.size()) {
-            // 1. check if it is same as previous pixel 
-            if (curIdx > 0 && m_RGBBytes[curIdx] == prevPixel) {
-                // if so, advance through image to look for length of run
-                uint8_t runLength = 0;
-                do {
-                    runLength++;
-                    curIdx++;
-                    if (runLength >= 62) // runLengths of 1..62 are allowed
-                        break;
-                } while (m_RGBBytes[curIdx] == prevPixel); // curIdx remains unprocessed, no need to update prevPixel
-    
-                m_QOIBytes.push_back(0b11000000 + runLength); // (QOI_OP_RUN)
-    
-                if (curIdx >= m_RGBBytes.size())
-                    break;
-            }
-    
-            // 2. try to express as difference from previous 
-            int dr = (int)m_RGBBytes[curIdx].red - (int)prevPixel.red; 
-            int dg = (int)m_RGBBytes[curIdx].green - (int)prevPixel.green;
-            int db = (int)m_RGBBytes[curIdx].blue - (int)prevPixel.blue;
-            
-            if ((-2<=dr && dr<=1) && (-2<=dg && dg<=1) && (-2<=db && db<=1)) { 
-                m_QOIBytes.push_back(0b01000000 + ((dr+2)<<4) + ((dg+2)<<2) + (db+2)); // (QOI_OP_DIFF)
-                
-                prevPixel = m_RGBBytes[curIdx];
-                curIdx++;
-                continue;
-            }
-            else if ((-32<=dg && dg<=31) && (-8<=(dr-dg) && (dr-dg)<=7) && (-8<=(db-dg) && (db-dg)<=7)) {
-                m_QOIBytes.push_back(0b10000000 + dg+32); // (QOI_OP_LUMA)
-                m_QOIBytes.push_back(((dr-dg+8)<<4 )+ (db-dg+8)); 
-                
-                prevPixel = m_RGBBytes[curIdx];
-                curIdx++;
-                continue;
-            }
+    // archival mode on the smallest sample: bits per pixel of plain QOI and of context mixing
+    {
+        QOIConverter small;
+        small.readBMP("../../test_images/input/sample_426.bmp");
+        small.encode();
+        vector<RGBValue> smallPixels = small.getRAW();
+        double pixels = (double)small.getWidth() * small.getHeight();
+        small.writeQOI("../../test_images/input/sample_426.qoi");
+        size_t plainSize = filesystem::file_size("../../test_images/input/sample_426.qoi");
+        auto m1 = chrono::high_resolution_clock::now();
+        small.writeQOI("../../test_images/input/sample_426.qoix", {QOIStage::Mix});
+        auto m2 = chrono::high_resolution_clock::now();
+        QOIConverter archived;
+        archived.readQOI("../../test_images/input/sample_426.qoix");
+        archived.decode();
+        auto m3 = chrono::high_resolution_clock::now();
+        size_t mixSize = filesystem::file_size("../../test_images/input/sample_426.qoix");
+        cout << "Stage mix (sample_426): " << plainSize * 8 / pixels << " bpp as QOI, " << mixSize * 8 / pixels << " bpp mixed, "
+             << chrono::duration_cast<chrono::milliseconds>(m2 - m1).count() << "ms writing, "
+             << chrono::duration_cast<chrono::milliseconds>(m3 - m2).count() << "ms reading + decoding";
+        cout << (archived.getRAW() == smallPixels ? "" : " [OUTPUT DIFFERS FROM SERIAL]") << endl;
+        filesystem::remove("../../test_images/input/sample_426.qoi");
+        filesystem::remove("../../test_images/input/sample_426.qoix");
+    }
 
-            // 3. check index array
-            uint8_t hash = m_RGBBytes[curIdx].hash();
-            if (index[hash].isNull) { // hash is not in index
-                index[hash] = m_RGBBytes[curIdx];
-                m_QOIBytes.push_back(hash); // (QOI_OP_INDEX)
-                
-                prevPixel = m_RGBBytes[curIdx];
-                curIdx++;
-                continue;
-            } 
-            else if (index[hash] == m_RGBBytes[curIdx]) { // we can reuse index
-                m_QOIBytes.push_back(hash); // (QOI_OP_INDEX)
-    
-                prevPixel = m_RGBBytes[curIdx];
-                curIdx++;
-                continue;
-            }
-    
-            // 4. last resort: store full RGBValue (QOI_OP_RGB)
-            m_QOIBytes.push_back(0b11111110);
-            m_QOIBytes.push_back(m_RGBBytes[curIdx].red);
-            m_QOIBytes.push_back(m_RGBBytes[curIdx].green);
-            m_QOIBytes.push_back(m_RGBBytes[curIdx].blue);
+    img.encodeSegmented(32);
+    cout << "Segmented size: " << (double)img.getQOI().size()/1000000 << "MB (" << img.getSegments().size() << " segments)" << endl;
+    auto p5 = chrono::high_resolution_clock::now();
+    img.decode();
+    auto p6 = chrono::high_resolution_clock::now();
+    duration = chrono::duration_cast<chrono::milliseconds>(p6 - p5);
+    cout << "Time taken (interleaved segment decoding, 1 thread): " << duration.count() << "ms";
+    cout << (img.getRAW() == serialPixels ? "" : " [OUTPUT DIFFERS FROM SERIAL]") << endl;
+    img.writeQOI("../../test_images/input/sample_1920.qoi");
+    inPlace.readQOIInPlace("../../test_images/input/sample_1920.qoi");
+    cout << "In-place segmented decoding" << (inPlace.getRAW() == serialPixels ? " matches" : " [OUTPUT DIFFERS FROM SERIAL]") << endl;
     
-            prevPixel = m_RGBBytes[curIdx];
-            curIdx++;
-        }
-
-        if (verbose) {
-            cout << "Original size:   " << (double)m_RGBBytes.size()*3/1000000 << "MB" << endl;
-            cout << "Compressed size: " << (double)m_QOIBytes.size()/1000000 << "MB" << endl;
-            cout << "Compression Rate: " << (double)(m_RGBBytes.size()*3 - m_QOIBytes.size()) / (double)m_RGBBytes.size() / 3 * 100 << "%" << endl;
+    // the sample cut into 32x32 thumbnails, encoded one by one and as a batch
+    const uint32_t tile = 32;
+    vector<QOIConverter> thumbs;
+    for (uint32_t ty = 0; ty + tile <= img.getHeight(); ty += tile) {
+        for (uint32_t tx = 0; tx + tile <= img.getWidth(); tx += tile) {
+            vector<RGBValue> pixels(tile * tile);
+            for (uint32_t y = 0; y < tile; y++)
+                copy_n(&serialPixels[(ty + y) * img.getWidth() + tx], tile, &pixels[y * tile]);
+            thumbs.emplace_back();
+            thumbs.back().setRAW(pixels, tile, tile);
         }
     }
-    
-    void decode() {
-        m_RGBBytes = {};
-        m_RGBBytes.reserve(m_width*m_height*3 + 9);
-        size_t curIdx = 0;
-
-        while (curIdx < m_QOIBytes.size()) {
-            uint8_t curByte = m_QOIBytes[curIdx++];
-
-            // QOI_OP_RGB
-            if (curByte == 0b11111110) {
-                uint8_t r = m_QOIBytes[curIdx++];
-                uint8_t g = m_QOIBytes[curIdx++];
-                uint8_t b = m_QOIBytes[curIdx++];
-                
-                RGBValue pixel(r, g, b);
-                m_RGBBytes.push_back(pixel);
-                continue;
-            }
-
-            // QOI_OP_INDEX
-            if (curByte >> 6 == 0b00) {
-                RGBValue pixel = index[curByte];
-                m_RGBBytes.push_back(pixel);
-                continue;
-            } 
-
-            // QOI_OP_DIFF
-            if (curByte >> 6 == 0b01) {
-                int dr = ((curByte >> 4) & 0b11) - 2;
-                int dg = ((curByte >> 2) & 0b11) - 2;
-                int db = (curByte & 0b11) - 2;
-
-                RGBValue pixel(m_RGBBytes.back().red + dr, m_RGBBytes.back().green + dg, m_RGBBytes.back().blue + db);
-                m_RGBBytes.push_back(pixel);
-                continue;
-            } 
-
-            // QOI_OP_LUMA
-            if (curByte >> 6 == 0b10) {
-                uint8_t b2 = m_QOIBytes[curIdx++];
-                int dg = (curByte & 0b111111) - 32;
-                int dr_dg = ((b2 >> 4) & 0b1111) - 8;
-                int db_dg = (b2 & 0b1111) - 8;
-                int dr = dr_dg + dg;
-                int db = db_dg + dg;
-
-                RGBValue pixel(m_RGBBytes.back().red + dr, m_RGBBytes.back().green + dg, m_RGBBytes.back().blue + db);
-                m_RGBBytes.push_back(pixel);
-                continue;
-            } 
-            
-            // QOI_OP_RUN
-            if (curByte >> 6 == 0b11) {
-                uint8_t run = curByte & 0b111111;
-                for (int i=0; i<run; i++) {
-                    m_RGBBytes.push_back(m_RGBBytes.back());
-                }
-            }
+    vector<vector<uint8_t>> thumbBytes;
+    auto b1 = chrono::high_resolution_clock::now();
+    for (auto& thumb : thumbs) {
+        thumb.encode();
+        thumbBytes.push_back(thumb.getQOI());
+    }
+    auto b2 = chrono::high_resolution_clock::now();
+    QOIConverter::encodeMany(thumbs);
+    auto b3 = chrono::high_resolution_clock::now();
+    bool sameBytes = true;
+    for (size_t k = 0; k < thumbs.size(); k++) sameBytes = sameBytes && thumbs[k].getQOI() == thumbBytes[k];
+    cout << "Time taken (" << thumbs.size() << " thumbnails, encode each): " << chrono::duration_cast<chrono::microseconds>(b2 - b1).count() << "us" << endl;
+    cout << "Time taken (" << thumbs.size() << " thumbnails, encodeMany): " << chrono::duration_cast<chrono::microseconds>(b3 - b2).count() << "us";
+    cout << (sameBytes ? "" : " [OUTPUT DIFFERS FROM SERIAL]") << endl;
+
+    BufferPoolStats pixelPool = BufferPool<RGBValue>::shared().stats();
+    BufferPoolStats bytePool = BufferPool<uint8_t>::shared().stats();
+    cout << "Buffer pools: " << pixelPool.allocations + bytePool.allocations << " allocations, "
+         << pixelPool.reuses + bytePool.reuses << " reuses" << endl;
+
+    // the same thumbnails again one at a time, as a batch would convert them: every buffer comes from the pool
+    {
+        vector<vector<RGBValue>> thumbPixels;
+        for (auto& thumb : thumbs) thumbPixels.push_back(thumb.getRAW());
+        thumbs.clear(); // back to the pools
+        BufferPoolStats pixelsBefore = BufferPool<RGBValue>::shared().stats(), bytesBefore = BufferPool<uint8_t>::shared().stats();
+        bool same = true;
+        for (size_t k = 0; k < thumbPixels.size(); k++) {
+            QOIConverter thumb;
+            thumb.setRAW(thumbPixels[k], tile, tile);
+            thumb.encode();
+            QOIConverter copy = thumb;
+            same = same && copy.getQOI() == thumbBytes[k];
         }
+        BufferPoolStats pixelsAfter = BufferPool<RGBValue>::shared().stats(), bytesAfter = BufferPool<uint8_t>::shared().stats();
+        cout << "Buffer pools (" << thumbPixels.size() << " thumbnails one after another, each copied once): "
+             << pixelsAfter.allocations + bytesAfter.allocations - pixelsBefore.allocations - bytesBefore.allocations << " allocations, "
+             << pixelsAfter.reuses + bytesAfter.reuses - pixelsBefore.reuses - bytesBefore.reuses << " reuses";
+        cout << (same ? "" : " [OUTPUT DIFFERS FROM SERIAL]") << endl;
     }
-};
-
-// ----- SAMPLE IMPLEMENTATION -----
 
-int main() {
-    QOIConverter img;
+    // every sample BMP to QOI and back, one pinned thread pool per NUMA node
+    BatchConverter batch;
+    string tmp = filesystem::temp_directory_path().string() + "/";
+    vector<ConvertJob> toQOI, toBMP;
+    for (const char* name : {"sample_426", "sample_853", "sample_1280", "sample_1920", "sample_3456"}) {
+        toQOI.push_back({string("../../test_images/input/") + name + ".bmp", tmp + name + ".qoi"});
+        toBMP.push_back({tmp + name + ".qoi", tmp + name + "_NEW.bmp"});
+    }
+    auto n1 = chrono::high_resolution_clock::now();
+    size_t converted = batch.run(toQOI);
+    converted += batch.run(toBMP);
+    auto n2 = chrono::high_resolution_clock::now();
+    cout << "Time taken (batch BMP -> QOI -> BMP, " << batch.nodeCount() << " NUMA nodes): "
+         << chrono::duration_cast<chrono::milliseconds>(n2 - n1).count() << "ms, "
+         << converted << "/" << toQOI.size() + toBMP.size() << " converted" << endl;
+    vector<NumaNodeStats> nodeStats = batch.stats();
+    for (size_t n = 0; n < nodeStats.size(); n++) {
+        const NumaNodeStats& s = nodeStats[n];
+        cout << "  node " << n << ": " << s.workers << " workers, " << s.images << " images, "
+             << s.pixels / 1000000.0 / max(s.seconds, 1e-9) << " MP/s per worker, "
+             << s.bytesIn << " -> " << s.bytesOut << " bytes, " << s.remote << " remote, " << s.failed << " failed" << endl;
+    }
+    for (auto& job : toBMP) {
+        filesystem::remove(job.input);
+        filesystem::remove(job.output);
+    }
 
-    auto start = chrono::high_resolution_clock::now();
-    
-    img.readBMP("../../test_images/input/sample_1920.bmp");
-    auto t1 = chrono::high_resolution_clock::now();
-    
-    img.encode(true);
-    auto t2 = chrono::high_resolution_clock::now();
-    auto duration = chrono::duration_cast<chrono::milliseconds>(t2 - t1);
-    cout << "Time taken (encoding): " << duration.count() << "ms" << endl;
-    
-    img.writeQOI("../../test_images/input/sample_1920.qoi");
-    auto t3 = chrono::high_resolution_clock::now();
-    
-    img.readQOI("../../test_images/input/sample_1920.qoi");
-    auto t4 = chrono::high_resolution_clock::now();
+    // the same BMPs split across 3 shards by path hash, as 3 nodes would run them, then merged
+    vector<string> manifests;
+    for (uint32_t shard = 0; shard < 3; shard++) {
+        manifests.push_back(shardManifestPath(tmp, shard));
+        runShard(toQOI, shard, 3, ShardKey::Path, manifests.back(), batch);
+    }
+    ShardMergeReport shards = mergeShardManifests(manifests, 3, tmp + "corpus.manifest", &toQOI);
+    cout << "Sharded batch (3 shards): " << shards.succeeded << "/" << shards.jobs << " converted"
+         << (shards.complete() ? "" : " [SHARDS MISSING OR FAILED]") << endl;
+    for (auto& manifest : manifests) filesystem::remove(manifest);
+    filesystem::remove(tmp + "corpus.manifest");
+
+    // the outputs are still there: a journaled rerun after dropping one of them only redoes that one
+    filesystem::remove(tmp + "batch.journal");
+    runResumable(toQOI, tmp + "batch.journal", batch);
+    filesystem::remove(toQOI[2].output);
+    auto r1 = chrono::high_resolution_clock::now();
+    ResumeStats resumed = runResumable(toQOI, tmp + "batch.journal", batch);
+    auto r2 = chrono::high_resolution_clock::now();
+    cout << "Time taken (resumed batch): " << chrono::duration_cast<chrono::milliseconds>(r2 - r1).count() << "ms, "
+         << resumed.converted << " converted, " << resumed.skipped << " already done" << endl;
+    filesystem::remove(tmp + "batch.journal");
+    for (auto& job : toQOI) filesystem::remove(job.output);
+
+#ifdef __linux__
+    // a BMP renamed into a watched folder, converted as soon as the rename is seen
+    filesystem::create_directories(tmp + "qoi_watch");
+    {
+        WatchFolder watch(tmp + "qoi_watch", tmp + "qoi_watch/out");
+        if (watch.start()) {
+            filesystem::copy_file(toQOI[0].input, tmp + "dropped.bmp", filesystem::copy_options::overwrite_existing);
+            filesystem::rename(tmp + "dropped.bmp", tmp + "qoi_watch/dropped.bmp");
+            this_thread::sleep_for(chrono::milliseconds(50));
+            watch.waitIdle(chrono::milliseconds(5000));
+            WatchStats watched = watch.stats();
+            cout << "Watch folder: " << watched.converted << " converted, latency " << watched.maxLatency * 1000 << "ms (20ms debounce)" << endl;
+        }
+    }
+    filesystem::remove_all(tmp + "qoi_watch");
+#endif
+
+    // 8 bands encoded by 4 worker processes, merged into one segmented file
+    auto d1 = chrono::high_resolution_clock::now();
+    bool distributed = encodeDistributed("../../test_images/input/sample_1920.bmp", tmp + "distributed.qoi", tmp, 8, 4, "/proc/self/exe");
+    auto d2 = chrono::high_resolution_clock::now();
+    QOIConverter merged;
+    merged.readQOI(tmp + "distributed.qoi");
+    merged.decode();
+    cout << "Time taken (split / encode in 4 processes / merge): " << chrono::duration_cast<chrono::milliseconds>(d2 - d1).count() << "ms, "
+         << merged.getSegments().size() << " segments";
+    cout << (distributed && merged.getRAW() == serialPixels ? "" : " [OUTPUT DIFFERS FROM SERIAL]") << endl;
+    filesystem::remove(tmp + "distributed.qoi");
+
+    // file to file through mappings, 64 rows at a time
+    auto g1 = chrono::high_resolution_clock::now();
+    bool banded = encodeFileBanded("../../test_images/input/sample_1920.bmp", tmp + "banded.qoi", 64)
+               && decodeFileBanded(tmp + "banded.qoi", tmp + "banded.bmp", 64);
+    auto g2 = chrono::high_resolution_clock::now();
+    QOIConverter bandedImg;
+    bandedImg.readBMP(tmp + "banded.bmp");
+    cout << "Time taken (banded BMP -> QOI -> BMP): " << chrono::duration_cast<chrono::milliseconds>(g2 - g1).count() << "ms";
+    cout << (banded && bandedImg.getRAW() == serialPixels ? "" : " [OUTPUT DIFFERS FROM SERIAL]") << endl;
+    filesystem::remove(tmp + "banded.qoi");
+    filesystem::remove(tmp + "banded.bmp");
 
-    img.decode();
-    auto t5 = chrono::high_resolution_clock::now();
-    duration = chrono::duration_cast<chrono::milliseconds>(t5 - t4);
-    cout << "Time taken (decoding): " << duration.count() << "ms" << endl;
-    
     img.writeBMP("../../test_images/input/sample_1920_NEW.bmp");
 }
\ No newline at end of file
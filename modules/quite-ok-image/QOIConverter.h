@@ -0,0 +1,812 @@
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <fstream>
+#include <bitset>
+#include <cstring>
+#include <algorithm>
+#include <map>
+
+#include "RGBValue.h"
+#include "CpuDispatch.h"
+#include "ThreadPool.h"
+#include "ParallelEncode.h"
+#include "ParallelDecode.h"
+#include "Segmented.h"
+#include "BufferPool.h"
+#include "Stages.h"
+
+using namespace std;
+
+// Which opcodes a stream may use
+enum class QOIFormat {
+    Standard, // QOI v1.0, for any decoder
+    Extended, // adds QOI_OP_LONG_RUN (see QOIKernels.h), flagged in the header so other decoders refuse the file
+};
+
+// Options of an extended-format file. They are stored in an extension header that follows the QOI header:
+//   field count (u8), then one byte per field in the order below
+// A field the file does not have takes its default. Files with more fields than a reader knows are refused.
+struct QOIExtension {
+    uint8_t wideIndexBits = 0; // log2 of the wide index entries (WideIndex.h), 0 for none
+    uint8_t wideIndexWays = 1; // 1 or 2
+    uint8_t indexHash = 0;     // set of INDEX_HASHES (QOIKernels.h) index[64] hashes with, 0 for the spec's
+    uint8_t prediction = 0;    // 1: a predictor per row (Predict.h), not together with the wide index
+};
+
+const uint8_t QOI_EXTENSION_FIELDS = 4;
+
+inline vector<uint8_t> serializeExtension(const QOIExtension& ext) {
+    return {QOI_EXTENSION_FIELDS, ext.wideIndexBits, ext.wideIndexWays, ext.indexHash, ext.prediction};
+}
+
+// Reads count fields into ext. Returns false if there are unknown fields or a value is out of range.
+inline bool parseExtension(const uint8_t* fields, size_t count, QOIExtension& ext) {
+    ext = QOIExtension();
+    if (count > QOI_EXTENSION_FIELDS) return false;
+    if (count > 0) ext.wideIndexBits = fields[0];
+    if (count > 1) ext.wideIndexWays = fields[1];
+    if (count > 2) ext.indexHash = fields[2];
+    if (count > 3) ext.prediction = fields[3];
+    bool wide = ext.wideIndexBits >= WIDE_INDEX_MIN_BITS && ext.wideIndexBits <= WIDE_INDEX_MAX_BITS;
+    return (ext.wideIndexBits == 0 || wide) && (ext.wideIndexWays == 1 || ext.wideIndexWays == 2) && ext.indexHash < INDEX_HASH_COUNT &&
+           (ext.prediction == 0 || (ext.prediction == 1 && ext.wideIndexBits == 0));
+}
+
+// ----- INDEX HASH SELECTION -----
+// Replaying the sets costs about twice what encoding does per pixel, so they only see 1 pixel in
+// HASH_SAMPLE_RATIO: up to HASH_SAMPLE_STRIPES stretches of at most HASH_SAMPLE_STRIPE pixels, spread evenly over
+// the image. A stretch is a few rows, enough for the index to fill and for the colors that repeat along a row to
+// come back. The spec's set wins ties.
+
+const size_t HASH_SAMPLE_STRIPE = 2048;
+const size_t HASH_SAMPLE_STRIPES = 32;
+const size_t HASH_SAMPLE_RATIO = 64;
+
+inline uint8_t chooseIndexHash(const RGBValue* pixels, size_t count) {
+    if (count == 0) return 0; // nothing to sample, the spec's set
+    uint32_t scores[INDEX_HASH_COUNT] = {};
+    size_t sample = count / HASH_SAMPLE_RATIO + 1;
+    size_t stripes = min(HASH_SAMPLE_STRIPES, (sample + HASH_SAMPLE_STRIPE - 1) / HASH_SAMPLE_STRIPE);
+    size_t length = min(HASH_SAMPLE_STRIPE, sample / stripes);
+    for (size_t s = 0; s < stripes; s++) {
+        qoiKernels().scoreIndexHashes(pixels + (count - length) * s / stripes, length, scores);
+    }
+
+    uint8_t best = 0;
+    for (uint8_t s = 1; s < INDEX_HASH_COUNT; s++) {
+        if (scores[s] > scores[best]) best = s;
+    }
+    return best;
+}
+
+class QOIConverter {
+private:
+    RGBValue index[64];
+    vector<RGBValue> m_RGBBytes;
+    vector<uint8_t> m_QOIBytes;
+    vector<QOISegment> m_segments; // seek table, empty for plain single-stream data
+    uint32_t m_width;
+    uint32_t m_height;
+    uint32_t m_channels;
+    uint32_t m_colorspace;
+    QOIFormat m_format = QOIFormat::Standard;
+    QOIExtension m_extension;
+    bool m_adaptiveHash = false; // encode() picks m_extension.indexHash per image
+
+    // Everything but the two pooled buffers, for the copy and move operations below (new members go here too)
+    void copySettings(const QOIConverter& other) {
+        copy(other.index, other.index + 64, index);
+        m_segments = other.m_segments;
+        m_width = other.m_width;
+        m_height = other.m_height;
+        m_channels = other.m_channels;
+        m_colorspace = other.m_colorspace;
+        m_format = other.m_format;
+        m_extension = other.m_extension;
+        m_adaptiveHash = other.m_adaptiveHash;
+    }
+
+    void resetIndex() {
+        for (int i=0; i<64; i++)
+            index[i] = RGBValue(); // initialize to NULL
+    }
+
+    void printStats() {
+        cout << "Original size:   " << (double)m_RGBBytes.size()*3/1000000 << "MB" << endl;
+        cout << "Compressed size: " << (double)m_QOIBytes.size()/1000000 << "MB" << endl;
+        cout << "Compression Rate: " << (double)(m_RGBBytes.size()*3 - m_QOIBytes.size()) / (double)m_RGBBytes.size() / 3 * 100 << "%" << endl;
+    }
+
+    // QOI header fields are big-endian
+    static void writeBE32(ofstream& file, uint32_t value) {
+        uint8_t bytes[4] = { (uint8_t)(value >> 24), (uint8_t)(value >> 16), (uint8_t)(value >> 8), (uint8_t)value };
+        file.write(reinterpret_cast<char*>(bytes), 4);
+    }
+
+    // Splits the extended-format flag off the colorspace byte just read, then reads the extension header if
+    // there is one. Returns false if it cannot be read.
+    bool readFormat(ifstream& file) {
+        m_format = (m_colorspace & QOI_EXTENDED_FLAG) ? QOIFormat::Extended : QOIFormat::Standard;
+        m_colorspace &= ~(uint32_t)QOI_EXTENDED_FLAG;
+        m_extension = QOIExtension();
+        if (m_format == QOIFormat::Standard) return true;
+
+        uint8_t fields[256];
+        uint8_t count = 0;
+        file.read(reinterpret_cast<char*>(&count), 1);
+        file.read(reinterpret_cast<char*>(fields), count);
+        if (!file || !parseExtension(fields, count, m_extension)) {
+            cerr << "Unsupported QOI extension header." << endl;
+            return false;
+        }
+        return true;
+    }
+
+    bool usesWideIndex() const {
+        return m_format == QOIFormat::Extended && m_extension.wideIndexBits != 0;
+    }
+
+    bool usesPrediction() const {
+        return m_format == QOIFormat::Extended && m_extension.prediction != 0;
+    }
+
+    IndexHash indexHash() const {
+        return m_format == QOIFormat::Extended ? INDEX_HASHES[m_extension.indexHash] : IndexHash();
+    }
+
+    // With the adaptive hash, samples the image for the set the next encode hashes with
+    void prepareIndexHash() {
+        if (m_adaptiveHash && m_format == QOIFormat::Extended) m_extension.indexHash = chooseIndexHash(m_RGBBytes.data(), m_RGBBytes.size());
+    }
+
+    // The extension header for the stream held. Segments use none of the options (standard hash, no wide index,
+    // no row prediction), whatever the settings.
+    QOIExtension streamExtension() const {
+        return m_segments.empty() ? m_extension : QOIExtension();
+    }
+
+    // Decodes a stream from a fresh state with the kernel for its format
+    size_t decodeStream(const uint8_t* bytes, size_t count, RGBValue* out, size_t pixelCount) {
+        const QOIKernels& kernels = qoiKernels();
+        if (usesWideIndex()) {
+            WideIndex wide;
+            wide.reset(m_extension.wideIndexBits, m_extension.wideIndexWays);
+            return kernels.decodeWide(bytes, count, RGBValue(0, 0, 0), index, indexHash(), wide, out, pixelCount);
+        }
+        if (usesPrediction()) return kernels.decodePredicted(bytes, count, m_width, index, indexHash(), out, pixelCount);
+        if (m_format == QOIFormat::Extended) return kernels.decodeExtended(bytes, count, RGBValue(0, 0, 0), index, indexHash(), out, pixelCount);
+        return kernels.decode(bytes, count, RGBValue(0, 0, 0), index, out, pixelCount);
+    }
+
+    static uint32_t readBE32(ifstream& file) {
+        uint8_t bytes[4] = {0, 0, 0, 0};
+        file.read(reinterpret_cast<char*>(bytes), 4);
+        return ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 8) | bytes[3];
+    }
+
+public:
+    QOIConverter() {
+        resetIndex();
+    }
+
+    // pixel and QOI buffers go back to the shared pools for the next image
+    ~QOIConverter() {
+        BufferPool<RGBValue>::shared().release(m_RGBBytes);
+        BufferPool<uint8_t>::shared().release(m_QOIBytes);
+    }
+
+    // Copies take their buffers from the pools too, so the destructor only ever hands back pooled storage
+    QOIConverter(const QOIConverter& other) {
+        *this = other;
+    }
+
+    QOIConverter(QOIConverter&&) = default;
+
+    QOIConverter& operator=(const QOIConverter& other) {
+        if (this == &other) return *this;
+        copySettings(other);
+        BufferPool<RGBValue>::shared().acquire(m_RGBBytes, other.m_RGBBytes.size());
+        m_RGBBytes.assign(other.m_RGBBytes.begin(), other.m_RGBBytes.end());
+        BufferPool<uint8_t>::shared().acquire(m_QOIBytes, other.m_QOIBytes.size());
+        m_QOIBytes.assign(other.m_QOIBytes.begin(), other.m_QOIBytes.end());
+        return *this;
+    }
+
+    // The buffers this one holds go back to the pools before other's are taken over
+    QOIConverter& operator=(QOIConverter&& other) noexcept {
+        if (this == &other) return *this;
+        copySettings(other);
+        BufferPool<RGBValue>::shared().release(m_RGBBytes);
+        BufferPool<uint8_t>::shared().release(m_QOIBytes);
+        m_RGBBytes = std::move(other.m_RGBBytes);
+        m_QOIBytes = std::move(other.m_QOIBytes);
+        return *this;
+    }
+    
+    // Reads a bottom-up 24-bit BMP. Returns false, with no pixels held, if the file is not one or is cut short.
+    bool readBMP(const string& filename, int channels=3, int colorspace=0) {
+        m_RGBBytes.clear();
+        m_channels = channels;
+        m_colorspace = colorspace;
+
+        ifstream file(filename, ios::binary | ios::ate);
+        uint8_t header[54];
+        size_t fileSize = file ? (size_t)file.tellg() : 0;
+        if (!file || fileSize < sizeof(header) || !file.seekg(0).read(reinterpret_cast<char*>(header), sizeof(header))
+            || header[0] != 'B' || header[1] != 'M') {
+            cerr << "Failed to open BMP file." << endl;
+            return false;
+        }
+
+        auto field = [&](size_t at) {
+            return (uint32_t)header[at] | (header[at + 1] << 8) | (header[at + 2] << 16) | ((uint32_t)header[at + 3] << 24);
+        };
+        uint32_t dataOffset = field(10);
+        uint32_t width = field(18);
+        int32_t signedHeight = (int32_t)field(22);
+        uint16_t bitsPerPixel = header[28] | (header[29] << 8);
+        if (signedHeight <= 0 || bitsPerPixel != 24) {
+            cerr << "Only bottom-up 24-bit BMP files are supported." << endl;
+            return false;
+        }
+        if (width == 0) {
+            cerr << "BMP file has no pixels." << endl;
+            return false;
+        }
+        size_t rowPadded = bmpRowSize(width);
+        if (dataOffset > fileSize || (fileSize - dataOffset) / rowPadded < (uint32_t)signedHeight) {
+            cerr << "BMP file is truncated." << endl;
+            return false;
+        }
+        m_width = width;
+        m_height = (uint32_t)signedHeight;
+
+        file.seekg(dataOffset);
+        vector<uint8_t> row;
+        BufferPool<uint8_t>::shared().acquire(row, rowPadded);
+        row.resize(rowPadded);
+        BufferPool<RGBValue>::shared().acquire(m_RGBBytes, (size_t)m_width * m_height);
+        m_RGBBytes.resize((size_t)m_width * m_height);
+
+        const QOIKernels& kernels = qoiKernels();
+        for (uint32_t y = 0; y < m_height && file; y++) {
+            file.read(reinterpret_cast<char*>(row.data()), rowPadded);
+            // BMP stored bottom-up
+            kernels.bgrToRGB(row.data(), &m_RGBBytes[(size_t)(m_height - 1 - y) * m_width], m_width);
+        }
+        BufferPool<uint8_t>::shared().release(row);
+        if (!file) {
+            cerr << "Failed to read BMP file." << endl;
+            m_RGBBytes.clear();
+            return false;
+        }
+        return true;
+    }
+
+    void readQOI(const string& filename, int channels=3, int colorspace=0) {
+        m_QOIBytes.clear();
+        m_segments = {};
+        m_channels = channels;
+        m_colorspace = colorspace;
+
+        ifstream file(filename, ios::binary);
+        if (!file) {
+            cerr << "Failed to open QOI file for reading." << endl;
+            return;
+        }
+
+        char magic[4];
+        file.read(magic, 4);
+        bool packed = memcmp(magic, PACKED_MAGIC, 4) == 0;
+        if (strncmp(magic, "qoif", 4) != 0 && !packed) {
+            cerr << "Invalid QOI magic." << endl;
+            return;
+        }
+
+        m_width = readBE32(file);
+        m_height = readBE32(file);
+        file.read(reinterpret_cast<char*>(&m_channels), 1);
+        file.read(reinterpret_cast<char*>(&m_colorspace), 1);
+        if (!readFormat(file)) return;
+
+        // rest of the file: data chunks, end marker, optional seek table (behind entropy stages if packed)
+        if (packed) {
+            // at most a QOI_OP_RGBA and a seek table entry per pixel
+            if (!readPackedBody(file, m_QOIBytes, (uint64_t)m_width * m_height * 21 + 64)) {
+                cerr << "Damaged QOI stage data." << endl;
+                m_QOIBytes.clear();
+                return;
+            }
+        }
+        else {
+            streampos dataStart = file.tellg();
+            file.seekg(0, ios::end);
+            size_t remaining = (size_t)(file.tellg() - dataStart);
+            file.seekg(dataStart);
+            BufferPool<uint8_t>::shared().acquire(m_QOIBytes, remaining);
+            m_QOIBytes.resize(remaining);
+            file.read(reinterpret_cast<char*>(m_QOIBytes.data()), remaining);
+        }
+
+        // Remove end marker from QOIBytes. A seek table must directly follow it, otherwise
+        // anything after the first end marker is ignored
+        const uint8_t endMarker[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+        size_t tableStart;
+        m_segments = parseSeekTable(m_QOIBytes, tableStart);
+        if (!m_segments.empty() && tableStart >= 8 && memcmp(&m_QOIBytes[tableStart - 8], endMarker, 8) == 0) {
+            m_QOIBytes.resize(tableStart - 8);
+        } else {
+            m_segments = {};
+            auto marker = search(m_QOIBytes.begin(), m_QOIBytes.end(), endMarker, endMarker + 8);
+            m_QOIBytes.resize(marker - m_QOIBytes.begin());
+        }
+
+        if (!validSeekTable(m_segments, m_QOIBytes.size(), (size_t)m_width * m_height)) {
+            cerr << "Ignoring invalid QOI seek table." << endl;
+            m_segments = {};
+        }
+    }
+
+    // Reads and decodes with a single buffer sized for the decoded image: the data chunks are read into its tail
+    // and pixels decoded from its front, so no separate QOI buffer is held. Every opcode reads at most 4 bytes and
+    // writes at least one 4-byte pixel (QOI_OP_LONG_RUN: at most 11 bytes for at least 63 pixels), so the write
+    // cursor never passes the read cursor as long as the stream ends with the last pixel, which every conforming
+    // encoder guarantees. getQOI() is empty afterwards.
+    // Files with data after the end marker (other than a seek table) go through readQOI() and decode() instead.
+    void readQOIInPlace(const string& filename, int channels=3, int colorspace=0) {
+        m_RGBBytes.clear();
+        BufferPool<uint8_t>::shared().release(m_QOIBytes);
+        m_segments = {};
+        m_channels = channels;
+        m_colorspace = colorspace;
+
+        ifstream file(filename, ios::binary);
+        if (!file) {
+            cerr << "Failed to open QOI file for reading." << endl;
+            return;
+        }
+
+        char magic[4];
+        file.read(magic, 4);
+        if (memcmp(magic, PACKED_MAGIC, 4) == 0) { // the stages have to be undone into a separate buffer anyway
+            file.close();
+            readQOI(filename, channels, colorspace);
+            decode();
+            BufferPool<uint8_t>::shared().release(m_QOIBytes);
+            return;
+        }
+        if (strncmp(magic, "qoif", 4) != 0) {
+            cerr << "Invalid QOI magic." << endl;
+            return;
+        }
+
+        m_width = readBE32(file);
+        m_height = readBE32(file);
+        file.read(reinterpret_cast<char*>(&m_channels), 1);
+        file.read(reinterpret_cast<char*>(&m_colorspace), 1);
+        if (!readFormat(file)) return;
+
+        // find the end of the data chunks from the back: end marker, optional seek table
+        streampos dataStart = file.tellg();
+        file.seekg(0, ios::end);
+        size_t remaining = (size_t)(file.tellg() - dataStart);
+        const uint8_t endMarker[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+        size_t trailer = 0;
+        uint8_t last[8];
+        if (remaining >= 8) {
+            file.seekg(dataStart + (streamoff)(remaining - 8));
+            file.read(reinterpret_cast<char*>(last), 8);
+            if (memcmp(last, endMarker, 8) == 0) trailer = 8;
+            else if (memcmp(last + 4, SEEK_TABLE_MAGIC, 4) == 0) {
+                uint64_t tableBytes = loadBE(last, 4) * 16 + 8;
+                if (tableBytes + 8 <= remaining) {
+                    vector<uint8_t> tail(tableBytes + 8);
+                    file.seekg(dataStart + (streamoff)(remaining - tail.size()));
+                    file.read(reinterpret_cast<char*>(tail.data()), tail.size());
+                    size_t tableStart;
+                    vector<QOISegment> segments = parseSeekTable(tail, tableStart);
+                    if (!segments.empty() && tableStart == 8 && memcmp(tail.data(), endMarker, 8) == 0) {
+                        m_segments = segments;
+                        trailer = tail.size();
+                    }
+                }
+            }
+        }
+        if (trailer == 0) {
+            file.close();
+            readQOI(filename, channels, colorspace);
+            decode();
+            BufferPool<uint8_t>::shared().release(m_QOIBytes);
+            return;
+        }
+
+        size_t count = remaining - trailer;
+        size_t pixelCount = (size_t)m_width * m_height;
+        if (!validSeekTable(m_segments, count, pixelCount)) {
+            cerr << "Ignoring invalid QOI seek table." << endl;
+            m_segments = {};
+        }
+
+        // data chunks end exactly where the pixels do (a corrupt stream longer than that still fits); with
+        // prediction they may end up to a byte per row later, each row's opcodes take at most 4 bytes per pixel
+        size_t rowBytes = usesPrediction() && m_segments.empty() ? ((size_t)m_height + 3) / 4 : 0;
+        size_t pixels = max(pixelCount + rowBytes, (count + 3) / 4);
+        BufferPool<RGBValue>::shared().acquire(m_RGBBytes, pixels);
+        m_RGBBytes.resize(pixels);
+        uint8_t* bytes = reinterpret_cast<uint8_t*>(m_RGBBytes.data()) + pixels * 4 - count;
+        file.seekg(dataStart);
+        file.read(reinterpret_cast<char*>(bytes), count);
+
+        // Segments one after another: a later segment's pixels may land on an earlier one's unread bytes,
+        // so they are not interleaved here
+        size_t decoded = 0;
+        if (!m_segments.empty()) {
+            for (auto& s : segmentStreams(bytes, count, m_segments, m_RGBBytes.data(), pixelCount)) {
+                resetIndex();
+                decoded += qoiKernels().decode(s.bytes, s.count, RGBValue(0, 0, 0), index, s.out, s.pixelCount); // standard opcodes
+            }
+        }
+        else {
+            resetIndex();
+            decoded = decodeStream(bytes, count, m_RGBBytes.data(), pixelCount);
+        }
+        m_RGBBytes.resize(decoded);
+    }
+
+    // Returns false if the file could not be written in full (disk full, I/O error)
+    bool writeBMP(const string& filename) {
+        ofstream file(filename, ios::binary);
+        if (!file) {
+            cerr << "Failed to open BMP file for writing." << endl;
+            return false;
+        }
+
+        size_t rowPadded = bmpRowSize(m_width);
+
+        uint8_t header[54];
+        bmpHeader(m_width, m_height, header);
+        file.write(reinterpret_cast<char*>(header), 54);
+
+        // --- PIXEL DATA ---
+        vector<uint8_t> row;
+        BufferPool<uint8_t>::shared().acquire(row, rowPadded);
+        row.resize(rowPadded, 0);
+        const QOIKernels& kernels = qoiKernels();
+        for (uint32_t y = m_height; y-- > 0;) { // BMP stores bottom-up
+            kernels.rgbToBGR(&m_RGBBytes[(size_t)y * m_width], row.data(), m_width);
+            file.write(reinterpret_cast<char*>(row.data()), rowPadded);
+        }
+        BufferPool<uint8_t>::shared().release(row);
+        file.close();
+        if (!file) {
+            cerr << "Failed to write BMP file." << endl;
+            return false;
+        }
+        return true;
+    }
+
+    // Padded size of one 24-bit BMP row
+    static size_t bmpRowSize(uint32_t width) {
+        return ((size_t)width * 3 + 3) & ~(size_t)3;
+    }
+
+    // 54-byte header of a bottom-up 24-bit BMP. The file size field is 32 bits, it is left 0 for files
+    // above 4 GB (readers take the size from width and height).
+    static void bmpHeader(uint32_t width, uint32_t height, uint8_t* out) {
+        uint64_t fileSize = 54 + (uint64_t)bmpRowSize(width) * height;  // 54 = header size
+        if (fileSize > 0xFFFFFFFF) fileSize = 0;
+
+        // --- BMP HEADER ---
+        uint8_t header[54] = {
+            'B', 'M',                   // Signature
+            0,0,0,0,                     // File size
+            0,0,0,0,                     // Reserved
+            54,0,0,0,                    // Offset to pixel data
+            40,0,0,0,                    // DIB header size
+            0,0,0,0,                     // Width
+            0,0,0,0,                     // Height
+            1,0,                         // Planes
+            24,0,                        // Bits per pixel
+            0,0,0,0,                     // Compression
+            0,0,0,0,                     // Image size (can be 0 for uncompressed)
+            0,0,0,0,                     // X pixels per meter
+            0,0,0,0,                     // Y pixels per meter
+            0,0,0,0,                     // Colors in color table
+            0,0,0,0                      // Important color count
+        };
+
+        // Set file size
+        header[2] = (uint8_t)(fileSize);
+        header[3] = (uint8_t)(fileSize >> 8);
+        header[4] = (uint8_t)(fileSize >> 16);
+        header[5] = (uint8_t)(fileSize >> 24);
+
+        // Set width
+        header[18] = (uint8_t)(width);
+        header[19] = (uint8_t)(width >> 8);
+        header[20] = (uint8_t)(width >> 16);
+        header[21] = (uint8_t)(width >> 24);
+
+        // Set height
+        header[22] = (uint8_t)(height);
+        header[23] = (uint8_t)(height >> 8);
+        header[24] = (uint8_t)(height >> 16);
+        header[25] = (uint8_t)(height >> 24);
+
+        memcpy(out, header, 54);
+    }
+
+    // With stages, the body (data chunks, end marker, seek table) is passed through them in order and the file
+    // gets the packed magic (see Stages.h); readQOI() undoes them again. Returns false if the file could not be
+    // written in full.
+    bool writeQOI(const string& filename, const vector<QOIStage>& stages = {}) {
+        ofstream file(filename, ios::binary);
+        if (!file) {
+            cerr << "Failed to open QOI file for writing." << endl;
+            return false;
+        }
+
+        file.write(stages.empty() ? "qoif" : PACKED_MAGIC, 4);
+        writeBE32(file, m_width);
+        writeBE32(file, m_height);
+        file.write(reinterpret_cast<char*>(&m_channels), 1);
+        file.put((char)(m_colorspace | (m_format == QOIFormat::Extended ? QOI_EXTENDED_FLAG : 0)));
+        if (m_format == QOIFormat::Extended) {
+            vector<uint8_t> extension = serializeExtension(streamExtension());
+            file.write(reinterpret_cast<const char*>(extension.data()), extension.size());
+        }
+
+        // data chunks, 8-byte end marker, seek table
+        uint8_t endMarker[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+        vector<uint8_t> table;
+        if (!m_segments.empty()) table = serializeSeekTable(m_segments);
+
+        if (!stages.empty()) {
+            size_t dataSize = m_QOIBytes.size();
+            m_QOIBytes.insert(m_QOIBytes.end(), endMarker, endMarker + 8);
+            m_QOIBytes.insert(m_QOIBytes.end(), table.begin(), table.end());
+            vector<uint8_t> packed = packStages(m_QOIBytes.data(), m_QOIBytes.size(), stages, m_width);
+            m_QOIBytes.resize(dataSize);
+
+            uint8_t stageCount = (uint8_t)stages.size();
+            file.write(reinterpret_cast<char*>(&stageCount), 1);
+            for (QOIStage stage : stages) file.put((char)stage);
+            file.write(reinterpret_cast<const char*>(packed.data()), packed.size());
+        } else {
+            file.write(reinterpret_cast<const char*>(m_QOIBytes.data()), m_QOIBytes.size());
+            file.write(reinterpret_cast<char*>(endMarker), 8);
+            file.write(reinterpret_cast<const char*>(table.data()), table.size());
+        }
+        file.close();
+        if (!file) {
+            cerr << "Failed to write QOI file." << endl;
+            return false;
+        }
+        return true;
+    }
+
+    vector<RGBValue> getRAW(bool print=false) {
+        if (print) {
+            for (RGBValue i : m_RGBBytes) {
+                i.print();
+            }   
+            cout << "-------------------------" << endl;
+            cout << "RAW Length: " << m_RGBBytes.size() << " bytes" << endl;
+        }
+
+        return m_RGBBytes;
+    }
+
+    vector<uint8_t> getQOI(bool print=false) {
+        if (print) {
+            for (auto i : m_QOIBytes) {
+                cout << bitset<8>(i).to_string() << endl;
+            }
+            cout << "-------------------------" << endl;
+            cout << "QOI Length: " << m_QOIBytes.size() << " bytes" << endl;
+        }
+
+        return m_QOIBytes;
+    }
+
+    uint32_t getWidth() const {
+        return m_width;
+    }
+
+    uint32_t getHeight() const {
+        return m_height;
+    }
+
+    // sizes of the current buffers without copying them, 0 after a failed read
+    size_t getPixelCount() const {
+        return m_RGBBytes.size();
+    }
+
+    size_t getQOISize() const {
+        return m_QOIBytes.size();
+    }
+
+    void setRAW(const vector<RGBValue>& pixels, uint32_t width, uint32_t height, int channels=3, int colorspace=0) {
+        BufferPool<RGBValue>::shared().acquire(m_RGBBytes, pixels.size());
+        m_RGBBytes.assign(pixels.begin(), pixels.end());
+        m_width = width;
+        m_height = height;
+        m_channels = channels;
+        m_colorspace = colorspace;
+    }
+
+    // Extended applies to the next encode() and is written to the header by writeQOI(); readQOI() sets it from the file
+    void setFormat(QOIFormat format) {
+        m_format = format;
+    }
+
+    QOIFormat getFormat() const {
+        return m_format;
+    }
+
+    // A wide index of entries (256 to 4096, a power of two) in sets of ways (1 or 2) next to the standard one,
+    // for the extended format (WideIndex.h). 0 entries turns it off.
+    void setWideIndex(uint32_t entries, uint32_t ways = 1) {
+        int bits = 0;
+        while (bits < 31 && (1u << bits) < entries) bits++;
+        if (entries != 0 && ((1u << bits) != entries || bits < WIDE_INDEX_MIN_BITS || bits > WIDE_INDEX_MAX_BITS || ways < 1 || ways > 2)) {
+            cerr << "Wide index needs 256 to 4096 entries (a power of two) and 1 or 2 ways." << endl;
+            return;
+        }
+        if (entries != 0 && m_extension.prediction) {
+            cerr << "The wide index does not combine with row prediction." << endl;
+            return;
+        }
+        m_extension.wideIndexBits = (uint8_t)(entries ? bits : 0);
+        m_extension.wideIndexWays = (uint8_t)(entries ? ways : 1);
+    }
+
+    // The set of multipliers index[64] hashes with in the extended format (INDEX_HASHES in QOIKernels.h, 0 is
+    // the spec's). setAdaptiveIndexHash() has encode() pick it per image instead, by sampling the pixels.
+    void setIndexHash(uint8_t set) {
+        if (set >= INDEX_HASH_COUNT) {
+            cerr << "Index hash set must be below " << INDEX_HASH_COUNT << "." << endl;
+            return;
+        }
+        m_extension.indexHash = set;
+        m_adaptiveHash = false;
+    }
+
+    void setAdaptiveIndexHash(bool adaptive) {
+        m_adaptiveHash = adaptive;
+    }
+
+    // Predicts each row from the left, above, their average or Paeth, whichever suits it (Predict.h), in the
+    // extended format. Not together with the wide index.
+    void setPrediction(bool predict) {
+        if (predict && m_extension.wideIndexBits) {
+            cerr << "Row prediction does not combine with the wide index." << endl;
+            return;
+        }
+        m_extension.prediction = predict ? 1 : 0;
+    }
+
+    const QOIExtension& getExtension() const {
+        return m_extension;
+    }
+
+    void encode(bool verbose=false) {
+        resetIndex();
+        m_segments = {};
+        BufferPool<uint8_t>::shared().acquire(m_QOIBytes, m_RGBBytes.size()*4 + 16); // QOI_OP_RGB is the worst case per pixel
+        prepareIndexHash();
+        bool extended = m_format == QOIFormat::Extended;
+        if (usesWideIndex()) {
+            WideIndex wide;
+            wide.reset(m_extension.wideIndexBits, m_extension.wideIndexWays);
+            qoiKernels().encodeWide(m_RGBBytes.data(), m_RGBBytes.size(), RGBValue(0, 0, 0), index, indexHash(), wide, m_QOIBytes);
+        }
+        else if (usesPrediction()) {
+            qoiKernels().encodePredicted(m_RGBBytes.data(), m_width, m_height, index, indexHash(), m_QOIBytes);
+        }
+        else if (extended) qoiKernels().encodeExtended(m_RGBBytes.data(), m_RGBBytes.size(), RGBValue(0, 0, 0), index, indexHash(), m_QOIBytes);
+        else qoiKernels().encode(m_RGBBytes.data(), m_RGBBytes.size(), RGBValue(0, 0, 0), index, m_QOIBytes);
+
+        if (verbose) printStats();
+    }
+
+    // Same output as encode(), with the work split across the shared thread pool. Neither the wide index nor
+    // row prediction can be split that way, with either this is encode().
+    void encodeParallel(bool verbose=false) {
+        if (usesWideIndex() || usesPrediction()) {
+            encode(verbose);
+            return;
+        }
+        m_segments = {};
+        BufferPool<uint8_t>::shared().acquire(m_QOIBytes, m_RGBBytes.size()*4 + 16); // QOI_OP_RGB is the worst case per pixel
+        prepareIndexHash();
+        ::encodeParallel(m_RGBBytes.data(), m_RGBBytes.size(), m_QOIBytes, ThreadPool::shared(), m_format == QOIFormat::Extended, indexHash());
+
+        if (verbose) printStats();
+    }
+
+    // Still a standard QOI stream, but every band of rowsPerSegment rows can be decoded on its own
+    // through the seek table that writeQOI() appends. Segments keep the standard opcodes and hash in either format,
+    // and their header leaves out the wide index and row prediction settings (they stay set for later encodes).
+    void encodeSegmented(uint32_t rowsPerSegment, bool verbose=false) {
+        BufferPool<uint8_t>::shared().acquire(m_QOIBytes, m_RGBBytes.size()*4 + 16);
+        ::encodeSegmented(m_RGBBytes.data(), m_width, m_height, rowsPerSegment, m_QOIBytes, m_segments, ThreadPool::shared());
+
+        if (verbose) printStats();
+    }
+
+    // Same output as encode() on each image. Images with equal pixel counts are encoded together, one per
+    // SIMD lane, which pays off for icons and thumbnails where a single encode is mostly per-call overhead
+    static void encodeMany(vector<QOIConverter>& images) {
+        map<size_t, vector<QOIConverter*>> bySize;
+        for (auto& img : images) {
+            if (img.usesWideIndex() || img.usesPrediction() || img.m_adaptiveHash || !img.indexHash().isStandard()) { // no lane kernels for these
+                img.encode();
+                continue;
+            }
+            img.m_segments = {};
+            BufferPool<uint8_t>::shared().acquire(img.m_QOIBytes, img.m_RGBBytes.size()*4 + 16); // what the batch kernels need
+            bySize[img.m_RGBBytes.size()].push_back(&img);
+        }
+
+        vector<pair<QOIConverter* const*, size_t>> groups;
+        for (auto& entry : bySize) {
+            const vector<QOIConverter*>& same = entry.second;
+            for (size_t g = 0; g < same.size(); g += BATCH_GROUP)
+                groups.push_back({same.data() + g, min(BATCH_GROUP, same.size() - g)});
+        }
+
+        ThreadPool::shared().parallelFor(groups.size(), [&](size_t k) {
+            QOIConverter* const* group = groups[k].first;
+            size_t count = groups[k].second;
+            const RGBValue* pixels[BATCH_GROUP];
+            vector<uint8_t> outs[BATCH_GROUP];
+            for (size_t l = 0; l < count; l++) {
+                pixels[l] = group[l]->m_RGBBytes.data();
+                outs[l].swap(group[l]->m_QOIBytes);
+            }
+
+            qoiKernels().encodeBatch(pixels, count, group[0]->m_RGBBytes.size(), outs);
+            for (size_t l = 0; l < count; l++) {
+                group[l]->m_QOIBytes.swap(outs[l]);
+                if (group[l]->m_format == QOIFormat::Extended) packLongRuns(group[l]->m_QOIBytes); // the lanes write standard runs
+            }
+        });
+    }
+
+    const vector<QOISegment>& getSegments() const {
+        return m_segments;
+    }
+
+    void decode() {
+        resetIndex();
+        BufferPool<RGBValue>::shared().acquire(m_RGBBytes, (size_t)m_width * m_height);
+        m_RGBBytes.resize((size_t)m_width * m_height);
+        if (!m_segments.empty()) { // independent segments, decoded several at a time on this thread
+            m_RGBBytes.resize(decodeSegmented(m_QOIBytes.data(), m_QOIBytes.size(), m_segments, m_RGBBytes.data(), m_RGBBytes.size()));
+            return;
+        }
+        size_t decoded = decodeStream(m_QOIBytes.data(), m_QOIBytes.size(), m_RGBBytes.data(), m_RGBBytes.size());
+        m_RGBBytes.resize(decoded);
+    }
+
+    // Same output as decode(), speculatively decoding chunks of the stream across the shared thread pool.
+    // Extended streams are decoded by decode(): the chunking pass only knows the standard opcodes.
+    void decodeParallel() {
+        if (m_format == QOIFormat::Extended && m_segments.empty()) {
+            decode();
+            return;
+        }
+        resetIndex();
+        BufferPool<RGBValue>::shared().acquire(m_RGBBytes, (size_t)m_width * m_height);
+        m_RGBBytes.resize((size_t)m_width * m_height);
+        if (!m_segments.empty()) {
+            m_RGBBytes.resize(decodeSegmented(m_QOIBytes.data(), m_QOIBytes.size(), m_segments, m_RGBBytes.data(), m_RGBBytes.size(), ThreadPool::shared()));
+            return;
+        }
+        size_t decoded = ::decodeParallel(m_QOIBytes.data(), m_QOIBytes.size(), m_RGBBytes.data(), m_RGBBytes.size(), ThreadPool::shared());
+        m_RGBBytes.resize(decoded);
+    }
+};
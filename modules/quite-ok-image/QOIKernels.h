@@ -0,0 +1,777 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+
+#include "RGBValue.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define QOI_X86 1
+#include <immintrin.h>
+#endif
+
+// GCC/Clang need per-function target attributes to emit instructions above the build's baseline ISA,
+// MSVC accepts any intrinsic anywhere
+#if defined(__GNUC__) || defined(__clang__)
+#define QOI_TARGET(isa) __attribute__((target(isa)))
+#else
+#define QOI_TARGET(isa)
+#endif
+
+// Set bits of a SIMD compare mask, without relying on the POPCNT instruction
+inline int popCount(uint32_t v) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_popcount(v);
+#else
+    v = v - ((v >> 1) & 0x55555555);
+    v = (v & 0x33333333) + ((v >> 2) & 0x33333333);
+    return (int)((((v + (v >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24);
+#endif
+}
+
+using namespace std;
+
+// ----- ENCODE / DECODE -----
+// Streams follow the QOI spec for 3-channel images: alpha is implicitly 255, runs are stored with a bias of -1,
+// every pixel that is not part of a run is written to index[hash], and the first pixel is predicted from black.
+// prevPixel/index carry the state in, so an encoder can start mid-image.
+//
+// Every encoder writes the shortest opcode for each pixel: QOI_OP_DIFF, then QOI_OP_INDEX, then QOI_OP_LUMA, then
+// QOI_OP_RGB, with runs as long as allowed. Whichever opcode writes a pixel, the decoder ends up in the same
+// state (that pixel is the previous one and sits in index[hash]), so a choice made now never pays off later and
+// this greedy parse is already the smallest stream; a search over opcode sequences finds nothing shorter. (The
+// one exception is the black pixel a stream starts from, which only gets into the index if some pixel of an
+// opening run of black is written as QOI_OP_DIFF, a byte spent for a possible byte saved later.)
+
+inline void encodeScalar(const RGBValue* pixels, size_t count, RGBValue prevPixel, RGBValue* index, vector<uint8_t>& out) {
+    size_t curIdx = 0;
+
+    while (curIdx < count) {
+        // 1. check if it is same as previous pixel
+        if (pixels[curIdx] == prevPixel) {
+            // if so, advance through image to look for length of run
+            uint8_t runLength = 0;
+            do {
+                runLength++;
+                curIdx++;
+            } while (runLength < 62 && curIdx < count && pixels[curIdx] == prevPixel); // runLengths of 1..62 are allowed
+
+            out.push_back(0b11000000 + runLength - 1); // (QOI_OP_RUN)
+            continue;
+        }
+
+        const RGBValue& px = pixels[curIdx];
+        uint8_t hash = px.hash();
+
+        // 2. try to express as difference from previous
+        int dr = (int)px.red - (int)prevPixel.red;
+        int dg = (int)px.green - (int)prevPixel.green;
+        int db = (int)px.blue - (int)prevPixel.blue;
+
+        if ((-2<=dr && dr<=1) && (-2<=dg && dg<=1) && (-2<=db && db<=1)) {
+            out.push_back(0b01000000 + ((dr+2)<<4) + ((dg+2)<<2) + (db+2)); // (QOI_OP_DIFF)
+        }
+        // 3. check index array, one byte before QOI_OP_LUMA's two
+        else if (!index[hash].isNull && index[hash] == px) {
+            out.push_back(hash); // (QOI_OP_INDEX)
+        }
+        else if ((-32<=dg && dg<=31) && (-8<=(dr-dg) && (dr-dg)<=7) && (-8<=(db-dg) && (db-dg)<=7)) {
+            out.push_back(0b10000000 + dg+32); // (QOI_OP_LUMA)
+            out.push_back(((dr-dg+8)<<4 )+ (db-dg+8));
+        }
+        // 4. last resort: store full RGBValue (QOI_OP_RGB)
+        else {
+            out.push_back(0b11111110);
+            out.push_back(px.red);
+            out.push_back(px.green);
+            out.push_back(px.blue);
+        }
+
+        index[hash] = px;
+        prevPixel = px;
+        curIdx++;
+    }
+}
+
+// ----- EXTENDED FORMAT -----
+// QOI_OP_RUN stops at 62 pixels, so a blank 3456 px scanline takes 56 bytes and a blank page tens of KB of 0xFD,
+// each of which decode() handles on its own. The extended format (QOIFormat::Extended) adds one opcode for the
+// longer runs, in place of QOI_OP_RGBA, which 3-channel streams never use:
+//   QOI_OP_LONG_RUN (0xFF), then run length - LONG_RUN_MIN as a varint (7 bits per byte, low first, the top bit
+//   set on every byte but the last)
+// Since no other decoder knows it, such files set QOI_EXTENDED_FLAG in the colorspace byte, which the spec only
+// allows to be 0 or 1, and carry an extension header with further options (QOIExtension). The encode kernels write it directly (QOIKernels::encodeExtended), and packLongRuns()
+// converts a finished standard stream.
+
+const uint8_t QOI_OP_LONG_RUN = 0b11111111;
+const size_t LONG_RUN_MIN = 63;
+const uint8_t QOI_EXTENDED_FLAG = 0x80;
+
+// Appends a QOI_OP_LONG_RUN for run pixels, run >= minimum
+inline uint8_t* storeLongRun(uint8_t* dst, size_t run, size_t minimum = LONG_RUN_MIN) {
+    *dst++ = QOI_OP_LONG_RUN;
+    for (run -= minimum; run >= 0x80; run >>= 7) *dst++ = (uint8_t)(run | 0x80);
+    *dst++ = (uint8_t)run;
+    return dst;
+}
+
+// Appends the opcode(s) for a run of run pixels: QOI_OP_RUN up to 62, beyond that QOI_OP_LONG_RUN if longRuns,
+// otherwise as many QOI_OP_RUNs as needed
+inline uint8_t* storeRun(uint8_t* dst, size_t run, bool longRuns) {
+    if (longRuns && run >= LONG_RUN_MIN) return storeLongRun(dst, run);
+    for (; run > 62; run -= 62) *dst++ = 0b11000000 + 61;
+    *dst++ = (uint8_t)(0b11000000 + run - 1); // (QOI_OP_RUN)
+    return dst;
+}
+
+// Rewrites a whole standard stream in place, every run over 62 pixels (a row of QOI_OP_RUNs) as one QOI_OP_LONG_RUN
+inline void packLongRuns(vector<uint8_t>& bytes) {
+    uint8_t* p = bytes.data();
+    size_t count = bytes.size(), in = 0, out = 0;
+    while (in < count) {
+        uint8_t tag = p[in];
+        if (tag >= 0b11000000 && tag < 0b11111110) { // (QOI_OP_RUN)
+            size_t run = 0;
+            for (; in < count && p[in] >= 0b11000000 && p[in] < 0b11111110; in++) run += (p[in] & 0b111111) + 1;
+            // up to 62 pixels (even from several short opcodes) become one QOI_OP_RUN, more a QOI_OP_LONG_RUN whose
+            // varint never takes more bytes than the run opcodes it replaces
+            out = storeRun(p + out, run, true) - p;
+            continue;
+        }
+        size_t size = tag == 0b11111110 ? 4 : tag >> 6 == 0b10 ? 2 : 1;
+        size = min(size, count - in);
+        if (out != in) memmove(p + out, p + in, size);
+        in += size;
+        out += size;
+    }
+    bytes.resize(out);
+}
+
+// Reads the varint after a QOI_OP_LONG_RUN at pos into run, advancing pos. Returns false if it is cut short.
+inline bool loadLongRun(const uint8_t* bytes, size_t count, size_t& pos, size_t& run, size_t minimum = LONG_RUN_MIN) {
+    uint64_t extra = 0;
+    for (int shift = 0; pos < count && shift < 64; shift += 7) {
+        uint8_t b = bytes[pos++];
+        extra |= (uint64_t)(b & 0x7F) << shift;
+        if (!(b & 0x80)) {
+            run = minimum + (size_t)min<uint64_t>(extra, SIZE_MAX - minimum);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Writes count copies of px. The SIMD tiers have their own (fillSSE42 and up), for decoding runs.
+inline void fillScalar(RGBValue* out, RGBValue px, size_t count) {
+    for (size_t i = 0; i < count; i++) out[i] = px;
+}
+
+// ----- INDEX HASHES -----
+// The spec's hash (r*3 + g*5 + b*7 + 255*11) % 64 only sees the low 6 bits of each channel, so a palette whose
+// colors differ in the high bits (posterized art, scans with a few inks, levels in steps of 64) lands in a
+// handful of slots and keeps evicting itself. The extended format can name another set of multipliers in its
+// header; a hash from the set is ((r*red + g*green + b*blue + bias) >> shift) % 64, and set 0 is the spec's.
+// Encoders pick a set by sampling the image (scoreIndexHashes, chooseIndexHash in QOIConverter.h), every
+// extended-format kernel takes the stream's set, the standard kernels keep the spec's through RGBValue::hash().
+
+struct IndexHash {
+    uint32_t red = 3, green = 5, blue = 7, bias = 255*11, shift = 0;
+
+    uint8_t operator()(const RGBValue& px) const {
+        return (uint8_t)(((px.red*red + px.green*green + px.blue*blue + bias) >> shift) & 63);
+    }
+
+    bool isStandard() const {
+        return red == 3 && green == 5 && blue == 7 && bias == 255*11 && shift == 0;
+    }
+};
+
+const size_t INDEX_HASH_COUNT = 8;
+const IndexHash INDEX_HASHES[INDEX_HASH_COUNT] = {
+    {3, 5, 7, 255*11, 0}, // the spec's
+    {3, 5, 7, 0, 2},
+    {5, 7, 11, 0, 3},
+    {7, 11, 13, 0, 4},
+    {11, 13, 17, 0, 5},
+    {29, 37, 53, 0, 6},
+    {1, 9, 25, 0, 2},
+    {3, 17, 31, 0, 4},
+};
+
+// Bytes an index hit saves on px after prev: 3 over QOI_OP_RGB, 1 over QOI_OP_LUMA, 0 for QOI_OP_DIFF
+inline uint32_t indexSaving(const RGBValue& px, const RGBValue& prev) {
+    int dr = (int)px.red - (int)prev.red;
+    int dg = (int)px.green - (int)prev.green;
+    int db = (int)px.blue - (int)prev.blue;
+    if ((-2<=dr && dr<=1) && (-2<=dg && dg<=1) && (-2<=db && db<=1)) return 0;
+    if ((-32<=dg && dg<=31) && (-8<=(dr-dg) && (dr-dg)<=7) && (-8<=(db-dg) && (db-dg)<=7)) return 1;
+    return 3;
+}
+
+// Replays count pixels, as a stream of their own, through one index[64] per set and adds the bytes each set's
+// hits would save to scores[set]
+inline void scoreIndexHashesScalar(const RGBValue* pixels, size_t count, uint32_t* scores) {
+    RGBValue index[INDEX_HASH_COUNT][64];
+    RGBValue prev(0, 0, 0);
+    for (size_t i = 0; i < count; i++) {
+        const RGBValue& px = pixels[i];
+        if (px == prev) continue; // part of a run
+        uint32_t saving = indexSaving(px, prev);
+        for (size_t s = 0; s < INDEX_HASH_COUNT; s++) {
+            RGBValue& slot = index[s][INDEX_HASHES[s](px)];
+            if (saving && !slot.isNull && slot == px) scores[s] += saving;
+            slot = px;
+        }
+        prev = px;
+    }
+}
+
+// Where a decoder stopped: the next byte, the pixel it holds and what is left of a run cut short by a full buffer
+struct DecodeState {
+    size_t byte = 0;
+    size_t pendingRun = 0;
+    RGBValue prevPixel = RGBValue(0, 0, 0);
+    bool longRuns = false; // 0xFF is QOI_OP_LONG_RUN (extended format)
+    IndexHash hash;        // the stream's index hash, another set only in the extended format
+};
+
+// Continues decoding from state into a buffer for pixelCount pixels, returns the number of pixels written.
+// Calling it again with the next buffer resumes exactly where it stopped, e.g. at band boundaries.
+// Fill writes the runs.
+template <void (*Fill)(RGBValue*, RGBValue, size_t) = fillScalar>
+size_t decodeResume(const uint8_t* bytes, size_t count, DecodeState& state, RGBValue* index, RGBValue* out, size_t pixelCount) {
+    size_t curIdx = state.byte;
+    size_t outIdx = min(state.pendingRun, pixelCount);
+    RGBValue prevPixel = state.prevPixel;
+    const IndexHash hash = state.hash;
+    Fill(out, prevPixel, outIdx);
+    state.pendingRun -= outIdx;
+
+    while (curIdx < count && outIdx < pixelCount) {
+        uint8_t curByte = bytes[curIdx++];
+
+        // QOI_OP_RGB
+        if (curByte == 0b11111110) {
+            if (curIdx + 3 > count) break;
+            prevPixel = RGBValue(bytes[curIdx], bytes[curIdx+1], bytes[curIdx+2]);
+            curIdx += 3;
+            out[outIdx++] = prevPixel;
+        }
+        // QOI_OP_INDEX
+        else if (curByte >> 6 == 0b00) {
+            prevPixel = index[curByte];
+            prevPixel.isNull = false;
+            out[outIdx++] = prevPixel;
+        }
+        // QOI_OP_DIFF
+        else if (curByte >> 6 == 0b01) {
+            int dr = ((curByte >> 4) & 0b11) - 2;
+            int dg = ((curByte >> 2) & 0b11) - 2;
+            int db = (curByte & 0b11) - 2;
+
+            prevPixel = RGBValue(prevPixel.red + dr, prevPixel.green + dg, prevPixel.blue + db);
+            out[outIdx++] = prevPixel;
+        }
+        // QOI_OP_LUMA
+        else if (curByte >> 6 == 0b10) {
+            if (curIdx >= count) break;
+            uint8_t b2 = bytes[curIdx++];
+            int dg = (curByte & 0b111111) - 32;
+            int dr = ((b2 >> 4) & 0b1111) - 8 + dg;
+            int db = (b2 & 0b1111) - 8 + dg;
+
+            prevPixel = RGBValue(prevPixel.red + dr, prevPixel.green + dg, prevPixel.blue + db);
+            out[outIdx++] = prevPixel;
+        }
+        // QOI_OP_RUN, QOI_OP_LONG_RUN
+        else {
+            size_t run = (curByte & 0b111111) + 1;
+            if (curByte == QOI_OP_LONG_RUN && state.longRuns && !loadLongRun(bytes, count, curIdx, run)) break;
+            if (run > pixelCount - outIdx) {
+                state.pendingRun = run - (pixelCount - outIdx);
+                run = pixelCount - outIdx;
+            }
+            Fill(out + outIdx, prevPixel, run);
+            outIdx += run;
+        }
+
+        index[hash(prevPixel)] = prevPixel;
+    }
+
+    state.byte = curIdx;
+    state.prevPixel = prevPixel;
+    return outIdx;
+}
+
+// Decodes into a buffer sized for pixelCount pixels, returns the number of pixels written
+inline size_t decodeScalar(const uint8_t* bytes, size_t count, RGBValue prevPixel, RGBValue* index, RGBValue* out, size_t pixelCount) {
+    DecodeState state;
+    state.prevPixel = prevPixel;
+    return decodeResume(bytes, count, state, index, out, pixelCount);
+}
+
+// decodeScalar() for extended-format streams, with the tier's Fill for the runs
+template <void (*Fill)(RGBValue*, RGBValue, size_t)>
+size_t decodeExtended(const uint8_t* bytes, size_t count, RGBValue prevPixel, RGBValue* index, IndexHash hash, RGBValue* out, size_t pixelCount) {
+    DecodeState state;
+    state.prevPixel = prevPixel;
+    state.longRuns = true;
+    state.hash = hash;
+    return decodeResume<Fill>(bytes, count, state, index, out, pixelCount);
+}
+
+// ----- CLASSIFIED ENCODE -----
+// Everything except the index table depends only on a pixel and the one before it, so a (vectorizable)
+// pre-pass packs each pixel into a descriptor: opcode class | first opcode byte << 8 | LUMA byte 2 << 16 | hash << 24.
+// A scalar loop then only tracks runs, resolves index hits and emits bytes.
+
+enum PixelClass : uint32_t { CLASS_SAME = 0, CLASS_DIFF = 1, CLASS_LUMA = 2, CLASS_OTHER = 3 };
+
+const size_t CLASSIFY_BLOCK = 32; // pixels classified per pre-pass step
+
+inline uint32_t classifyPixel(const RGBValue& px, const RGBValue& prev) {
+    int dr = (int)px.red - (int)prev.red;
+    int dg = (int)px.green - (int)prev.green;
+    int db = (int)px.blue - (int)prev.blue;
+
+    uint32_t cls = CLASS_OTHER;
+    uint32_t op0 = 0, op1 = 0;
+    if ((-2<=dr && dr<=1) && (-2<=dg && dg<=1) && (-2<=db && db<=1)) {
+        cls = (dr == 0 && dg == 0 && db == 0) ? CLASS_SAME : CLASS_DIFF;
+        op0 = 0b01000000 + ((dr+2)<<4) + ((dg+2)<<2) + (db+2);
+    }
+    else if ((-32<=dg && dg<=31) && (-8<=(dr-dg) && (dr-dg)<=7) && (-8<=(db-dg) && (db-dg)<=7)) {
+        cls = CLASS_LUMA;
+        op0 = 0b10000000 + dg+32;
+        op1 = ((dr-dg+8)<<4) + (db-dg+8);
+    }
+    return cls | (op0 << 8) | (op1 << 16) | ((uint32_t)px.hash() << 24);
+}
+
+// Classifies count pixels against the ones in refs (the previous pixel, or a prediction of it: Predict.h)
+inline void classifyFromScalar(const RGBValue* pixels, const RGBValue* refs, size_t count, uint32_t* desc) {
+    for (size_t i = 0; i < count; i++) {
+        desc[i] = classifyPixel(pixels[i], refs[i]);
+    }
+}
+
+// Classifies count pixels, pixels[-1] must be readable
+inline void classifyScalar(const RGBValue* pixels, size_t count, uint32_t* desc) {
+    classifyFromScalar(pixels, pixels - 1, count, desc);
+}
+
+// Writes the opcodes for count classified pixels to dst, returns the new end. runLength carries a run that is
+// still open in and out, the caller writes it once nothing follows. Extended writes runs over 62 pixels as
+// QOI_OP_LONG_RUN; descHash takes the hash from the descriptors, otherwise it is indexHash's.
+// !slot.isNull && slot == px as one 32-bit compare: a slot holding px has a clear isNull byte
+inline bool indexHit(const RGBValue& slot, const RGBValue& px) {
+    uint32_t a, b;
+    memcpy(&a, &slot, 4);
+    memcpy(&b, &px, 4);
+    return a == (b & 0x00FFFFFF);
+}
+
+template <bool Extended>
+inline uint8_t* emitClassified(const RGBValue* pixels, const uint32_t* desc, size_t count, RGBValue* index, bool descHash, IndexHash indexHash,
+                               size_t& runLength, uint8_t* dst) {
+    size_t run = runLength;
+    for (size_t i = 0; i < count; i++) {
+        uint32_t d = desc[i];
+        uint32_t cls = d & 0b11;
+
+        if (cls == CLASS_SAME) {
+            if (++run == 62 && !Extended) { // runLengths of 1..62 are allowed
+                *dst++ = 0b11000000 + run - 1; // (QOI_OP_RUN)
+                run = 0;
+            }
+            continue;
+        }
+        if (run > 0) {
+            dst = storeRun(dst, run, Extended);
+            run = 0;
+        }
+
+        const RGBValue& px = pixels[i];
+        uint8_t hash = descHash ? (uint8_t)(d >> 24) : indexHash(px);
+        if (cls == CLASS_DIFF) {
+            *dst++ = (uint8_t)(d >> 8); // (QOI_OP_DIFF)
+        }
+        else if (cls == CLASS_LUMA) { // QOI_OP_INDEX if it hits, without a branch on it
+            bool hit = indexHit(index[hash], px);
+            dst[0] = hit ? hash : (uint8_t)(d >> 8); // (QOI_OP_INDEX) / (QOI_OP_LUMA)
+            dst[1] = (uint8_t)(d >> 16);
+            dst += 2 - hit;
+        }
+        else if (indexHit(index[hash], px)) {
+            *dst++ = hash; // (QOI_OP_INDEX)
+        }
+        else { // (QOI_OP_RGB)
+            dst[0] = 0b11111110;
+            dst[1] = px.red;
+            dst[2] = px.green;
+            dst[3] = px.blue;
+            dst += 4;
+        }
+        index[hash] = px;
+    }
+    runLength = run;
+    return dst;
+}
+
+// Produces exactly the bytes encodeScalar() does, Classify only changes how the descriptors are computed.
+// Extended writes runs over 62 pixels as QOI_OP_LONG_RUN instead and hashes with indexHash (extended format).
+template <void (*Classify)(const RGBValue*, size_t, uint32_t*), bool Extended>
+void encodeClassifiedWith(const RGBValue* pixels, size_t count, RGBValue prevPixel, RGBValue* index, IndexHash indexHash, vector<uint8_t>& out) {
+    if (count == 0) return;
+    const bool descHash = !Extended || indexHash.isStandard(); // the descriptors carry the spec's hash
+
+    size_t base = out.size();
+    out.resize(base + count*4); // QOI_OP_RGB is the worst case per pixel
+    uint8_t* dst = out.data() + base;
+
+    uint32_t desc[CLASSIFY_BLOCK];
+    size_t runLength = 0;
+
+    for (size_t blockStart = 0; blockStart < count; blockStart += CLASSIFY_BLOCK) {
+        size_t blockSize = min(CLASSIFY_BLOCK, count - blockStart);
+        if (blockStart == 0) {
+            desc[0] = classifyPixel(pixels[0], prevPixel);
+            Classify(pixels + 1, blockSize - 1, desc + 1);
+        } else {
+            Classify(pixels + blockStart, blockSize, desc);
+        }
+        dst = emitClassified<Extended>(pixels + blockStart, desc, blockSize, index, descHash, indexHash, runLength, dst);
+    }
+
+    if (runLength > 0) {
+        dst = storeRun(dst, runLength, Extended);
+    }
+    out.resize(dst - out.data());
+}
+
+template <void (*Classify)(const RGBValue*, size_t, uint32_t*)>
+void encodeClassified(const RGBValue* pixels, size_t count, RGBValue prevPixel, RGBValue* index, vector<uint8_t>& out) {
+    encodeClassifiedWith<Classify, false>(pixels, count, prevPixel, index, IndexHash(), out);
+}
+
+template <void (*Classify)(const RGBValue*, size_t, uint32_t*)>
+void encodeClassifiedExtended(const RGBValue* pixels, size_t count, RGBValue prevPixel, RGBValue* index, IndexHash indexHash, vector<uint8_t>& out) {
+    encodeClassifiedWith<Classify, true>(pixels, count, prevPixel, index, indexHash, out);
+}
+
+// ----- BMP <-> RGBValue CONVERSION -----
+// BMP rows store BGR triplets; RGBValue is {r, g, b, isNull}
+
+inline void bgrToRGBScalar(const uint8_t* bgr, RGBValue* out, size_t count) {
+    for (size_t x = 0; x < count; x++) {
+        out[x] = RGBValue(bgr[x*3 + 2], bgr[x*3 + 1], bgr[x*3]);
+    }
+}
+
+inline void rgbToBGRScalar(const RGBValue* in, uint8_t* bgr, size_t count) {
+    for (size_t x = 0; x < count; x++) {
+        bgr[x*3 + 0] = in[x].blue;
+        bgr[x*3 + 1] = in[x].green;
+        bgr[x*3 + 2] = in[x].red;
+    }
+}
+
+#ifdef QOI_X86
+
+// 4 BGR pixels (12 bytes) -> 4 RGBValues, zero byte for isNull
+#define QOI_BGR_TO_RGB_MASK 2,1,0,-128, 5,4,3,-128, 8,7,6,-128, 11,10,9,-128
+// 4 RGBValues -> 12 BGR bytes, top 4 bytes unused
+#define QOI_RGB_TO_BGR_MASK 2,1,0, 6,5,4, 10,9,8, 14,13,12, -128,-128,-128,-128
+
+// Every vector step loads/stores 16 bytes per 12 used, so loops stop early enough to stay inside the buffers
+
+QOI_TARGET("sse4.2")
+inline void bgrToRGBSSE42(const uint8_t* bgr, RGBValue* out, size_t count) {
+    const __m128i mask = _mm_setr_epi8(QOI_BGR_TO_RGB_MASK);
+    size_t x = 0;
+    for (; x + 6 <= count; x += 4) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bgr + x*3));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + x), _mm_shuffle_epi8(v, mask));
+    }
+    bgrToRGBScalar(bgr + x*3, out + x, count - x);
+}
+
+QOI_TARGET("sse4.2")
+inline void rgbToBGRSSE42(const RGBValue* in, uint8_t* bgr, size_t count) {
+    const __m128i mask = _mm_setr_epi8(QOI_RGB_TO_BGR_MASK);
+    size_t x = 0;
+    for (; x + 6 <= count; x += 4) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + x));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(bgr + x*3), _mm_shuffle_epi8(v, mask));
+    }
+    rgbToBGRScalar(in + x, bgr + x*3, count - x);
+}
+
+QOI_TARGET("avx2")
+inline void bgrToRGBAVX2(const uint8_t* bgr, RGBValue* out, size_t count) {
+    const __m256i mask = _mm256_setr_epi8(QOI_BGR_TO_RGB_MASK, QOI_BGR_TO_RGB_MASK);
+    size_t x = 0;
+    for (; x + 10 <= count; x += 8) {
+        __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bgr + x*3));
+        __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bgr + x*3 + 12));
+        __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + x), _mm256_shuffle_epi8(v, mask));
+    }
+    bgrToRGBSSE42(bgr + x*3, out + x, count - x);
+}
+
+QOI_TARGET("avx2")
+inline void rgbToBGRAVX2(const RGBValue* in, uint8_t* bgr, size_t count) {
+    const __m256i mask = _mm256_setr_epi8(QOI_RGB_TO_BGR_MASK, QOI_RGB_TO_BGR_MASK);
+    size_t x = 0;
+    for (; x + 10 <= count; x += 8) {
+        __m256i v = _mm256_shuffle_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + x)), mask);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(bgr + x*3), _mm256_castsi256_si128(v));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(bgr + x*3 + 12), _mm256_extracti128_si256(v, 1));
+    }
+    rgbToBGRSSE42(in + x, bgr + x*3, count - x);
+}
+
+// GCC 12's AVX-512 headers trip -Wmaybe-uninitialized on their own _mm512_undefined_* placeholders
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+// AVX-512 uses masked 48-byte loads/stores plus a dword permute instead of the 16-byte overlap trick
+
+QOI_TARGET("avx512f,avx512bw")
+inline void bgrToRGBAVX512(const uint8_t* bgr, RGBValue* out, size_t count) {
+    const __m512i spread = _mm512_setr_epi32(0,1,2,0, 3,4,5,0, 6,7,8,0, 9,10,11,0);
+    const __m512i mask = _mm512_maskz_broadcast_i32x4(0xFFFF, _mm_setr_epi8(QOI_BGR_TO_RGB_MASK));
+    size_t x = 0;
+    for (; x + 16 <= count; x += 16) {
+        __m512i v = _mm512_maskz_loadu_epi8(0xFFFFFFFFFFFFull, bgr + x*3);
+        v = _mm512_shuffle_epi8(_mm512_maskz_permutexvar_epi32(0xFFFF, spread, v), mask);
+        _mm512_storeu_si512(reinterpret_cast<void*>(out + x), v);
+    }
+    bgrToRGBAVX2(bgr + x*3, out + x, count - x);
+}
+
+QOI_TARGET("avx512f,avx512bw")
+inline void rgbToBGRAVX512(const RGBValue* in, uint8_t* bgr, size_t count) {
+    const __m512i pack = _mm512_setr_epi32(0,1,2, 4,5,6, 8,9,10, 12,13,14, 15,15,15,15);
+    const __m512i mask = _mm512_maskz_broadcast_i32x4(0xFFFF, _mm_setr_epi8(QOI_RGB_TO_BGR_MASK));
+    size_t x = 0;
+    for (; x + 16 <= count; x += 16) {
+        __m512i v = _mm512_shuffle_epi8(_mm512_loadu_si512(reinterpret_cast<const void*>(in + x)), mask);
+        _mm512_mask_storeu_epi8(bgr + x*3, 0xFFFFFFFFFFFFull, _mm512_maskz_permutexvar_epi32(0xFFFF, pack, v));
+    }
+    rgbToBGRAVX2(in + x, bgr + x*3, count - x);
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+// ----- RUN FILLS -----
+// One broadcast pixel stored 4, 8 or 16 at a time; AVX-512 masks the tail instead of handing it down
+
+QOI_TARGET("sse4.2")
+inline void fillSSE42(RGBValue* out, RGBValue px, size_t count) {
+    uint32_t bits;
+    memcpy(&bits, &px, 4);
+    const __m128i v = _mm_set1_epi32((int)bits);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), v);
+    fillScalar(out + i, px, count - i);
+}
+
+QOI_TARGET("avx2")
+inline void fillAVX2(RGBValue* out, RGBValue px, size_t count) {
+    uint32_t bits;
+    memcpy(&bits, &px, 4);
+    const __m256i v = _mm256_set1_epi32((int)bits);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), v);
+    fillSSE42(out + i, px, count - i);
+}
+
+QOI_TARGET("avx512f")
+inline void fillAVX512(RGBValue* out, RGBValue px, size_t count) {
+    uint32_t bits;
+    memcpy(&bits, &px, 4);
+    const __m512i v = _mm512_set1_epi32((int)bits);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) _mm512_storeu_si512(reinterpret_cast<void*>(out + i), v);
+    if (i < count) _mm512_mask_storeu_epi32(reinterpret_cast<void*>(out + i), (__mmask16)((1u << (count - i)) - 1), v);
+}
+
+// ----- SIMD CLASSIFIERS -----
+// One pixel per 32-bit lane, channel deltas are exact (no byte wraparound) to match classifyPixel().
+// Range checks use (value + bias) & ~(width - 1) == 0; SAME implies DIFF implies LUMA, so the class is
+// CLASS_OTHER plus one per (all-ones) mask that holds.
+
+#define QOI_CLASSIFY_BODY(VEC, PFX, SFX)                                                              \
+    const VEC ff = PFX##_set1_epi32(0xFF);                                                            \
+    VEC cur = PFX##_loadu_##SFX(reinterpret_cast<const VEC*>(pixels + i));                            \
+    VEC prev = PFX##_loadu_##SFX(reinterpret_cast<const VEC*>(refs + i));                             \
+    VEC r = PFX##_and_##SFX(cur, ff), g = PFX##_and_##SFX(PFX##_srli_epi32(cur, 8), ff);              \
+    VEC b = PFX##_and_##SFX(PFX##_srli_epi32(cur, 16), ff);                                           \
+    VEC dr = PFX##_sub_epi32(r, PFX##_and_##SFX(prev, ff));                                           \
+    VEC dg = PFX##_sub_epi32(g, PFX##_and_##SFX(PFX##_srli_epi32(prev, 8), ff));                      \
+    VEC db = PFX##_sub_epi32(b, PFX##_and_##SFX(PFX##_srli_epi32(prev, 16), ff));                     \
+    VEC dr2 = PFX##_add_epi32(dr, PFX##_set1_epi32(2));                                               \
+    VEC dg2 = PFX##_add_epi32(dg, PFX##_set1_epi32(2));                                               \
+    VEC db2 = PFX##_add_epi32(db, PFX##_set1_epi32(2));                                               \
+    VEC dg32 = PFX##_add_epi32(dg, PFX##_set1_epi32(32));                                             \
+    VEC drg = PFX##_add_epi32(PFX##_sub_epi32(dr, dg), PFX##_set1_epi32(8));                          \
+    VEC dbg = PFX##_add_epi32(PFX##_sub_epi32(db, dg), PFX##_set1_epi32(8));                          \
+    VEC diffByte = PFX##_or_##SFX(PFX##_or_##SFX(PFX##_slli_epi32(dr2, 4), PFX##_slli_epi32(dg2, 2)), \
+                                  PFX##_or_##SFX(db2, PFX##_set1_epi32(0b01000000)));                 \
+    VEC lumaByte = PFX##_or_##SFX(dg32, PFX##_set1_epi32(0b10000000));                                \
+    VEC op1 = PFX##_and_##SFX(PFX##_or_##SFX(PFX##_slli_epi32(drg, 4), dbg), ff);                     \
+    VEC hash = PFX##_add_epi32(PFX##_add_epi32(PFX##_add_epi32(PFX##_slli_epi32(r, 1), r),            \
+                                               PFX##_add_epi32(PFX##_slli_epi32(g, 2), g)),           \
+                               PFX##_sub_epi32(PFX##_slli_epi32(b, 3), b));                           \
+    hash = PFX##_and_##SFX(PFX##_add_epi32(hash, PFX##_set1_epi32(255*11)), PFX##_set1_epi32(63));
+
+QOI_TARGET("sse4.2")
+inline void classifyFromSSE42(const RGBValue* pixels, const RGBValue* refs, size_t count, uint32_t* desc) {
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        QOI_CLASSIFY_BODY(__m128i, _mm, si128)
+        const __m128i zero = _mm_setzero_si128();
+        __m128i same = _mm_cmpeq_epi32(_mm_and_si128(_mm_xor_si128(cur, prev), _mm_set1_epi32(0xFFFFFF)), zero);
+        __m128i diffOk = _mm_cmpeq_epi32(_mm_and_si128(_mm_or_si128(_mm_or_si128(dr2, dg2), db2), _mm_set1_epi32(~3)), zero);
+        __m128i lumaOk = _mm_cmpeq_epi32(_mm_or_si128(_mm_and_si128(dg32, _mm_set1_epi32(~63)),
+                                                      _mm_and_si128(_mm_or_si128(drg, dbg), _mm_set1_epi32(~15))), zero);
+        __m128i cls = _mm_add_epi32(_mm_add_epi32(_mm_set1_epi32(CLASS_OTHER), lumaOk), _mm_add_epi32(diffOk, same));
+        __m128i op0 = _mm_and_si128(_mm_blendv_epi8(lumaByte, diffByte, diffOk), ff);
+        __m128i d = _mm_or_si128(_mm_or_si128(cls, _mm_slli_epi32(op0, 8)), _mm_or_si128(_mm_slli_epi32(op1, 16), _mm_slli_epi32(hash, 24)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(desc + i), d);
+    }
+    classifyFromScalar(pixels + i, refs + i, count - i, desc + i);
+}
+
+QOI_TARGET("sse4.2")
+inline void classifySSE42(const RGBValue* pixels, size_t count, uint32_t* desc) {
+    classifyFromSSE42(pixels, pixels - 1, count, desc);
+}
+
+QOI_TARGET("avx2")
+inline void classifyFromAVX2(const RGBValue* pixels, const RGBValue* refs, size_t count, uint32_t* desc) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        QOI_CLASSIFY_BODY(__m256i, _mm256, si256)
+        const __m256i zero = _mm256_setzero_si256();
+        __m256i same = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_xor_si256(cur, prev), _mm256_set1_epi32(0xFFFFFF)), zero);
+        __m256i diffOk = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_or_si256(_mm256_or_si256(dr2, dg2), db2), _mm256_set1_epi32(~3)), zero);
+        __m256i lumaOk = _mm256_cmpeq_epi32(_mm256_or_si256(_mm256_and_si256(dg32, _mm256_set1_epi32(~63)),
+                                                            _mm256_and_si256(_mm256_or_si256(drg, dbg), _mm256_set1_epi32(~15))), zero);
+        __m256i cls = _mm256_add_epi32(_mm256_add_epi32(_mm256_set1_epi32(CLASS_OTHER), lumaOk), _mm256_add_epi32(diffOk, same));
+        __m256i op0 = _mm256_and_si256(_mm256_blendv_epi8(lumaByte, diffByte, diffOk), ff);
+        __m256i d = _mm256_or_si256(_mm256_or_si256(cls, _mm256_slli_epi32(op0, 8)), _mm256_or_si256(_mm256_slli_epi32(op1, 16), _mm256_slli_epi32(hash, 24)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(desc + i), d);
+    }
+    classifyFromSSE42(pixels + i, refs + i, count - i, desc + i);
+}
+
+QOI_TARGET("avx2")
+inline void classifyAVX2(const RGBValue* pixels, size_t count, uint32_t* desc) {
+    classifyFromAVX2(pixels, pixels - 1, count, desc);
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+// AVX-512 compares produce k-masks, so the class is built with masked subtracts instead of adding all-ones lanes
+QOI_TARGET("avx512f,avx512bw")
+inline void classifyFromAVX512(const RGBValue* pixels, const RGBValue* refs, size_t count, uint32_t* desc) {
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        QOI_CLASSIFY_BODY(__m512i, _mm512, si512)
+        const __m512i one = _mm512_set1_epi32(1);
+        __mmask16 same = _mm512_testn_epi32_mask(_mm512_xor_si512(cur, prev), _mm512_set1_epi32(0xFFFFFF));
+        __mmask16 diffOk = _mm512_testn_epi32_mask(_mm512_or_si512(_mm512_or_si512(dr2, dg2), db2), _mm512_set1_epi32(~3));
+        __mmask16 lumaOk = _mm512_testn_epi32_mask(dg32, _mm512_set1_epi32(~63)) &
+                           _mm512_testn_epi32_mask(_mm512_or_si512(drg, dbg), _mm512_set1_epi32(~15));
+        __m512i cls = _mm512_mask_sub_epi32(_mm512_set1_epi32(CLASS_OTHER), lumaOk, _mm512_set1_epi32(CLASS_OTHER), one);
+        cls = _mm512_mask_sub_epi32(cls, diffOk, cls, one);
+        cls = _mm512_mask_sub_epi32(cls, same, cls, one);
+        __m512i op0 = _mm512_and_si512(_mm512_mask_blend_epi32(diffOk, lumaByte, diffByte), ff);
+        __m512i d = _mm512_or_si512(_mm512_or_si512(cls, _mm512_slli_epi32(op0, 8)), _mm512_or_si512(_mm512_slli_epi32(op1, 16), _mm512_slli_epi32(hash, 24)));
+        _mm512_storeu_si512(reinterpret_cast<void*>(desc + i), d);
+    }
+    classifyFromAVX2(pixels + i, refs + i, count - i, desc + i);
+}
+
+QOI_TARGET("avx512f,avx512bw")
+inline void classifyAVX512(const RGBValue* pixels, size_t count, uint32_t* desc) {
+    classifyFromAVX512(pixels, pixels - 1, count, desc);
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+#undef QOI_CLASSIFY_BODY
+
+// ----- INDEX HASH SCORING -----
+// scoreIndexHashesScalar() with the 8 sets in the 8 lanes of a vector: one multiply-add computes every set's
+// slot for a pixel, one gather fetches what the 8 tables hold there, and a compare turns the hits into savings.
+// Tables hold packed colors, 0xFFFFFFFF while empty. AVX2 has no scatter, the slots are written back one by one.
+
+QOI_TARGET("avx2")
+inline void scoreIndexHashesAVX2(const RGBValue* pixels, size_t count, uint32_t* scores) {
+    static_assert(INDEX_HASH_COUNT == 8, "one set per 32-bit lane");
+    uint32_t table[INDEX_HASH_COUNT * 64];
+    fill(table, table + INDEX_HASH_COUNT * 64, 0xFFFFFFFF);
+
+    uint32_t params[5][INDEX_HASH_COUNT];
+    for (size_t s = 0; s < INDEX_HASH_COUNT; s++) {
+        params[0][s] = INDEX_HASHES[s].red;
+        params[1][s] = INDEX_HASHES[s].green;
+        params[2][s] = INDEX_HASHES[s].blue;
+        params[3][s] = INDEX_HASHES[s].bias;
+        params[4][s] = INDEX_HASHES[s].shift;
+    }
+    const __m256i mr = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(params[0]));
+    const __m256i mg = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(params[1]));
+    const __m256i mb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(params[2]));
+    const __m256i bias = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(params[3]));
+    const __m256i shift = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(params[4]));
+    const __m256i tableBase = _mm256_setr_epi32(0, 64, 128, 192, 256, 320, 384, 448);
+    const __m256i mask = _mm256_set1_epi32(63);
+
+    __m256i total = _mm256_setzero_si256();
+    alignas(32) uint32_t slots[INDEX_HASH_COUNT];
+    RGBValue prev(0, 0, 0);
+    for (size_t i = 0; i < count; i++) {
+        const RGBValue& px = pixels[i];
+        if (px == prev) continue; // part of a run
+        uint32_t saving = indexSaving(px, prev);
+        prev = px;
+
+        int color = (int)(px.red | (px.green << 8) | (px.blue << 16));
+        __m256i sum = _mm256_add_epi32(_mm256_add_epi32(_mm256_mullo_epi32(_mm256_set1_epi32(px.red), mr),
+                                                        _mm256_mullo_epi32(_mm256_set1_epi32(px.green), mg)),
+                                       _mm256_add_epi32(_mm256_mullo_epi32(_mm256_set1_epi32(px.blue), mb), bias));
+        __m256i slot = _mm256_add_epi32(_mm256_and_si256(_mm256_srlv_epi32(sum, shift), mask), tableBase);
+        if (saving) {
+            __m256i held = _mm256_i32gather_epi32(reinterpret_cast<const int*>(table), slot, 4);
+            __m256i hit = _mm256_cmpeq_epi32(held, _mm256_set1_epi32(color));
+            total = _mm256_add_epi32(total, _mm256_and_si256(hit, _mm256_set1_epi32((int)saving)));
+        }
+        _mm256_store_si256(reinterpret_cast<__m256i*>(slots), slot);
+        for (size_t s = 0; s < INDEX_HASH_COUNT; s++) table[slots[s]] = (uint32_t)color;
+    }
+
+    uint32_t lanes[INDEX_HASH_COUNT];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), total);
+    for (size_t s = 0; s < INDEX_HASH_COUNT; s++) scores[s] += lanes[s];
+}
+
+#endif // QOI_X86
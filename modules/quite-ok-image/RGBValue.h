@@ -0,0 +1,40 @@
+#pragma once
+
+#include <iostream>
+#include <cstdint>
+
+using namespace std;
+
+struct RGBValue {
+    uint8_t red = 0;
+    uint8_t green = 0;
+    uint8_t blue = 0;
+    bool isNull = true;
+
+    RGBValue(uint8_t r, uint8_t g, uint8_t b) {
+        red = r;
+        green = g;
+        blue = b;
+        isNull = false;
+    }
+
+    RGBValue() {
+        isNull = true;
+    }
+
+    bool operator==(const RGBValue& other) const {
+        return (red == other.red && green == other.green) && (blue == other.blue);
+    }
+
+    void print() {
+        cout << (int)red << ' ' << (int)green << ' ' << (int)blue << endl;
+    }
+
+    // QOI spec hash with the implicit alpha of 255
+    uint8_t hash() const {
+        return (red*3 + green*5 + blue*7 + 255*11) % 64;
+    }
+};
+
+// the SIMD conversion kernels treat a pixel buffer as packed 4-byte {r, g, b, isNull} lanes
+static_assert(sizeof(RGBValue) == 4, "RGBValue must stay 4 bytes wide");
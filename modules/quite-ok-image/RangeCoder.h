@@ -0,0 +1,272 @@
+#pragma once
+
+#include <istream>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+
+#include "QOIKernels.h"
+#include "Segmented.h"
+
+using namespace std;
+
+// ----- RANGE CODER STAGE -----
+// An adaptive range coder over the QOI byte stream. Every byte is coded as two 4-bit symbols, the high nibble
+// and then the low nibble given the high one, each with an adaptive 16-entry cumulative frequency table (15-bit,
+// nudged towards the symbol just seen, AV1 style). The table set is picked by the byte's place in the opcode
+// stream:
+//   tag byte            by the kinds of the two opcodes before it
+//   QOI_OP_RGB(A)       red as is, then green - red and blue - green (mod 256), alpha on its own
+//   QOI_OP_LUMA byte 2  by the green difference in byte 1
+// The parse only looks at bytes already coded, so any byte string round-trips; well-formed QOI just codes smaller.
+// Stage data: decoded size (u64 BE), then the coded bytes. RangeDecoder can pull its input from a stream in
+// small blocks and hand out the decoded bytes in pieces of any size.
+
+const int RANGE_CDF_BITS = 15;
+const int RANGE_ADAPT_SHIFT = 5;
+const int RANGE_MIN_GAP = 16;    // the adaptation targets keep every symbol at least this likely (in 1/32768)
+const uint32_t RANGE_TOP = 1u << 24;
+
+// cdf[i]: how likely (out of 1 << RANGE_CDF_BITS) the symbol is below i; cdf[0] = 0, cdf[16] is implied.
+// With SSE2 the lookup and the update take a few vector ops on the 16 entries instead of 16 scalar steps.
+struct alignas(32) NibbleModel {
+    uint16_t cdf[16];
+
+    NibbleModel() {
+        for (int i = 0; i < 16; i++) cdf[i] = (uint16_t)(i << (RANGE_CDF_BITS - 4));
+    }
+
+#ifdef QOI_X86
+    // Number of entries above cdf[0] that are <= v, i.e. the symbol whose interval holds v
+    QOI_TARGET("sse2")
+    int find(uint32_t v) const {
+        __m128i limit = _mm_set1_epi16((int16_t)v);
+        __m128i above0 = _mm_cmpgt_epi16(_mm_load_si128(reinterpret_cast<const __m128i*>(cdf)), limit);
+        __m128i above1 = _mm_cmpgt_epi16(_mm_load_si128(reinterpret_cast<const __m128i*>(cdf + 8)), limit);
+        return 15 - popCount(_mm_movemask_epi8(_mm_packs_epi16(above0, above1)));
+    }
+
+    // Moves every entry 1/32 of the way towards its target: RANGE_MIN_GAP * i up to the symbol, the top minus
+    // RANGE_MIN_GAP * (16 - i) above it
+    QOI_TARGET("sse2")
+    void update(int symbol) {
+        const __m128i index0 = _mm_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7), index1 = _mm_setr_epi16(8, 9, 10, 11, 12, 13, 14, 15);
+        __m128i s = _mm_set1_epi16((int16_t)symbol);
+        __m128i gap = _mm_set1_epi16(RANGE_MIN_GAP);
+        __m128i top = _mm_set1_epi16((int16_t)((1 << RANGE_CDF_BITS) - 16 * RANGE_MIN_GAP));
+        __m128i* c = reinterpret_cast<__m128i*>(cdf);
+        for (int half = 0; half < 2; half++) {
+            __m128i index = half ? index1 : index0;
+            __m128i low = _mm_mullo_epi16(index, gap);
+            __m128i above = _mm_cmpgt_epi16(index, s);
+            __m128i target = _mm_add_epi16(low, _mm_and_si128(above, top));
+            __m128i value = _mm_load_si128(c + half);
+            value = _mm_add_epi16(value, _mm_srai_epi16(_mm_sub_epi16(target, value), RANGE_ADAPT_SHIFT));
+            _mm_store_si128(c + half, value);
+        }
+    }
+#else
+    int find(uint32_t v) const {
+        int symbol = -1;
+        for (int i = 0; i < 16; i++) symbol += (cdf[i] <= v);
+        return symbol;
+    }
+
+    void update(int symbol) {
+        for (int i = 1; i < 16; i++) {
+            int target = RANGE_MIN_GAP * i + ((i > symbol) ? (1 << RANGE_CDF_BITS) - 16 * RANGE_MIN_GAP : 0);
+            cdf[i] = (uint16_t)(cdf[i] + ((target - cdf[i]) >> RANGE_ADAPT_SHIFT));
+        }
+    }
+#endif
+};
+
+// A byte's models: its high nibble, and its low nibble for each high nibble
+struct ByteModel {
+    NibbleModel high;
+    NibbleModel low[16];
+};
+
+// Where the next byte sits in the opcode stream, and the models for each place
+class RangeContext {
+private:
+    enum Kind { KIND_INDEX, KIND_DIFF, KIND_LUMA, KIND_RUN, KIND_RGB, KIND_RGBA, KINDS };
+    enum Place { PLACE_RED, PLACE_GREEN, PLACE_BLUE, PLACE_ALPHA, PLACE_LUMA, PLACE_TAG = PLACE_LUMA + 16, PLACES = PLACE_TAG + KINDS * KINDS };
+
+    ByteModel m_models[PLACES];
+    int m_kinds = KIND_RGB * KINDS + KIND_RGB; // previous two opcodes
+    int m_payload = 0;  // payload bytes left of the current opcode
+    int m_place = PLACE_TAG + KIND_RGB * KINDS + KIND_RGB;
+    uint8_t m_last = 0; // previous byte
+
+public:
+    ByteModel& model() {
+        return m_models[m_place];
+    }
+
+    // Byte as coded, and back
+    uint8_t toCoded(uint8_t byte) const {
+        return (m_place == PLACE_GREEN || m_place == PLACE_BLUE) ? (uint8_t)(byte - m_last) : byte;
+    }
+
+    uint8_t fromCoded(uint8_t coded) const {
+        return (m_place == PLACE_GREEN || m_place == PLACE_BLUE) ? (uint8_t)(coded + m_last) : coded;
+    }
+
+    // Moves past byte (in its plain form)
+    void push(uint8_t byte) {
+        if (m_payload > 0) {
+            m_payload--;
+            if (m_place == PLACE_RED || m_place == PLACE_GREEN) m_place++;
+            else if (m_place == PLACE_BLUE && m_payload > 0) m_place = PLACE_ALPHA;
+        }
+        else {
+            int kind;
+            if (byte == 0xFE) { kind = KIND_RGB; m_payload = 3; m_place = PLACE_RED; }
+            else if (byte == 0xFF) { kind = KIND_RGBA; m_payload = 4; m_place = PLACE_RED; }
+            else {
+                kind = byte >> 6;
+                if (kind == KIND_LUMA) { m_payload = 1; m_place = PLACE_LUMA + ((byte & 0x3F) >> 2); }
+            }
+            m_kinds = (m_kinds % KINDS) * KINDS + kind;
+        }
+        if (m_payload == 0) m_place = PLACE_TAG + m_kinds;
+        m_last = byte;
+    }
+};
+
+class RangeEncoder {
+private:
+    vector<uint8_t>& m_out;
+    uint64_t m_low = 0;
+    uint32_t m_range = 0xFFFFFFFF;
+    uint8_t m_cache = 0;
+    uint64_t m_cacheSize = 1;
+
+    void shiftLow() {
+        if ((uint32_t)m_low < 0xFF000000u || (m_low >> 32) != 0) {
+            uint8_t carry = (uint8_t)(m_low >> 32);
+            uint8_t byte = m_cache;
+            do {
+                m_out.push_back((uint8_t)(byte + carry));
+                byte = 0xFF;
+            } while (--m_cacheSize != 0);
+            m_cache = (uint8_t)(m_low >> 24);
+        }
+        m_cacheSize++;
+        m_low = (m_low & 0x00FFFFFF) << 8;
+    }
+
+public:
+    explicit RangeEncoder(vector<uint8_t>& out) : m_out(out) {}
+
+    void encodeNibble(NibbleModel& model, int symbol) {
+        uint32_t r = m_range >> RANGE_CDF_BITS;
+        uint32_t low = r * model.cdf[symbol];
+        m_low += low;
+        m_range = (symbol < 15) ? r * (model.cdf[symbol + 1] - model.cdf[symbol]) : m_range - low;
+        model.update(symbol);
+        while (m_range < RANGE_TOP) {
+            m_range <<= 8;
+            shiftLow();
+        }
+    }
+
+    void encodeByte(ByteModel& model, uint8_t byte) {
+        encodeNibble(model.high, byte >> 4);
+        encodeNibble(model.low[byte >> 4], byte & 15);
+    }
+
+    void flush() {
+        for (int i = 0; i < 5; i++) shiftLow();
+    }
+};
+
+// Appends the stage data for bytes to out
+inline void rangeEncode(const uint8_t* bytes, size_t count, vector<uint8_t>& out) {
+    storeBE(out, count, 8);
+    out.reserve(out.size() + count / 2 + 16);
+    RangeContext context;
+    RangeEncoder encoder(out);
+    for (size_t i = 0; i < count; i++) {
+        encoder.encodeByte(context.model(), context.toCoded(bytes[i]));
+        context.push(bytes[i]);
+    }
+    encoder.flush();
+}
+
+class RangeDecoder {
+private:
+    istream* m_source = nullptr;
+    vector<uint8_t> m_buffer;
+    const uint8_t* m_in = nullptr;
+    const uint8_t* m_end = nullptr;
+    uint32_t m_range = 0xFFFFFFFF;
+    uint32_t m_code = 0;
+    uint64_t m_size = 0;
+    uint64_t m_remaining = 0;
+    RangeContext m_context;
+
+    // Next input byte; past the end of the input the coder reads zeros
+    uint8_t nextByte() {
+        if (m_in == m_end && m_source) {
+            m_source->read(reinterpret_cast<char*>(m_buffer.data()), m_buffer.size());
+            m_in = m_buffer.data();
+            m_end = m_in + m_source->gcount();
+        }
+        return (m_in < m_end) ? *m_in++ : 0;
+    }
+
+    void start() {
+        for (int i = 0; i < 8; i++) m_size = (m_size << 8) | nextByte();
+        for (int i = 0; i < 5; i++) m_code = (m_code << 8) | nextByte();
+        m_remaining = m_size;
+    }
+
+    int decodeNibble(NibbleModel& model) {
+        uint32_t r = m_range >> RANGE_CDF_BITS;
+        uint32_t v = min(m_code / r, (uint32_t)(1 << RANGE_CDF_BITS) - 1);
+        int symbol = model.find(v);
+        uint32_t low = r * model.cdf[symbol];
+        m_code -= low;
+        m_range = (symbol < 15) ? r * (model.cdf[symbol + 1] - model.cdf[symbol]) : m_range - low;
+        model.update(symbol);
+        while (m_range < RANGE_TOP) {
+            m_range <<= 8;
+            m_code = (m_code << 8) | nextByte();
+        }
+        return symbol;
+    }
+
+public:
+    // Stage data held in memory
+    RangeDecoder(const uint8_t* data, size_t size) : m_in(data), m_end(data + size) {
+        start();
+    }
+
+    // Stage data read from source, blockSize bytes at a time
+    explicit RangeDecoder(istream& source, size_t blockSize = 1 << 16) : m_source(&source), m_buffer(blockSize) {
+        m_in = m_end = m_buffer.data();
+        start();
+    }
+
+    // Decoded size as recorded by the encoder
+    uint64_t size() const {
+        return m_size;
+    }
+
+    // Decodes the next bytes, up to count. Returns how many were written, 0 once everything was.
+    size_t read(uint8_t* out, size_t count) {
+        count = (size_t)min<uint64_t>(count, m_remaining);
+        for (size_t i = 0; i < count; i++) {
+            ByteModel& model = m_context.model();
+            int high = decodeNibble(model.high);
+            int low = decodeNibble(model.low[high]);
+            uint8_t byte = m_context.fromCoded((uint8_t)(high << 4 | low));
+            m_context.push(byte);
+            out[i] = byte;
+        }
+        m_remaining -= count;
+        return count;
+    }
+};
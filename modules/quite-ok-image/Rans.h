@@ -0,0 +1,190 @@
+#pragma once
+
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+
+#include "CpuDispatch.h"
+#include "Segmented.h"
+#include "PlaceStreams.h"
+
+using namespace std;
+
+// ----- INTERLEAVED rANS STAGE -----
+// A static entropy coder built for decode speed, the "fast-compact" option. The body is cut into blocks of about
+// RANS_BLOCK bytes at opcode boundaries, and each block into its five place streams (PlaceStreams.h). Each stream
+// gets its own frequency table, stored with the block, and is coded by 32 interleaved rANS states, so the
+// decoder runs 8 or 16 of them per SIMD instruction (RansKernels.h). Decoding a block decodes its five streams
+// and interleaves them back into QOI bytes.
+//
+// Block: byte count (u32 BE), then per stream its symbol count (u32 BE) and, if not empty, a mode byte:
+//   0  stored: the symbols as they are
+//   1  rANS: table, coded size (u32 BE), 32 initial states (u32 LE), then 16-bit words (LE) in reading order
+// Table: 32-byte bitmap of the symbols present, then the frequency (u16 BE, out of 4096) of each of them.
+// A stream is stored when coding it would not make it smaller.
+
+const size_t RANS_BLOCK = 1 << 18;
+
+// Frequencies out of 1 << RANS_SCALE_BITS in proportion to counts, at least 1 for every symbol that occurs
+inline void ransFrequencies(const size_t* counts, size_t total, uint32_t* freq) {
+    const uint32_t scale = 1u << RANS_SCALE_BITS;
+    uint32_t sum = 0;
+    int largest = 0;
+    for (int s = 0; s < 256; s++) {
+        freq[s] = counts[s] ? max<uint32_t>(1, (uint32_t)((uint64_t)counts[s] * scale / total)) : 0;
+        sum += freq[s];
+        if (freq[s] > freq[largest]) largest = s;
+    }
+    if (sum <= scale) {
+        freq[largest] += scale - sum;
+        return;
+    }
+    // rounding rare symbols up to 1 overshot: take it back from the most frequent ones
+    while (sum > scale) {
+        int top = 0;
+        for (int s = 1; s < 256; s++)
+            if (freq[s] > freq[top]) top = s;
+        uint32_t take = min(sum - scale, max<uint32_t>(1, freq[top] / 16));
+        freq[top] -= take;
+        sum -= take;
+    }
+}
+
+// Appends one stream: symbol count, then the symbols stored or coded
+inline void ransEncodeStream(const uint8_t* symbols, size_t count, vector<uint8_t>& out) {
+    storeBE(out, count, 4);
+    if (count == 0) return;
+
+    size_t counts[256] = {};
+    for (size_t i = 0; i < count; i++) counts[symbols[i]]++;
+    uint32_t freq[256], start[256];
+    ransFrequencies(counts, count, freq);
+    vector<uint8_t> table(32, 0);
+    for (int s = 0, next = 0; s < 256; s++) {
+        start[s] = next;
+        next += freq[s];
+        if (freq[s] == 0) continue;
+        table[s >> 3] |= (uint8_t)(1 << (s & 7));
+        storeBE(table, freq[s], 2);
+    }
+
+    // written back to front: the decoder reads in the opposite order. A symbol takes at most one word.
+    vector<uint8_t> coded(count * 2 + RANS_LANES * 4);
+    uint8_t* p = coded.data() + coded.size();
+    uint32_t states[RANS_LANES];
+    for (auto& x : states) x = RANS_LOW;
+    for (size_t i = count; i-- > 0;) {
+        uint32_t& x = states[i % RANS_LANES];
+        uint32_t f = freq[symbols[i]];
+        if ((uint64_t)x >= ((uint64_t)f << (32 - RANS_SCALE_BITS))) {
+            p -= 2;
+            p[0] = (uint8_t)x;
+            p[1] = (uint8_t)(x >> 8);
+            x >>= 16;
+        }
+        x = ((x / f) << RANS_SCALE_BITS) + (x % f) + start[symbols[i]];
+    }
+    for (int l = RANS_LANES - 1; l >= 0; l--) {
+        p -= 4;
+        for (int b = 0; b < 4; b++) p[b] = (uint8_t)(states[l] >> (b * 8));
+    }
+    size_t codedSize = coded.data() + coded.size() - p;
+
+    if (table.size() + 4 + codedSize >= count) {
+        out.push_back(0);
+        out.insert(out.end(), symbols, symbols + count);
+        return;
+    }
+    out.push_back(1);
+    out.insert(out.end(), table.begin(), table.end());
+    storeBE(out, codedSize, 4);
+    out.insert(out.end(), p, p + codedSize);
+}
+
+// Reads one stream from p into out (room for maxCount symbols), advancing p. Returns false if it is damaged.
+inline bool ransDecodeStream(const uint8_t*& p, const uint8_t* end, uint8_t* out, size_t maxCount, size_t& count,
+                             uint32_t* table) {
+    if (end - p < 4) return false;
+    count = (size_t)loadBE(p, 4);
+    p += 4;
+    if (count > maxCount) return false;
+    if (count == 0) return true;
+    if (end - p < 1) return false;
+    uint8_t mode = *p++;
+
+    if (mode == 0) {
+        if ((size_t)(end - p) < count) return false;
+        memcpy(out, p, count);
+        p += count;
+        return true;
+    }
+    if (mode != 1 || end - p < 32) return false;
+
+    const uint8_t* present = p;
+    p += 32;
+    uint32_t next = 0;
+    for (int s = 0; s < 256; s++) {
+        if (!((present[s >> 3] >> (s & 7)) & 1)) continue;
+        if (end - p < 2) return false;
+        uint32_t f = (uint32_t)loadBE(p, 2);
+        p += 2;
+        if (f == 0 || next + f > (1u << RANS_SCALE_BITS)) return false;
+        for (uint32_t k = 0; k < f; k++) table[next + k] = ((uint32_t)s << 24) | ((f - 1) << 12) | k;
+        next += f;
+    }
+    if (next != (1u << RANS_SCALE_BITS) || end - p < 4) return false;
+
+    size_t codedSize = (size_t)loadBE(p, 4);
+    p += 4;
+    if ((size_t)(end - p) < codedSize || codedSize < RANS_LANES * 4) return false;
+    uint32_t states[RANS_LANES];
+    for (int l = 0; l < RANS_LANES; l++) states[l] = (uint32_t)p[l*4] | ((uint32_t)p[l*4 + 1] << 8) | ((uint32_t)p[l*4 + 2] << 16) | ((uint32_t)p[l*4 + 3] << 24);
+    qoiKernels().ransDecode(table, states, p + RANS_LANES * 4, p + codedSize, out, count);
+    p += codedSize;
+    return true;
+}
+
+// Appends the stage data for bytes to out
+inline void ransEncode(const uint8_t* bytes, size_t count, vector<uint8_t>& out) {
+    storeBE(out, count, 8);
+    vector<uint8_t> streams[PLACE_STREAMS];
+    for (auto& s : streams) s.reserve(RANS_BLOCK + 4);
+    for (size_t pos = 0; pos < count;) {
+        for (auto& s : streams) s.clear();
+        size_t end = splitPlaces(bytes, count, pos, RANS_BLOCK, streams);
+        storeBE(out, end - pos, 4);
+        for (auto& s : streams) ransEncodeStream(s.data(), s.size(), out);
+        pos = end;
+    }
+}
+
+// Undoes the stage into out. Returns false if the data is damaged or decodes to more than maxSize bytes.
+inline bool ransDecode(const uint8_t* data, size_t size, vector<uint8_t>& out, uint64_t maxSize) {
+    if (size < 8 || loadBE(data, 8) > maxSize) return false;
+    size_t total = (size_t)loadBE(data, 8);
+    out.resize(total);
+
+    vector<uint8_t> scratch(RANS_BLOCK + 4 + MERGE_SLACK); // a block's streams, one after another
+    vector<uint32_t> table(1 << RANS_SCALE_BITS);
+    const uint8_t* p = data + 8;
+    const uint8_t* end = data + size;
+    for (size_t done = 0; done < total;) {
+        if (end - p < 4) return false;
+        size_t blockSize = (size_t)loadBE(p, 4);
+        p += 4;
+        if (blockSize == 0 || blockSize > RANS_BLOCK + 4 || blockSize > total - done) return false;
+
+        const uint8_t* streams[PLACE_STREAMS];
+        size_t sizes[PLACE_STREAMS];
+        size_t offset = 0;
+        for (int k = 0; k < PLACE_STREAMS; k++) {
+            if (!ransDecodeStream(p, end, scratch.data() + offset, blockSize - offset, sizes[k], table.data())) return false;
+            streams[k] = scratch.data() + offset;
+            offset += sizes[k];
+        }
+        if (!mergePlaces(streams, sizes, out.data() + done, blockSize)) return false;
+        done += blockSize;
+    }
+    return true;
+}
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "QOIKernels.h"
+
+using namespace std;
+
+// ----- rANS DECODE KERNELS -----
+// 32 rANS states decoded side by side (see Rans.h for the stream layout). Symbol i belongs to state i % 32,
+// and after decoding its symbol a state below RANS_LOW takes the next 16-bit word of the shared input, in
+// state order. The SIMD kernels step 8 (AVX2) or 16 (AVX-512) states per instruction: a gather reads each
+// state's table slot, and the words for the states that need one are loaded together and spread to their
+// lanes (a permute from a lookup table on AVX2, an expand on AVX-512). Every kernel starts at state 0 and
+// finishes the last, partial round with the scalar loop.
+//
+// table[slot]: symbol << 24 | (frequency - 1) << 12 | (slot - start of the symbol's slots)
+
+const int RANS_LANES = 32;
+const int RANS_SCALE_BITS = 12;
+const uint32_t RANS_LOW = 1u << 16;
+
+// Decodes count symbols into out, reading words from in. Returns where the input stops.
+inline const uint8_t* ransDecodeScalar(const uint32_t* table, uint32_t* states, const uint8_t* in, const uint8_t* inEnd,
+                                       uint8_t* out, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        uint32_t& x = states[i % RANS_LANES];
+        uint32_t entry = table[x & ((1u << RANS_SCALE_BITS) - 1)];
+        out[i] = (uint8_t)(entry >> 24);
+        x = (((entry >> 12) & 0xFFF) + 1) * (x >> RANS_SCALE_BITS) + (entry & 0xFFF);
+        if (x < RANS_LOW) {
+            uint32_t word = 0;
+            if (inEnd - in >= 2) { // damaged data runs out of words, it only decodes to wrong symbols
+                word = (uint32_t)in[0] | ((uint32_t)in[1] << 8);
+                in += 2;
+            }
+            x = (x << 16) | word;
+        }
+    }
+    return in;
+}
+
+#ifdef QOI_X86
+
+// For each 8-lane mask, the input word each set lane takes: the number of set lanes below it
+struct RansExpandTable {
+    uint32_t lanes[256][8];
+
+    RansExpandTable() {
+        for (int mask = 0; mask < 256; mask++) {
+            int next = 0;
+            for (int l = 0; l < 8; l++) lanes[mask][l] = (mask >> l) & 1 ? next++ : 0;
+        }
+    }
+};
+
+QOI_TARGET("avx2")
+inline const uint8_t* ransDecodeAVX2(const uint32_t* table, uint32_t* states, const uint8_t* in, const uint8_t* inEnd,
+                                     uint8_t* out, size_t count) {
+    static const RansExpandTable expand;
+    const __m256i slotMask = _mm256_set1_epi32((1 << RANS_SCALE_BITS) - 1);
+    const __m256i lowLimit = _mm256_set1_epi32(RANS_LOW - 1);
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    __m256i x[4];
+    for (int v = 0; v < 4; v++) x[v] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(states + v * 8));
+
+    size_t i = 0;
+    for (; i + RANS_LANES <= count && inEnd - in >= RANS_LANES * 2; i += RANS_LANES) {
+        __m256i symbols[4];
+        for (int v = 0; v < 4; v++) {
+            __m256i entry = _mm256_i32gather_epi32(reinterpret_cast<const int*>(table), _mm256_and_si256(x[v], slotMask), 4);
+            symbols[v] = _mm256_srli_epi32(entry, 24);
+            __m256i freq = _mm256_add_epi32(_mm256_and_si256(_mm256_srli_epi32(entry, 12), slotMask), _mm256_set1_epi32(1));
+            x[v] = _mm256_add_epi32(_mm256_mullo_epi32(freq, _mm256_srli_epi32(x[v], RANS_SCALE_BITS)), _mm256_and_si256(entry, slotMask));
+
+            __m256i need = _mm256_cmpeq_epi32(_mm256_min_epu32(x[v], lowLimit), x[v]); // x < RANS_LOW, unsigned
+            int mask = _mm256_movemask_ps(_mm256_castsi256_ps(need));
+            __m256i words = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in)));
+            words = _mm256_permutevar8x32_epi32(words, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(expand.lanes[mask])));
+            x[v] = _mm256_blendv_epi8(x[v], _mm256_or_si256(_mm256_slli_epi32(x[v], 16), words), need);
+            in += 2 * popCount(mask);
+        }
+        // 4 x 8 symbols -> 32 bytes in state order
+        __m256i packed = _mm256_packus_epi16(_mm256_packus_epi32(symbols[0], symbols[1]), _mm256_packus_epi32(symbols[2], symbols[3]));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_permutevar8x32_epi32(packed, order));
+    }
+
+    for (int v = 0; v < 4; v++) _mm256_storeu_si256(reinterpret_cast<__m256i*>(states + v * 8), x[v]);
+    return ransDecodeScalar(table, states, in, inEnd, out + i, count - i);
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+QOI_TARGET("avx512f,avx512bw")
+inline const uint8_t* ransDecodeAVX512(const uint32_t* table, uint32_t* states, const uint8_t* in, const uint8_t* inEnd,
+                                       uint8_t* out, size_t count) {
+    const __m512i slotMask = _mm512_set1_epi32((1 << RANS_SCALE_BITS) - 1);
+    const __m512i low = _mm512_set1_epi32(RANS_LOW);
+    __m512i x[2];
+    for (int v = 0; v < 2; v++) x[v] = _mm512_loadu_si512(reinterpret_cast<const void*>(states + v * 16));
+
+    size_t i = 0;
+    for (; i + RANS_LANES <= count && inEnd - in >= RANS_LANES * 2; i += RANS_LANES) {
+        for (int v = 0; v < 2; v++) {
+            __m512i entry = _mm512_i32gather_epi32(_mm512_and_si512(x[v], slotMask), reinterpret_cast<const void*>(table), 4);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i + v * 16), _mm512_cvtepi32_epi8(_mm512_srli_epi32(entry, 24)));
+            __m512i freq = _mm512_add_epi32(_mm512_and_si512(_mm512_srli_epi32(entry, 12), slotMask), _mm512_set1_epi32(1));
+            x[v] = _mm512_add_epi32(_mm512_mullo_epi32(freq, _mm512_srli_epi32(x[v], RANS_SCALE_BITS)), _mm512_and_si512(entry, slotMask));
+
+            __mmask16 need = _mm512_cmplt_epu32_mask(x[v], low);
+            __m512i words = _mm512_cvtepu16_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(in)));
+            x[v] = _mm512_mask_or_epi32(x[v], need, _mm512_slli_epi32(x[v], 16), _mm512_maskz_expand_epi32(need, words));
+            in += 2 * popCount(need);
+        }
+    }
+
+    for (int v = 0; v < 2; v++) _mm512_storeu_si512(reinterpret_cast<void*>(states + v * 16), x[v]);
+    return ransDecodeScalar(table, states, in, inEnd, out + i, count - i);
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+#endif // QOI_X86
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <vector>
+#include <cstring>
+
+#include "RGBValue.h"
+#include "CpuDispatch.h"
+#include "ThreadPool.h"
+#include "InterleavedDecode.h"
+
+using namespace std;
+
+// ----- SEGMENTED STREAMS -----
+// A segmented file is still one valid QOI stream. Each segment (a band of rows) starts with a QOI_OP_RGB and
+// only emits QOI_OP_INDEX for slots it wrote itself, so a standard decoder reads straight through while ours can
+// start at any segment with a fresh state. The seek table follows the end marker, where other decoders stop:
+//   per segment: byte offset into the data chunks (u64), first pixel (u64)
+//   segment count (u32), "qseg"
+// All fields big-endian like the QOI header.
+
+struct QOISegment {
+    uint64_t byteOffset;
+    uint64_t pixelOffset;
+};
+
+const char SEEK_TABLE_MAGIC[4] = {'q', 's', 'e', 'g'};
+
+const int SEGMENT_DECODE_LANES = 2; // streams interleaved per thread, more lanes start to spill registers
+
+// Encodes pixels so they decode without any prior state
+inline void encodeSegment(const RGBValue* pixels, size_t count, vector<uint8_t>& out) {
+    if (count == 0) return;
+
+    out.push_back(0b11111110); // (QOI_OP_RGB)
+    out.push_back(pixels[0].red);
+    out.push_back(pixels[0].green);
+    out.push_back(pixels[0].blue);
+
+    RGBValue index[64];
+    index[pixels[0].hash()] = pixels[0];
+    qoiKernels().encode(pixels + 1, count - 1, pixels[0], index, out);
+}
+
+// Encodes one segment per rowsPerSegment rows across the pool
+inline void encodeSegmented(const RGBValue* pixels, uint32_t width, uint32_t height, uint32_t rowsPerSegment,
+                            vector<uint8_t>& out, vector<QOISegment>& segments, ThreadPool& pool) {
+    if (rowsPerSegment == 0) rowsPerSegment = height;
+    size_t count = (height + rowsPerSegment - 1) / rowsPerSegment;
+
+    vector<vector<uint8_t>> parts(count);
+    pool.parallelFor(count, [&](size_t k) {
+        size_t firstRow = k * rowsPerSegment;
+        size_t rows = min((size_t)rowsPerSegment, (size_t)height - firstRow);
+        parts[k].reserve(rows * width * 3);
+        encodeSegment(pixels + firstRow * width, rows * width, parts[k]);
+    });
+
+    segments.clear();
+    size_t total = out.size();
+    for (auto& part : parts) total += part.size();
+    size_t offset = out.size();
+    out.resize(total);
+    for (size_t k = 0; k < count; k++) {
+        segments.push_back({offset, (uint64_t)k * rowsPerSegment * width});
+        memcpy(out.data() + offset, parts[k].data(), parts[k].size());
+        offset += parts[k].size();
+    }
+}
+
+inline vector<DecodeStream> segmentStreams(const uint8_t* bytes, size_t count, const vector<QOISegment>& segments,
+                                           RGBValue* out, size_t pixelCount) {
+    vector<DecodeStream> streams;
+    for (size_t k = 0; k < segments.size(); k++) {
+        size_t byteEnd = (k + 1 < segments.size()) ? segments[k+1].byteOffset : count;
+        size_t pixelEnd = (k + 1 < segments.size()) ? segments[k+1].pixelOffset : pixelCount;
+        DecodeStream s;
+        s.bytes = bytes + segments[k].byteOffset;
+        s.count = byteEnd - segments[k].byteOffset;
+        s.out = out + segments[k].pixelOffset;
+        s.pixelCount = pixelEnd - segments[k].pixelOffset;
+        streams.push_back(s);
+    }
+    return streams;
+}
+
+// Returns the number of pixels decoded; a short segment leaves the rest of its band untouched
+inline size_t decodeSegmented(const uint8_t* bytes, size_t count, const vector<QOISegment>& segments, RGBValue* out, size_t pixelCount) {
+    vector<DecodeStream> streams = segmentStreams(bytes, count, segments, out, pixelCount);
+    decodeInterleaved<SEGMENT_DECODE_LANES>(streams.data(), streams.size());
+
+    size_t decoded = 0;
+    for (auto& s : streams) decoded += s.decoded;
+    return decoded;
+}
+
+// Every worker interleaves its own share of the segments
+inline size_t decodeSegmented(const uint8_t* bytes, size_t count, const vector<QOISegment>& segments, RGBValue* out, size_t pixelCount,
+                              ThreadPool& pool) {
+    vector<DecodeStream> streams = segmentStreams(bytes, count, segments, out, pixelCount);
+    size_t groups = min(pool.size(), (streams.size() + SEGMENT_DECODE_LANES - 1) / SEGMENT_DECODE_LANES);
+    pool.parallelFor(groups, [&](size_t g) {
+        size_t begin = streams.size() * g / groups, end = streams.size() * (g + 1) / groups;
+        decodeInterleaved<SEGMENT_DECODE_LANES>(streams.data() + begin, end - begin);
+    });
+
+    size_t decoded = 0;
+    for (auto& s : streams) decoded += s.decoded;
+    return decoded;
+}
+
+// Validates a table read from a file: offsets must be increasing and inside the stream
+inline bool validSeekTable(const vector<QOISegment>& segments, size_t byteCount, size_t pixelCount) {
+    for (size_t k = 0; k < segments.size(); k++) {
+        if (segments[k].byteOffset > byteCount || segments[k].pixelOffset > pixelCount) return false;
+        if (k == 0 && (segments[k].byteOffset != 0 || segments[k].pixelOffset != 0)) return false;
+        if (k > 0 && (segments[k].byteOffset < segments[k-1].byteOffset || segments[k].pixelOffset < segments[k-1].pixelOffset)) return false;
+    }
+    return true;
+}
+
+inline void storeBE(vector<uint8_t>& out, uint64_t value, int bytes) {
+    for (int i = bytes - 1; i >= 0; i--) out.push_back((uint8_t)(value >> (i * 8)));
+}
+
+inline uint64_t loadBE(const uint8_t* in, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) value = (value << 8) | in[i];
+    return value;
+}
+
+inline vector<uint8_t> serializeSeekTable(const vector<QOISegment>& segments) {
+    vector<uint8_t> out;
+    for (auto& seg : segments) {
+        storeBE(out, seg.byteOffset, 8);
+        storeBE(out, seg.pixelOffset, 8);
+    }
+    storeBE(out, segments.size(), 4);
+    out.insert(out.end(), SEEK_TABLE_MAGIC, SEEK_TABLE_MAGIC + 4);
+    return out;
+}
+
+// Reads a seek table from the end of tail (everything after the QOI header), tableStart is where it begins.
+// Returns an empty table when there is none.
+inline vector<QOISegment> parseSeekTable(const vector<uint8_t>& tail, size_t& tableStart) {
+    vector<QOISegment> segments;
+    size_t size = tail.size();
+    tableStart = size;
+    if (size < 8 || memcmp(&tail[size - 4], SEEK_TABLE_MAGIC, 4) != 0) return segments;
+
+    uint64_t count = loadBE(&tail[size - 8], 4);
+    if (count == 0 || count > (size - 8) / 16) return segments;
+
+    tableStart = size - 8 - count * 16;
+    for (uint64_t k = 0; k < count; k++) {
+        const uint8_t* entry = &tail[tableStart + k * 16];
+        segments.push_back({loadBE(entry, 8), loadBE(entry + 8, 8)});
+    }
+    return segments;
+}
@@ -0,0 +1,230 @@
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <set>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cerrno>
+#include <cctype>
+
+#include "BatchConverter.h"
+
+using namespace std;
+
+// ----- CORPUS SHARDING -----
+// Every node gets the same job list and keeps the jobs whose hash falls into its shard, so no one has to split
+// lists by hand and shards stay balanced by file count. The key is either the input path (use the same relative
+// paths on every node) or the file contents (its size and first SHARD_CONTENT_BYTES, so renamed or moved
+// files stay on their shard; every node reads the head of every file to decide).
+//
+// A shard writes a manifest when it is done, via a temporary file, so a manifest that exists is complete:
+//   qoi-shard-manifest <shard> <shard count>
+//   ok|failed <input> <output> <bytes in> <bytes out> <ratio> <ms>     one line per job
+//   end <jobs> <succeeded> <failed>
+// Fields are tab-separated, so paths must not contain tabs or newlines. mergeShardManifests() combines the
+// manifests of all shards and reports shards that are missing, incomplete or had failures.
+
+const size_t SHARD_CONTENT_BYTES = 1 << 16;
+
+enum class ShardKey { Path, Content };
+
+// FNV-1a
+inline uint64_t hashBytes(const void* data, size_t size, uint64_t hash = 0xcbf29ce484222325ull) {
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; i++) hash = (hash ^ p[i]) * 0x100000001b3ull;
+    return hash;
+}
+
+inline uint64_t shardHash(const string& path, ShardKey key) {
+    if (key == ShardKey::Path) return hashBytes(path.data(), path.size());
+
+    ifstream file(path, ios::binary);
+    file.seekg(0, ios::end);
+    uint64_t size = file ? (uint64_t)file.tellg() : 0;
+    file.seekg(0);
+    vector<char> head((size_t)min<uint64_t>(size, SHARD_CONTENT_BYTES));
+    file.read(head.data(), head.size());
+    return hashBytes(head.data(), head.size(), hashBytes(&size, sizeof(size)));
+}
+
+inline uint32_t shardOf(uint64_t hash, uint32_t shardCount) {
+    // spread the bits first, FNV leaves the low bits of similar paths close together
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    return (uint32_t)(hash % max(shardCount, 1u));
+}
+
+inline vector<ConvertJob> shardJobs(const vector<ConvertJob>& jobs, uint32_t shard, uint32_t shardCount, ShardKey key) {
+    vector<ConvertJob> mine;
+    for (auto& job : jobs)
+        if (shardOf(shardHash(job.input, key), shardCount) == shard) mine.push_back(job);
+    return mine;
+}
+
+inline string shardManifestPath(const string& dir, uint32_t shard) {
+    return dir + "/shard-" + to_string(shard) + ".manifest";
+}
+
+// One job per line: "<input>\t<output>", or just "<input>" to convert .bmp <-> .qoi next to it
+inline vector<ConvertJob> readJobList(const string& filename) {
+    vector<ConvertJob> jobs;
+    ifstream file(filename);
+    string line;
+    while (getline(file, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back(); // lists written on Windows
+        if (line.empty()) continue;
+        size_t tab = line.find('\t');
+        if (tab != string::npos) {
+            jobs.push_back({line.substr(0, tab), line.substr(tab + 1)});
+            continue;
+        }
+        size_t dot = line.find_last_of('.');
+        string ext = (dot == string::npos) ? "" : line.substr(dot);
+        string base = line.substr(0, dot);
+        jobs.push_back({line, base + ((ext == ".qoi" || ext == ".QOI") ? ".bmp" : ".qoi")});
+    }
+    return jobs;
+}
+
+// Converts this shard's part of jobs and writes its manifest. Returns true if every job of the shard succeeded.
+inline bool runShard(const vector<ConvertJob>& jobs, uint32_t shard, uint32_t shardCount, ShardKey key,
+                     const string& manifestPath, BatchConverter& converter) {
+    vector<ConvertJob> mine = shardJobs(jobs, shard, shardCount, key);
+    vector<ConvertResult> results;
+    size_t succeeded = converter.run(mine, &results);
+
+    string tmpPath = manifestPath + ".tmp";
+    {
+        ofstream out(tmpPath);
+        out << "qoi-shard-manifest\t" << shard << "\t" << shardCount << "\n";
+        for (size_t j = 0; j < mine.size(); j++) {
+            const ConvertResult& r = results[j];
+            double ratio = r.bytesIn ? (double)r.bytesOut / r.bytesIn : 0.0;
+            out << (r.ok ? "ok" : "failed") << "\t" << mine[j].input << "\t" << mine[j].output << "\t"
+                << r.bytesIn << "\t" << r.bytesOut << "\t" << ratio << "\t" << r.seconds * 1000 << "\n";
+        }
+        out << "end\t" << mine.size() << "\t" << succeeded << "\t" << mine.size() - succeeded << "\n";
+        if (!out) {
+            cerr << "Failed to write shard manifest " << tmpPath << "." << endl;
+            return false;
+        }
+    }
+    remove(manifestPath.c_str());
+    if (rename(tmpPath.c_str(), manifestPath.c_str()) != 0) return false;
+    return succeeded == mine.size();
+}
+
+struct ShardMergeReport {
+    vector<uint32_t> missingShards;    // no manifest
+    vector<uint32_t> incompleteShards; // manifest of another shard or run, or cut short
+    vector<uint32_t> failedShards;     // manifest lists failed jobs
+    vector<string> failedJobs;
+    vector<string> unlistedJobs;       // expected inputs that no manifest mentions
+    size_t jobs = 0;
+    size_t succeeded = 0;
+    size_t bytesIn = 0;
+    size_t bytesOut = 0;
+    double seconds = 0.0;              // conversion time summed over all jobs
+
+    bool complete() const {
+        return missingShards.empty() && incompleteShards.empty() && failedShards.empty() && unlistedJobs.empty();
+    }
+};
+
+// Reads a manifest count or time field. Returns false unless the whole field is a non-negative number.
+inline bool parseManifestCount(const string& field, uint64_t& value) {
+    if (field.empty() || !isdigit((unsigned char)field[0])) return false;
+    char* end;
+    errno = 0;
+    unsigned long long parsed = strtoull(field.c_str(), &end, 10);
+    if (errno == ERANGE || *end != '\0') return false;
+    value = parsed;
+    return true;
+}
+
+inline bool parseManifestTime(const string& field, double& value) {
+    if (field.empty() || !isdigit((unsigned char)field[0])) return false;
+    char* end;
+    errno = 0;
+    double parsed = strtod(field.c_str(), &end);
+    if (errno == ERANGE || *end != '\0') return false;
+    value = parsed;
+    return true;
+}
+
+// Combines the manifests of shards 0..shardCount-1 (manifestPaths in shard order) into one corpus manifest with
+// the same line format. expected, if given, is the full job list every input must show up for.
+inline ShardMergeReport mergeShardManifests(const vector<string>& manifestPaths, uint32_t shardCount,
+                                            const string& combinedPath, const vector<ConvertJob>* expected = nullptr) {
+    ShardMergeReport report;
+    set<string> listed;
+    ofstream out(combinedPath);
+    out << "qoi-corpus-manifest\t" << shardCount << "\n";
+
+    for (uint32_t shard = 0; shard < shardCount; shard++) {
+        ifstream file(shard < manifestPaths.size() ? manifestPaths[shard] : string());
+        if (!file) {
+            report.missingShards.push_back(shard);
+            continue;
+        }
+
+        string line, tag;
+        uint32_t headerShard = 0, headerCount = 0;
+        getline(file, line);
+        istringstream(line) >> tag >> headerShard >> headerCount;
+        if (tag != "qoi-shard-manifest" || headerShard != shard || headerCount != shardCount) {
+            report.incompleteShards.push_back(shard);
+            continue;
+        }
+
+        vector<string> entries;
+        size_t failed = 0, endJobs = SIZE_MAX;
+        while (getline(file, line)) {
+            vector<string> fields;
+            stringstream ss(line);
+            string field;
+            while (getline(ss, field, '\t')) fields.push_back(field);
+            if (fields.size() == 4 && fields[0] == "end") {
+                uint64_t jobs;
+                if (parseManifestCount(fields[1], jobs)) endJobs = (size_t)jobs;
+                break;
+            }
+            // a line that does not parse cuts the manifest short there
+            if (fields.size() != 7 || (fields[0] != "ok" && fields[0] != "failed")) break;
+            uint64_t bytesIn = 0, bytesOut = 0;
+            double ms = 0;
+            if (fields[0] == "ok" && (!parseManifestCount(fields[3], bytesIn) || !parseManifestCount(fields[4], bytesOut)
+                                      || !parseManifestTime(fields[6], ms)))
+                break;
+
+            entries.push_back(line);
+            listed.insert(fields[1]);
+            if (fields[0] == "failed") {
+                failed++;
+                report.failedJobs.push_back(fields[1]);
+                continue;
+            }
+            report.succeeded++;
+            report.bytesIn += bytesIn;
+            report.bytesOut += bytesOut;
+            report.seconds += ms / 1000;
+        }
+        if (endJobs != entries.size()) report.incompleteShards.push_back(shard);
+        else if (failed > 0) report.failedShards.push_back(shard);
+        report.jobs += entries.size();
+        for (auto& entry : entries) out << entry << "\n";
+    }
+
+    if (expected)
+        for (auto& job : *expected)
+            if (!listed.count(job.input)) report.unlistedJobs.push_back(job.input);
+
+    out << "end\t" << report.jobs << "\t" << report.succeeded << "\t" << report.jobs - report.succeeded << "\n";
+    return report;
+}
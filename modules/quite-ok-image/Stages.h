@@ -0,0 +1,128 @@
+#pragma once
+
+#include <iostream>
+#include <istream>
+#include <iterator>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+
+#include "Segmented.h"
+#include "RangeCoder.h"
+#include "Rans.h"
+#include "Huffman.h"
+#include "Lz.h"
+#include "ContextMix.h"
+
+using namespace std;
+
+// ----- ENTROPY STAGES -----
+// Optional passes over the body of a QOI file (data chunks, end marker and seek table, exactly as writeQOI()
+// writes them) that make the file smaller. A file with stages gets its own magic, so standard QOI readers
+// refuse it instead of decoding garbage:
+//   "qoix", width, height (u32 BE), channels, colorspace   same layout as the QOI header
+//   extension header (extended format only)                as in a plain file (QOIConverter.h)
+//   stage count (u8), stage ids (u8 each) in the order they were applied
+//   output of the last stage
+// Every stage's output starts with the size of its input (u64 BE). Unpacking runs the stages backwards, and
+// decoding the result is the same as decoding a plain file.
+
+const char PACKED_MAGIC[4] = {'q', 'o', 'i', 'x'};
+
+enum class QOIStage : uint8_t {
+    Range = 1, // adaptive range coder with opcode-aware contexts (RangeCoder.h)
+    Rans = 2,  // interleaved rANS with static per-block tables, decodes in SIMD lanes (Rans.h)
+    Huffman = 3, // canonical Huffman per 64 KB block, several symbols per table lookup (Huffman.h)
+    Lz = 4,      // LZ4-style back-references to repeated byte sequences (Lz.h)
+    Mix = 5,     // bitwise context mixing over rebuilt decoder state, for archives (ContextMix.h)
+};
+
+inline const char* stageName(QOIStage stage) {
+    switch (stage) {
+        case QOIStage::Range: return "range";
+        case QOIStage::Rans: return "rans";
+        case QOIStage::Huffman: return "huffman";
+        case QOIStage::Lz: return "lz";
+        case QOIStage::Mix: return "mix";
+    }
+    return "unknown";
+}
+
+inline bool knownStage(uint8_t id) {
+    return id >= (uint8_t)QOIStage::Range && id <= (uint8_t)QOIStage::Mix;
+}
+
+// One stage over bytes, appended to out. width is the image width (0 if unknown), for stages that use the rows.
+inline void packStage(QOIStage stage, const uint8_t* bytes, size_t count, vector<uint8_t>& out, uint32_t width = 0) {
+    switch (stage) {
+        case QOIStage::Range: rangeEncode(bytes, count, out); break;
+        case QOIStage::Rans: ransEncode(bytes, count, out); break;
+        case QOIStage::Huffman: huffmanEncode(bytes, count, out); break;
+        case QOIStage::Lz: lzEncode(bytes, count, out); break;
+        case QOIStage::Mix: mixEncode(bytes, count, out, width); break;
+    }
+}
+
+// Undoes one stage, replacing out. Returns false if the data is damaged or would decode to more than maxSize.
+inline bool unpackStage(QOIStage stage, const uint8_t* data, size_t size, vector<uint8_t>& out, uint64_t maxSize) {
+    if (size < 8 || loadBE(data, 8) > maxSize) return false;
+    switch (stage) {
+        case QOIStage::Range: {
+            RangeDecoder decoder(data, size);
+            out.resize((size_t)decoder.size());
+            decoder.read(out.data(), out.size());
+            return true;
+        }
+        case QOIStage::Rans: return ransDecode(data, size, out, maxSize);
+        case QOIStage::Huffman: return huffmanDecode(data, size, out, maxSize);
+        case QOIStage::Lz: return lzDecode(data, size, out, maxSize);
+        case QOIStage::Mix: return mixDecode(data, size, out, maxSize);
+    }
+    return false;
+}
+
+// All stages in order, the result ready to follow the stage list
+inline vector<uint8_t> packStages(const uint8_t* bytes, size_t count, const vector<QOIStage>& stages, uint32_t width = 0) {
+    vector<uint8_t> current(bytes, bytes + count), next;
+    for (QOIStage stage : stages) {
+        next.clear();
+        packStage(stage, current.data(), current.size(), next, width);
+        current.swap(next);
+    }
+    return current;
+}
+
+// Reads the stage list and the stage data that follow the header of a packed file and leaves the original body
+// in body. The outermost stage decodes straight from the file when it is the range coder, so its coded input is
+// never held in full. Returns false on an unknown stage or damaged data.
+inline bool readPackedBody(istream& file, vector<uint8_t>& body, uint64_t maxSize) {
+    uint8_t stageCount = 0;
+    file.read(reinterpret_cast<char*>(&stageCount), 1);
+    vector<uint8_t> ids(stageCount);
+    file.read(reinterpret_cast<char*>(ids.data()), stageCount);
+    if (!file || stageCount == 0) return false;
+    for (uint8_t id : ids)
+        if (!knownStage(id)) {
+            cerr << "Unknown QOI stage " << (int)id << "." << endl;
+            return false;
+        }
+
+    size_t k = stageCount;
+    if ((QOIStage)ids[k - 1] == QOIStage::Range) {
+        RangeDecoder decoder(file);
+        if (decoder.size() > maxSize) return false;
+        body.resize((size_t)decoder.size());
+        decoder.read(body.data(), body.size());
+        k--;
+    }
+    else {
+        body.assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+    }
+
+    vector<uint8_t> inner;
+    while (k-- > 0) {
+        if (!unpackStage((QOIStage)ids[k], body.data(), body.size(), inner, maxSize)) return false;
+        body.swap(inner);
+    }
+    return true;
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <vector>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <memory>
+#include <cstdlib>
+
+using namespace std;
+
+// Persistent worker threads fed from one FIFO queue
+class ThreadPool {
+private:
+    vector<thread> m_workers;
+    queue<function<void()>> m_tasks;
+    mutex m_mutex;
+    condition_variable m_cv;
+    bool m_stopping = false;
+
+    void workerLoop() {
+        while (true) {
+            function<void()> task;
+            {
+                unique_lock<mutex> lock(m_mutex);
+                m_cv.wait(lock, [this] { return m_stopping || !m_tasks.empty(); });
+                if (m_stopping && m_tasks.empty()) return;
+                task = std::move(m_tasks.front());
+                m_tasks.pop();
+            }
+            task();
+        }
+    }
+
+public:
+    explicit ThreadPool(size_t threads) : ThreadPool(threads, nullptr) {}
+
+    // onStart(i) runs first on worker i, e.g. to pin it to a CPU set
+    ThreadPool(size_t threads, function<void(size_t)> onStart) {
+        if (threads == 0) threads = 1;
+        for (size_t i = 0; i < threads; i++) {
+            m_workers.emplace_back([this, onStart, i] {
+                if (onStart) onStart(i);
+                workerLoop();
+            });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            lock_guard<mutex> lock(m_mutex);
+            m_stopping = true;
+        }
+        m_cv.notify_all();
+        for (auto& w : m_workers) w.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t size() const {
+        return m_workers.size();
+    }
+
+    void submit(function<void()> task) {
+        {
+            lock_guard<mutex> lock(m_mutex);
+            m_tasks.push(std::move(task));
+        }
+        m_cv.notify_one();
+    }
+
+    // Runs body(0..count-1) across the pool and blocks until all are done.
+    // The calling thread takes items too, so nesting inside a pool task cannot deadlock.
+    void parallelFor(size_t count, const function<void(size_t)>& body) {
+        if (count == 0) return;
+        if (count == 1) { body(0); return; }
+
+        struct Shared {
+            atomic<size_t> next{0};
+            size_t done = 0;
+            mutex m;
+            condition_variable cv;
+        };
+        auto shared = make_shared<Shared>();
+        const function<void(size_t)>* bodyPtr = &body;
+
+        // helpers only touch body while holding an unfinished item, so it outlives them
+        auto work = [shared, bodyPtr, count] {
+            size_t finished = 0;
+            for (size_t i; (i = shared->next.fetch_add(1)) < count; finished++)
+                (*bodyPtr)(i);
+            if (finished == 0) return;
+            lock_guard<mutex> lock(shared->m);
+            shared->done += finished;
+            if (shared->done == count) shared->cv.notify_all();
+        };
+
+        size_t helpers = min(count - 1, size());
+        for (size_t h = 0; h < helpers; h++) submit(work);
+        work();
+
+        unique_lock<mutex> lock(shared->m);
+        shared->cv.wait(lock, [&] { return shared->done == count; });
+    }
+
+    // Process-wide pool, sized by QOI_THREADS or the hardware thread count
+    static ThreadPool& shared() {
+        static ThreadPool pool([] {
+            const char* env = getenv("QOI_THREADS");
+            long n = env ? atol(env) : 0;
+            if (n > 0) return (size_t)n;
+            return (size_t)max(1u, thread::hardware_concurrency());
+        }());
+        return pool;
+    }
+};
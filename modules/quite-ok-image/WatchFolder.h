@@ -0,0 +1,266 @@
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <cstring>
+
+#include "BatchConverter.h"
+#include "ThreadPool.h"
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+// ----- WATCH FOLDER -----
+// Converts every .bmp that appears in a directory to .qoi in an output directory, as soon as its writer closes
+// it (inotify IN_CLOSE_WRITE, or IN_MOVED_TO for files renamed into place). Events for a file are coalesced
+// until it has been quiet for the debounce interval, and a file whose size does not yet match its BMP header is
+// left for the writer's next close. A file that changes again while it is being converted is converted once
+// more afterwards. The conversions run on a persistent thread pool; files already waiting (or newer than their
+// output) when the watch starts are converted first. Linux only.
+
+struct WatchStats {
+    size_t converted = 0;
+    size_t failed = 0;
+    double totalLatency = 0.0; // seconds from the last close to the output being in place
+    double maxLatency = 0.0;
+};
+
+class WatchFolder {
+private:
+    using Clock = chrono::steady_clock;
+
+    struct Pending {
+        Clock::time_point due;    // end of the debounce interval
+        Clock::time_point closed; // last close event
+    };
+
+    string m_dir;
+    string m_outDir;
+    Clock::duration m_debounce;
+    ThreadPool& m_pool;
+
+    thread m_thread;
+    atomic<bool> m_stopping{false};
+    int m_inotify = -1;
+    int m_wake = -1;
+
+    mutex m_mutex;
+    condition_variable m_idle;
+    unordered_map<string, Pending> m_pending; // file name -> when to convert it
+    unordered_set<string> m_running;
+    unordered_set<string> m_changed;          // running files that were closed again meanwhile
+    size_t m_inFlight = 0;
+    WatchStats m_stats;
+
+    static bool isBMPName(const string& name) {
+        return name.size() > 4 && name[0] != '.' && (name.compare(name.size() - 4, 4, ".bmp") == 0
+                                                     || name.compare(name.size() - 4, 4, ".BMP") == 0);
+    }
+
+    // Whether the file holds as many bytes as its header promises
+    static bool bmpComplete(const string& path) {
+        ifstream file(path, ios::binary);
+        uint8_t header[26] = {};
+        file.read(reinterpret_cast<char*>(header), 26);
+        if (!file) return false;
+        uint32_t dataOffset, width;
+        int32_t height;
+        memcpy(&dataOffset, header + 10, 4);
+        memcpy(&width, header + 18, 4);
+        memcpy(&height, header + 22, 4);
+        file.seekg(0, ios::end);
+        uint64_t expected = dataOffset + (uint64_t)QOIConverter::bmpRowSize(width) * (uint64_t)(height < 0 ? -(int64_t)height : height);
+        return (uint64_t)file.tellg() >= expected;
+    }
+
+    string outputFor(const string& name) const {
+        return m_outDir + "/" + name.substr(0, name.size() - 4) + ".qoi";
+    }
+
+    void wake() {
+#ifdef __linux__
+        uint64_t one = 1;
+        if (write(m_wake, &one, sizeof(one)) < 0) {} // the loop is awake already if the counter is full
+#endif
+    }
+
+    // Queues a file, or pushes its deadline back if it is queued already (m_mutex held)
+    void scheduleLocked(const string& name, Clock::time_point closed) {
+        if (m_running.count(name)) {
+            m_changed.insert(name);
+            return;
+        }
+        m_pending[name] = {closed + m_debounce, closed};
+    }
+
+    // Files without an up-to-date output. Files being converted are only marked changed, as for an event.
+    void scanExisting() {
+        error_code ec;
+        Clock::time_point now = Clock::now();
+        lock_guard<mutex> lock(m_mutex);
+        for (auto& entry : filesystem::directory_iterator(m_dir, ec)) {
+            string name = entry.path().filename().string();
+            if (!entry.is_regular_file(ec) || !isBMPName(name)) continue;
+            auto out = filesystem::path(outputFor(name));
+            if (filesystem::exists(out, ec) && filesystem::last_write_time(out, ec) >= entry.last_write_time(ec)) continue;
+            scheduleLocked(name, now);
+        }
+    }
+
+    void convert(const string& name, Clock::time_point closed) {
+        string input = m_dir + "/" + name;
+        bool complete = bmpComplete(input);
+        bool ok = complete && BatchConverter::convert({input, outputFor(name)}) > 0;
+        double latency = chrono::duration<double>(Clock::now() - closed).count();
+
+        lock_guard<mutex> lock(m_mutex);
+        m_running.erase(name);
+        if (m_changed.erase(name)) scheduleLocked(name, Clock::now());
+        if (complete) { // an incomplete file is picked up again on its writer's next close
+            if (ok) {
+                m_stats.converted++;
+                m_stats.totalLatency += latency;
+                m_stats.maxLatency = max(m_stats.maxLatency, latency);
+            }
+            else m_stats.failed++;
+        }
+        m_inFlight--;
+        m_idle.notify_all();
+        wake();
+    }
+
+#ifdef __linux__
+    void loop() {
+        alignas(inotify_event) char buffer[64 * 1024];
+        while (!m_stopping) {
+            // hand every file whose debounce interval is over to the pool, sleep until the next one is due
+            int timeout = -1;
+            {
+                lock_guard<mutex> lock(m_mutex);
+                Clock::time_point now = Clock::now();
+                for (auto it = m_pending.begin(); it != m_pending.end();) {
+                    if (it->second.due > now) {
+                        auto wait = chrono::ceil<chrono::milliseconds>(it->second.due - now).count();
+                        timeout = (timeout < 0) ? (int)wait : min(timeout, (int)wait);
+                        ++it;
+                        continue;
+                    }
+                    string name = it->first;
+                    Clock::time_point closed = it->second.closed;
+                    it = m_pending.erase(it);
+                    m_running.insert(name);
+                    m_inFlight++;
+                    m_pool.submit([this, name, closed] { convert(name, closed); });
+                }
+            }
+
+            pollfd fds[2] = {{m_inotify, POLLIN, 0}, {m_wake, POLLIN, 0}};
+            if (poll(fds, 2, timeout) < 0) continue;
+            if (fds[1].revents & POLLIN) {
+                uint64_t count;
+                if (read(m_wake, &count, sizeof(count)) < 0) {}
+            }
+            if (!(fds[0].revents & POLLIN)) continue;
+
+            ssize_t length;
+            bool overflow = false;
+            Clock::time_point now = Clock::now();
+            {
+                lock_guard<mutex> lock(m_mutex);
+                while ((length = read(m_inotify, buffer, sizeof(buffer))) > 0) {
+                    for (char* p = buffer; p < buffer + length;) {
+                        const inotify_event* event = reinterpret_cast<const inotify_event*>(p);
+                        p += sizeof(inotify_event) + event->len;
+                        if (event->mask & IN_Q_OVERFLOW) overflow = true;
+                        if (event->len == 0 || (event->mask & IN_ISDIR)) continue;
+                        string name = event->name;
+                        if (isBMPName(name)) scheduleLocked(name, now);
+                    }
+                }
+            }
+            if (overflow) scanExisting(); // events were dropped, look at the whole directory again
+        }
+    }
+#endif
+
+public:
+    WatchFolder(const string& dir, const string& outDir, chrono::milliseconds debounce = chrono::milliseconds(20),
+                ThreadPool& pool = ThreadPool::shared())
+        : m_dir(dir), m_outDir(outDir), m_debounce(debounce), m_pool(pool) {}
+
+    WatchFolder(const WatchFolder&) = delete;
+    WatchFolder& operator=(const WatchFolder&) = delete;
+
+    ~WatchFolder() {
+        stop();
+    }
+
+    // Starts watching, returns false if the directory cannot be watched
+    bool start() {
+#ifdef __linux__
+        if (m_thread.joinable()) return true;
+        m_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        m_wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (m_inotify < 0 || m_wake < 0 || inotify_add_watch(m_inotify, m_dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+            cerr << "Failed to watch " << m_dir << "." << endl;
+            stop();
+            return false;
+        }
+        error_code ec;
+        filesystem::create_directories(m_outDir, ec);
+        m_stopping = false;
+        scanExisting();
+        m_thread = thread([this] { loop(); });
+        return true;
+#else
+        cerr << "Watch folders need inotify (Linux)." << endl;
+        return false;
+#endif
+    }
+
+    // Stops watching and waits for the conversions already handed to the pool; queued files are dropped
+    void stop() {
+        m_stopping = true;
+        if (m_thread.joinable()) {
+            wake();
+            m_thread.join();
+        }
+        {
+            unique_lock<mutex> lock(m_mutex);
+            m_idle.wait(lock, [this] { return m_inFlight == 0; });
+            m_pending.clear();
+        }
+#ifdef __linux__
+        if (m_inotify >= 0) close(m_inotify);
+        if (m_wake >= 0) close(m_wake);
+#endif
+        m_inotify = m_wake = -1;
+    }
+
+    // Blocks until nothing is queued or being converted, or the timeout passes. Returns true if idle.
+    bool waitIdle(chrono::milliseconds timeout) {
+        unique_lock<mutex> lock(m_mutex);
+        return m_idle.wait_for(lock, timeout, [this] { return m_inFlight == 0 && m_pending.empty(); });
+    }
+
+    WatchStats stats() {
+        lock_guard<mutex> lock(m_mutex);
+        return m_stats;
+    }
+};
@@ -0,0 +1,204 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+#include "RGBValue.h"
+#include "QOIKernels.h"
+
+using namespace std;
+
+// ----- WIDE INDEX -----
+// index[64] forgets a color as soon as another with the same hash comes along, which on photos is almost at
+// once: colors that do come back mostly cost a 4-byte QOI_OP_RGB. The extended format can add a second, larger
+// index of 256 to 4096 entries, direct-mapped or 2-way set-associative, behind a 2-byte opcode. It comes on top
+// of the standard 64 slots, whose 1-byte QOI_OP_INDEX stays:
+//   QOI_OP_WIDE_INDEX: tag 0xEE + entry / 256, then entry % 256
+// Its 16 tags are taken from the top of QOI_OP_RUN, which then stops at WIDE_RUN_MAX pixels; longer runs are
+// QOI_OP_LONG_RUN from WIDE_RUN_MAX + 1 on.
+//
+// Every pixel that is not part of a run is looked up by a multiplicative hash of its color, which picks a set.
+// Within a 2-way set the most recent color is kept first: a color already in the set moves to the front, a new
+// one pushes the other out. Entries are packed colors (4 bytes), so a set sits in one cache line and the largest
+// table takes 16 KB, within L1. The encoder prefers the shortest opcode (QOI_OP_INDEX before QOI_OP_LUMA, then
+// QOI_OP_WIDE_INDEX, then QOI_OP_RGB); decoders keep the same table and update it the same way.
+
+const int WIDE_INDEX_MIN_BITS = 8;
+const int WIDE_INDEX_MAX_BITS = 12;
+const uint8_t QOI_OP_WIDE_INDEX = 0b11101110;
+const size_t WIDE_RUN_MAX = 46;
+const uint32_t WIDE_EMPTY = 0xFFFFFFFF; // never a packed color
+
+inline uint32_t packColor(const RGBValue& px) {
+    return (uint32_t)px.red | ((uint32_t)px.green << 8) | ((uint32_t)px.blue << 16);
+}
+
+struct WideIndex {
+    uint32_t entries[1 << WIDE_INDEX_MAX_BITS];
+    uint32_t ways = 1;
+    int setShift = 32;
+
+    // An empty table of 1 << bits entries in sets of ways (1 or 2)
+    void reset(int bits, uint32_t setWays) {
+        ways = setWays;
+        setShift = 32 - bits + (ways == 2 ? 1 : 0);
+        fill(entries, entries + ((size_t)1 << bits), WIDE_EMPTY);
+    }
+
+    uint32_t set(uint32_t color) const {
+        return ((color * 2654435761u) >> setShift) * ways;
+    }
+
+    // Entry holding color, or -1
+    int find(uint32_t color) const {
+        uint32_t s = set(color);
+        if (entries[s] == color) return (int)s;
+        if (ways == 2 && entries[s + 1] == color) return (int)s + 1;
+        return -1;
+    }
+
+    // Records color as the most recent in its set
+    void touch(uint32_t color) {
+        uint32_t* e = entries + set(color);
+        if (e[0] == color) return;
+        if (ways == 2) e[1] = e[0];
+        e[0] = color;
+    }
+};
+
+// Appends the opcode for a run of run pixels
+inline uint8_t* storeWideRun(uint8_t* dst, size_t run) {
+    if (run > WIDE_RUN_MAX) return storeLongRun(dst, run, WIDE_RUN_MAX + 1);
+    *dst++ = (uint8_t)(0b11000000 + run - 1); // (QOI_OP_RUN)
+    return dst;
+}
+
+// encodeClassified() with the wide index next to index; wide has to be reset() with the stream's size
+template <void (*Classify)(const RGBValue*, size_t, uint32_t*)>
+void encodeWide(const RGBValue* pixels, size_t count, RGBValue prevPixel, RGBValue* index, IndexHash indexHash, WideIndex& wide, vector<uint8_t>& out) {
+    if (count == 0) return;
+    const bool descHash = indexHash.isStandard(); // the descriptors carry the spec's hash
+
+    size_t base = out.size();
+    out.resize(base + count*4); // QOI_OP_RGB is the worst case per pixel
+    uint8_t* dst = out.data() + base;
+
+    uint32_t desc[CLASSIFY_BLOCK];
+    size_t runLength = 0;
+
+    for (size_t blockStart = 0; blockStart < count; blockStart += CLASSIFY_BLOCK) {
+        size_t blockSize = min(CLASSIFY_BLOCK, count - blockStart);
+        if (blockStart == 0) {
+            desc[0] = classifyPixel(pixels[0], prevPixel);
+            Classify(pixels + 1, blockSize - 1, desc + 1);
+        } else {
+            Classify(pixels + blockStart, blockSize, desc);
+        }
+
+        for (size_t i = 0; i < blockSize; i++) {
+            uint32_t d = desc[i];
+            uint32_t cls = d & 0b11;
+
+            if (cls == CLASS_SAME) {
+                runLength++;
+                continue;
+            }
+            if (runLength > 0) {
+                dst = storeWideRun(dst, runLength);
+                runLength = 0;
+            }
+
+            const RGBValue& px = pixels[blockStart + i];
+            uint8_t hash = descHash ? (uint8_t)(d >> 24) : indexHash(px);
+            uint32_t color = packColor(px);
+            int entry;
+            if (cls == CLASS_DIFF) {
+                *dst++ = (uint8_t)(d >> 8); // (QOI_OP_DIFF)
+            }
+            else if (!index[hash].isNull && index[hash] == px) {
+                *dst++ = hash; // (QOI_OP_INDEX)
+            }
+            else if (cls == CLASS_LUMA) {
+                *dst++ = (uint8_t)(d >> 8); // (QOI_OP_LUMA)
+                *dst++ = (uint8_t)(d >> 16);
+            }
+            else if ((entry = wide.find(color)) >= 0) {
+                *dst++ = (uint8_t)(QOI_OP_WIDE_INDEX + (entry >> 8)); // (QOI_OP_WIDE_INDEX)
+                *dst++ = (uint8_t)entry;
+            }
+            else { // (QOI_OP_RGB)
+                dst[0] = 0b11111110;
+                dst[1] = px.red;
+                dst[2] = px.green;
+                dst[3] = px.blue;
+                dst += 4;
+            }
+            index[hash] = px;
+            wide.touch(color);
+        }
+    }
+
+    if (runLength > 0) {
+        dst = storeWideRun(dst, runLength);
+    }
+    out.resize(dst - out.data());
+}
+
+// Decodes a stream with the wide index into a buffer for pixelCount pixels, returns the number of pixels
+// written. wide has to be reset() with the stream's size.
+template <void (*Fill)(RGBValue*, RGBValue, size_t)>
+size_t decodeWide(const uint8_t* bytes, size_t count, RGBValue prevPixel, RGBValue* index, IndexHash indexHash, WideIndex& wide, RGBValue* out, size_t pixelCount) {
+    size_t curIdx = 0, outIdx = 0;
+    while (curIdx < count && outIdx < pixelCount) {
+        uint8_t curByte = bytes[curIdx++];
+
+        // QOI_OP_RGB
+        if (curByte == 0b11111110) {
+            if (curIdx + 3 > count) break;
+            prevPixel = RGBValue(bytes[curIdx], bytes[curIdx+1], bytes[curIdx+2]);
+            curIdx += 3;
+        }
+        // QOI_OP_INDEX
+        else if (curByte >> 6 == 0b00) {
+            prevPixel = index[curByte];
+            prevPixel.isNull = false;
+        }
+        // QOI_OP_DIFF
+        else if (curByte >> 6 == 0b01) {
+            int dr = ((curByte >> 4) & 0b11) - 2;
+            int dg = ((curByte >> 2) & 0b11) - 2;
+            int db = (curByte & 0b11) - 2;
+            prevPixel = RGBValue(prevPixel.red + dr, prevPixel.green + dg, prevPixel.blue + db);
+        }
+        // QOI_OP_LUMA
+        else if (curByte >> 6 == 0b10) {
+            if (curIdx >= count) break;
+            uint8_t b2 = bytes[curIdx++];
+            int dg = (curByte & 0b111111) - 32;
+            int dr = ((b2 >> 4) & 0b1111) - 8 + dg;
+            int db = (b2 & 0b1111) - 8 + dg;
+            prevPixel = RGBValue(prevPixel.red + dr, prevPixel.green + dg, prevPixel.blue + db);
+        }
+        // QOI_OP_WIDE_INDEX
+        else if (curByte >= QOI_OP_WIDE_INDEX && curByte != QOI_OP_LONG_RUN) {
+            if (curIdx >= count) break;
+            uint32_t color = wide.entries[((curByte - QOI_OP_WIDE_INDEX) << 8) | bytes[curIdx++]];
+            prevPixel = RGBValue((uint8_t)color, (uint8_t)(color >> 8), (uint8_t)(color >> 16));
+        }
+        // QOI_OP_RUN, QOI_OP_LONG_RUN
+        else {
+            size_t run = (curByte & 0b111111) + 1;
+            if (curByte == QOI_OP_LONG_RUN && !loadLongRun(bytes, count, curIdx, run, WIDE_RUN_MAX + 1)) break;
+            run = min(run, pixelCount - outIdx);
+            Fill(out + outIdx, prevPixel, run);
+            outIdx += run;
+            continue;
+        }
+
+        out[outIdx++] = prevPixel;
+        index[indexHash(prevPixel)] = prevPixel;
+        wide.touch(packColor(prevPixel));
+    }
+    return outIdx;
+}